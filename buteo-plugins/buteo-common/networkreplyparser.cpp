@@ -392,6 +392,201 @@ QList<NetworkReplyParser::Notification> JsonReplyParser::parseNotificationRespon
     return notifs;
 }
 
+//--- PropFindResponseReader:
+
+// Reads a PROPFIND multistatus body token by token, and fills a Resource directly from
+// the response/href/propstat/prop elements, without building an intermediate tree.
+class PropFindResponseReader
+{
+public:
+    // Processes the current token of the reader.
+    // Returns true if the token completed a response entry, which is then available from resource().
+    bool processToken(const QXmlStreamReader &reader)
+    {
+        switch (reader.tokenType()) {
+        case QXmlStreamReader::StartElement:
+            startElement(reader.name());
+            break;
+        case QXmlStreamReader::Characters:
+            if (m_state == InHref || m_state == InProperty) {
+                m_text += reader.text();
+            }
+            break;
+        case QXmlStreamReader::EndElement:
+            return endElement();
+        default:
+            break;
+        }
+        return false;
+    }
+
+    const NetworkReplyParser::Resource &resource() const { return m_resource; }
+    bool isComplete() const { return m_complete; }
+
+private:
+    enum State {
+        Outside,
+        InResponse,
+        InHref,
+        InPropStat,
+        InProp,
+        InProperty
+    };
+
+    // Element depths within the document: <multistatus> is 1, <response> is 2.
+    enum Depth {
+        ResponseDepth = 2,
+        HrefDepth,
+        PropStatDepth = HrefDepth,
+        PropDepth,
+        PropertyDepth
+    };
+
+    void startElement(const QStringRef &name)
+    {
+        ++m_depth;
+
+        if (m_state == Outside) {
+            if (m_depth == ResponseDepth && name == QLatin1String("response")) {
+                m_state = InResponse;
+                m_resource = NetworkReplyParser::Resource();
+            }
+        } else if (m_state == InResponse) {
+            if (m_depth == HrefDepth && name == QLatin1String("href")) {
+                m_state = InHref;
+                m_text.clear();
+            } else if (m_depth == PropStatDepth && name == QLatin1String("propstat")) {
+                m_state = InPropStat;
+            }
+        } else if (m_state == InPropStat) {
+            if (m_depth == PropDepth && name == QLatin1String("prop")) {
+                m_state = InProp;
+            }
+        } else if (m_state == InProp) {
+            if (m_depth == PropertyDepth) {
+                m_state = InProperty;
+                m_property = propertyFromName(name);
+                m_text.clear();
+                if (m_property == ResourceType) {
+                    m_resource.isCollection = false;
+                }
+            }
+        } else if (m_state == InProperty) {
+            if (m_property == ResourceType
+                    && name.compare(QLatin1String("collection"), Qt::CaseInsensitive) == 0) {
+                m_resource.isCollection = true;
+            }
+        }
+    }
+
+    bool endElement()
+    {
+        const int depth = m_depth--;
+        bool responseFinished = false;
+
+        if (m_state == InHref && depth == HrefDepth) {
+            m_state = InResponse;
+            m_resource.href = QString::fromUtf8(QByteArray::fromPercentEncoding(elementText().toUtf8()));
+        } else if (m_state == InProperty && depth == PropertyDepth) {
+            m_state = InProp;
+            setProperty();
+        } else if (m_state == InProp && depth == PropDepth) {
+            m_state = InPropStat;
+        } else if (m_state == InPropStat && depth == PropStatDepth) {
+            m_state = InResponse;
+        } else if (m_state == InResponse && depth == ResponseDepth) {
+            m_state = Outside;
+            responseFinished = true;
+        } else if (depth == 1) {
+            // The root <multistatus> element has been closed.
+            m_complete = true;
+        }
+
+        return responseFinished;
+    }
+
+    enum Property {
+        UnknownProperty,
+        LastModified,
+        ContentType,
+        OwnerId,
+        FileId,
+        ETag,
+        Size,
+        ContentLength,
+        ResourceType
+    };
+
+    static Property propertyFromName(const QStringRef &name)
+    {
+        if (name == QLatin1String("getlastmodified")) {
+            return LastModified;
+        } else if (name == QLatin1String("getcontenttype")) {
+            return ContentType;
+        } else if (name == QLatin1String("owner-id")) {
+            return OwnerId;
+        } else if (name == QLatin1String("fileid")) {
+            return FileId;
+        } else if (name == QLatin1String("getetag")) {
+            return ETag;
+        } else if (name == QLatin1String("size")) {
+            return Size;
+        } else if (name == QLatin1String("getcontentlength")) {
+            return ContentLength;
+        } else if (name == QLatin1String("resourcetype")) {
+            return ResourceType;
+        }
+        return UnknownProperty;
+    }
+
+    QString elementText() const
+    {
+        // whitespace-only text is formatting between elements, not a value.
+        return m_text.trimmed().isEmpty() ? QString() : m_text;
+    }
+
+    void setProperty()
+    {
+        switch (m_property) {
+        case LastModified:
+            m_resource.lastModified = QDateTime::fromString(elementText(), Qt::RFC2822Date);
+            break;
+        case ContentType:
+            m_resource.contentType = elementText();
+            break;
+        case OwnerId:
+            m_resource.ownerId = elementText();
+            break;
+        case FileId:
+            m_resource.fileId = elementText();
+            break;
+        case ETag:
+            m_resource.etag = elementText();
+            break;
+        case Size:
+            m_resource.size = elementText().toInt();
+            break;
+        case ContentLength:
+        {
+            bool ok = false;
+            const qint64 contentLength = elementText().toLongLong(&ok);
+            m_resource.contentLength = ok ? contentLength : -1;
+            break;
+        }
+        case ResourceType:
+        case UnknownProperty:
+            break;
+        }
+    }
+
+    NetworkReplyParser::Resource m_resource;
+    QString m_text;
+    State m_state = Outside;
+    Property m_property = UnknownProperty;
+    int m_depth = 0;
+    bool m_complete = false;
+};
+
 //--- XmlReplyParser:
 
 QVariantMap XmlReplyParser::xmlToVariantMap(QXmlStreamReader &reader)
@@ -456,69 +651,62 @@ QList<NetworkReplyParser::Resource> XmlReplyParser::parsePropFindResponse(const
         </d:multistatus>
     */
 
-    NetworkReplyParser::debugDumpData(QString::fromUtf8(propFindResponse));
+    PropFindReplyParser parser;
+    const QList<NetworkReplyParser::Resource> result = parser.addData(propFindResponse);
+    if (parser.hasError() || !parser.atEnd()) {
+        qWarning() << "PROPFIND response parsing failed:" << parser.errorString();
+    }
+
+    return result;
+}
 
-    QXmlStreamReader reader(propFindResponse);
-    QVariantMap variantMap = XmlReplyParser::xmlToVariantMap(reader);
+//--- PropFindReplyParser:
+
+PropFindReplyParser::PropFindReplyParser()
+    : m_responseReader(new PropFindResponseReader)
+{
+}
 
-    QVariantMap multistatusMap = variantMap.value(QStringLiteral("multistatus")).toMap();
-    QVariantList responses;
+PropFindReplyParser::~PropFindReplyParser()
+{
+}
 
-    QVariant response = multistatusMap.value(QStringLiteral("response"));
-    if (response.type() == QVariant::List) {
-        // multiple directory entries.
-        responses = response.toList();
-    } else {
-        // only one directory entry.
-        responses << response.toMap();
+QList<NetworkReplyParser::Resource> PropFindReplyParser::addData(const QByteArray &data)
+{
+    // Only convert the chunk for the dump if it is going to be printed.
+    if (NetworkReplyParser::debugEnabled) {
+        NetworkReplyParser::debugDumpData(QString::fromUtf8(data));
     }
 
-    // parse the information about each entry (response element)
     QList<NetworkReplyParser::Resource> result;
-    for (const QVariant &rv : responses) {
-        const QVariantMap rmap = rv.toMap();
-        const QString entryHref = QString::fromUtf8(
-                QByteArray::fromPercentEncoding(
-                        rmap.value(QStringLiteral("href")).toMap().value(
-                                XmlElementTextKey).toString().toUtf8()));
-
-        QVariantList propstats;
-        if (rmap.value(QStringLiteral("propstat")).type() == QVariant::List) {
-            propstats = rmap.value(QStringLiteral("propstat")).toList();
-        } else {
-            QVariantMap propstat = rmap.value(QStringLiteral("propstat")).toMap();
-            propstats << propstat;
-        }
-
-        NetworkReplyParser::Resource resource;
-        resource.href = entryHref;
-
-        for (const QVariant &vpropstat : propstats) {
-            const QVariantMap propstat = vpropstat.toMap();
-            const QVariantMap &prop(propstat.value(QStringLiteral("prop")).toMap());
-            for (QVariantMap::ConstIterator it = prop.constBegin(); it != prop.constEnd(); ++it) {
-                const QString &key = it.key();
-
-                if (key == QStringLiteral("getlastmodified")) {
-                    resource.lastModified = QDateTime::fromString(it.value().toMap().value(XmlElementTextKey).toString(), Qt::RFC2822Date);
-                } else if (key == QStringLiteral("getcontenttype")) {
-                    resource.contentType = it.value().toMap().value(XmlElementTextKey).toString();
-                } else if (key == QStringLiteral("owner-id")) {
-                    resource.ownerId = it.value().toMap().value(XmlElementTextKey).toString();
-                } else if (key == QStringLiteral("fileid")) {
-                    resource.fileId = it.value().toMap().value(XmlElementTextKey).toString();
-                } else if (key == QStringLiteral("getetag")) {
-                    resource.etag = it.value().toMap().value(XmlElementTextKey).toString();
-                } else if (key == QStringLiteral("size")) {
-                    resource.size = it.value().toMap().value(XmlElementTextKey).toInt();
-                } else if (key == QStringLiteral("resourcetype")) {
-                    const QStringList resourceTypeKeys = it.value().toMap().keys();
-                    resource.isCollection = resourceTypeKeys.contains(QStringLiteral("collection"), Qt::CaseInsensitive);
-                }
-            }
+    m_reader.addData(data);
+
+    // The reader stops with PrematureEndOfDocumentError once the available data is consumed,
+    // and continues from the same position when more data is added.
+    while (!m_reader.atEnd()) {
+        m_reader.readNext();
+        if (m_responseReader->processToken(m_reader)) {
+            result.append(m_responseReader->resource());
         }
-        result.append(resource);
     }
 
     return result;
 }
+
+bool PropFindReplyParser::hasError() const
+{
+    return m_reader.hasError() && m_reader.error() != QXmlStreamReader::PrematureEndOfDocumentError;
+}
+
+bool PropFindReplyParser::atEnd() const
+{
+    return !hasError() && m_responseReader->isComplete();
+}
+
+QString PropFindReplyParser::errorString() const
+{
+    if (!hasError() && !m_responseReader->isComplete()) {
+        return QStringLiteral("Incomplete multistatus document");
+    }
+    return m_reader.errorString();
+}
@@ -41,8 +41,8 @@
 #include <QVariantMap>
 #include <QDateTime>
 #include <QUrl>
-
-class QXmlStreamReader;
+#include <QScopedPointer>
+#include <QXmlStreamReader>
 
 class NetworkReplyParser
 {
@@ -64,6 +64,7 @@ public:
         QString fileId;
         QString etag;
         int size = 0;
+        qint64 contentLength = -1;  // getcontentlength, or -1 if not reported
         bool isCollection = false;
     };
 
@@ -104,6 +105,31 @@ public:
     static const QString XmlElementTextKey;
 };
 
+class PropFindResponseReader;
+
+// Parses a PROPFIND multistatus reply incrementally, as its data arrives.
+class PropFindReplyParser
+{
+public:
+    PropFindReplyParser();
+    ~PropFindReplyParser();
+
+    // Parses the next chunk of the reply, and returns the response entries it completed.
+    QList<NetworkReplyParser::Resource> addData(const QByteArray &data);
+
+    // Returns true if the reply is malformed. An incomplete reply is not an error.
+    bool hasError() const;
+    // Returns true once the multistatus document has been read completely. Check this when
+    // the reply has finished, as an empty or truncated reply is otherwise not an error.
+    bool atEnd() const;
+    QString errorString() const;
+
+private:
+    Q_DISABLE_COPY(PropFindReplyParser)
+    QXmlStreamReader m_reader;
+    QScopedPointer<PropFindResponseReader> m_responseReader;
+};
+
 class JsonReplyParser
 {
 public:
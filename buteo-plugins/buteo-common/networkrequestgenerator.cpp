@@ -83,6 +83,17 @@ QNetworkReply *NetworkRequestGenerator::sendRequest(const QNetworkRequest &reque
     return reply;
 }
 
+QNetworkReply *NetworkRequestGenerator::sendRequest(const QNetworkRequest &request, const QByteArray &requestType, QIODevice *requestDevice) const
+{
+    if (debugEnabled) {
+        qDebug() << "Sending request:" << requestType << "to:" << request.url().toDisplayString(QUrl::RemoveUserInfo)
+                 << "data:" << request.header(QNetworkRequest::ContentLengthHeader).toLongLong() << "bytes from device";
+    }
+
+    // The device is read as the request is sent, so it must stay open until the reply has finished.
+    return m_networkAccessManager->sendCustomRequest(request, requestType, requestDevice);
+}
+
 QNetworkRequest NetworkRequestGenerator::networkRequest(const QString &path, const QString &contentType, const QByteArray &requestData) const
 {
     const bool isOcsRequest = path.startsWith(QStringLiteral("/ocs/"));
@@ -200,6 +211,7 @@ QNetworkReply *NetworkRequestGenerator::dirListing(const QString &remoteDirPath)
              "<oc:fileid />" \
              "<oc:owner-id />" \
              "<oc:size />" \
+             "<d:getcontentlength />" \
             "</d:prop>" \
         "</d:propfind>";
 
@@ -219,6 +231,17 @@ QNetworkReply *NetworkRequestGenerator::dirCreation(const QString &remoteDirPath
     return sendRequest(request, "MKCOL");
 }
 
+QNetworkReply *NetworkRequestGenerator::dirDeletion(const QString &remoteDirPath)
+{
+    if (Q_UNLIKELY(remoteDirPath.isEmpty())) {
+        qWarning() << "remotePath path empty, aborting";
+        return nullptr;
+    }
+
+    QNetworkRequest request = networkRequest(remoteDirPath);
+    return sendRequest(request, "DELETE");
+}
+
 QNetworkReply *NetworkRequestGenerator::upload(const QString &dataContentType, const QByteArray &data, const QString &remoteDirPath)
 {
     if (Q_UNLIKELY(remoteDirPath.isEmpty())) {
@@ -236,6 +259,84 @@ QNetworkReply *NetworkRequestGenerator::upload(const QString &dataContentType, c
     return sendRequest(request, "PUT", data);
 }
 
+QNetworkReply *NetworkRequestGenerator::upload(const QString &dataContentType, QIODevice *device, const QString &remoteDirPath)
+{
+    if (Q_UNLIKELY(remoteDirPath.isEmpty())) {
+        qWarning() << "remotePath path empty, aborting";
+        return nullptr;
+    }
+
+    if (Q_UNLIKELY(!device || !device->isReadable() || device->isSequential())) {
+        qWarning() << "device not readable, aborting";
+        return nullptr;
+    }
+
+    const qint64 size = device->size() - device->pos();
+    if (Q_UNLIKELY(size <= 0)) {
+        qWarning() << "bytes empty, aborting";
+        return nullptr;
+    }
+
+    // dataContentType may be empty.
+    QNetworkRequest request = networkRequest(remoteDirPath, dataContentType.toUtf8());
+    request.setHeader(QNetworkRequest::ContentLengthHeader, size);
+    return sendRequest(request, "PUT", device);
+}
+
+// Nextcloud chunked upload (v2): the chunks are uploaded into a collection under
+// /remote.php/dav/uploads/<user>/, and then assembled by moving its .file member to the
+// final destination. Every request carries the destination, so that the server can
+// write the chunks directly to the target storage.
+QNetworkReply *NetworkRequestGenerator::chunkedUploadDirCreation(const QString &uploadDirPath, const QString &destinationPath)
+{
+    if (Q_UNLIKELY(uploadDirPath.isEmpty() || destinationPath.isEmpty())) {
+        qWarning() << "upload path empty, aborting";
+        return nullptr;
+    }
+
+    QNetworkRequest request = networkRequest(uploadDirPath);
+    request.setRawHeader("Destination", destinationHeader(destinationPath));
+    return sendRequest(request, "MKCOL");
+}
+
+QNetworkReply *NetworkRequestGenerator::chunkedUploadChunk(QIODevice *device, const QString &chunkPath, const QString &destinationPath, qint64 totalLength)
+{
+    if (Q_UNLIKELY(chunkPath.isEmpty() || destinationPath.isEmpty())) {
+        qWarning() << "upload path empty, aborting";
+        return nullptr;
+    }
+
+    if (Q_UNLIKELY(!device || !device->isReadable() || device->isSequential())) {
+        qWarning() << "device not readable, aborting";
+        return nullptr;
+    }
+
+    QNetworkRequest request = networkRequest(chunkPath);
+    request.setHeader(QNetworkRequest::ContentLengthHeader, device->size() - device->pos());
+    request.setRawHeader("Destination", destinationHeader(destinationPath));
+    request.setRawHeader("OC-Total-Length", QByteArray::number(totalLength));
+    return sendRequest(request, "PUT", device);
+}
+
+QNetworkReply *NetworkRequestGenerator::chunkedUploadAssembly(const QString &uploadDirPath, const QString &destinationPath, qint64 totalLength)
+{
+    if (Q_UNLIKELY(uploadDirPath.isEmpty() || destinationPath.isEmpty())) {
+        qWarning() << "upload path empty, aborting";
+        return nullptr;
+    }
+
+    QNetworkRequest request = networkRequest(uploadDirPath + QStringLiteral("/.file"));
+    request.setRawHeader("Destination", destinationHeader(destinationPath));
+    request.setRawHeader("OC-Total-Length", QByteArray::number(totalLength));
+    request.setRawHeader("Overwrite", "T");
+    return sendRequest(request, "MOVE");
+}
+
+QByteArray NetworkRequestGenerator::destinationHeader(const QString &path) const
+{
+    return networkRequest(path).url().toEncoded(QUrl::RemoveUserInfo);
+}
+
 QNetworkReply *NetworkRequestGenerator::download(const QString &remoteFilePath)
 {
     if (Q_UNLIKELY(remoteFilePath.isEmpty())) {
@@ -247,3 +348,23 @@ QNetworkReply *NetworkRequestGenerator::download(const QString &remoteFilePath)
     request.setRawHeader("Depth", "1");
     return sendRequest(request, "GET");
 }
+
+QNetworkReply *NetworkRequestGenerator::download(const QString &remoteFilePath, qint64 offset, const QString &etag)
+{
+    if (Q_UNLIKELY(remoteFilePath.isEmpty())) {
+        qWarning() << "remotePath path empty, aborting";
+        return nullptr;
+    }
+
+    QNetworkRequest request = networkRequest(remoteFilePath);
+    request.setRawHeader("Depth", "1");
+    if (offset > 0) {
+        // If the file has changed since the etag was read, the server ignores the range
+        // and sends the whole file instead.
+        request.setRawHeader("Range", "bytes=" + QByteArray::number(offset) + '-');
+        if (!etag.isEmpty()) {
+            request.setRawHeader("If-Range", etag.startsWith('"') ? etag.toUtf8() : '"' + etag.toUtf8() + '"');
+        }
+    }
+    return sendRequest(request, "GET");
+}
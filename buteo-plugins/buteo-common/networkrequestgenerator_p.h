@@ -58,8 +58,14 @@ public:
 
     QNetworkReply *dirListing(const QString &remoteDirPath);
     QNetworkReply *dirCreation(const QString &remoteDirPath);
+    QNetworkReply *dirDeletion(const QString &remoteDirPath);
     QNetworkReply *upload(const QString &dataContentType, const QByteArray &data, const QString &remoteDirPath);
+    QNetworkReply *upload(const QString &dataContentType, QIODevice *device, const QString &remoteDirPath);
+    QNetworkReply *chunkedUploadDirCreation(const QString &uploadDirPath, const QString &destinationPath);
+    QNetworkReply *chunkedUploadChunk(QIODevice *device, const QString &chunkPath, const QString &destinationPath, qint64 totalLength);
+    QNetworkReply *chunkedUploadAssembly(const QString &uploadDirPath, const QString &destinationPath, qint64 totalLength);
     QNetworkReply *download(const QString &remoteFilePath);
+    QNetworkReply *download(const QString &remoteFilePath, qint64 offset, const QString &etag);
 
     static bool debugEnabled;
 
@@ -71,7 +77,9 @@ private:
                                    const QString &contentType = QString(),
                                    const QByteArray &requestData = QByteArray()) const;
     QUrl networkRequestUrl(const QString &path);
+    QByteArray destinationHeader(const QString &path) const;
     QNetworkReply *sendRequest(const QNetworkRequest &request, const QByteArray &requestType, const QByteArray &requestData = QByteArray()) const;
+    QNetworkReply *sendRequest(const QNetworkRequest &request, const QByteArray &requestType, QIODevice *requestDevice) const;
 
     QString m_username;
     QString m_password;
@@ -49,6 +49,12 @@
 #include <QtCore/QByteArray>
 #include <QtCore/QStandardPaths>
 #include <QtCore/QMimeDatabase>
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QSet>
+#include <QtCore/QSaveFile>
+#include <QtCore/QTextStream>
+#include <QtCore/QUuid>
+#include <QtCore/QTimer>
 
 #include <QtDBus/QDBusConnection>
 #include <QtDBus/QDBusInterface>
@@ -61,6 +67,97 @@
 #include <Accounts/Account>
 #include <Accounts/Service>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+
+namespace {
+
+// Enough data for QMimeDatabase to match the magic of the backup archive formats.
+const qint64 MimeTypeDetectionSize = 4096;
+
+// Nextcloud requires all chunks except the last one to be at least 5 MiB.
+const qint64 MinimumUploadChunkSize = 5 * 1024 * 1024;
+const qint64 DefaultUploadChunkSize = 10 * 1024 * 1024;
+const qint64 MaximumUploadChunkSize = 1024 * 1024 * 1024;
+const int DefaultMaxActiveChunkUploads = 2;
+const int MaximumMaxActiveChunkUploads = 4;
+const int MaxChunkUploadRetries = 2;
+
+// Nextcloud expires upload collections after a day, so older uploads are not resumed.
+const qint64 MaxPendingUploadAge = 20 * 60 * 60 * 1000;
+
+const int HttpOk = 200;
+const int HttpPartialContent = 206;
+const int HttpNotFound = 404;
+const int HttpRangeNotSatisfiable = 416;
+
+const int DownloadBufferSize = 64 * 1024;
+const qint64 DownloadCheckpointInterval = 4 * 1024 * 1024;
+const int MaxDownloadRetries = 3;
+const int DownloadRetryDelay = 2000; // ms, doubled on each retry
+
+// Reads a range of a file, so that a chunk can be streamed without copying it to memory.
+class FileChunkDevice : public QIODevice
+{
+public:
+    FileChunkDevice(const QString &filePath, qint64 offset, qint64 length, QObject *parent = nullptr)
+        : QIODevice(parent)
+        , m_file(filePath)
+        , m_offset(offset)
+        , m_length(length)
+    {
+    }
+
+    bool open(OpenMode mode) override
+    {
+        if (mode != QIODevice::ReadOnly
+                || !m_file.open(QFile::ReadOnly)
+                || !m_file.seek(m_offset)) {
+            setErrorString(m_file.errorString());
+            return false;
+        }
+        return QIODevice::open(mode);
+    }
+
+    void close() override
+    {
+        m_file.close();
+        QIODevice::close();
+    }
+
+    bool isSequential() const override { return false; }
+    qint64 size() const override { return m_length; }
+
+    bool seek(qint64 pos) override
+    {
+        if (pos > m_length || !m_file.seek(m_offset + pos)) {
+            return false;
+        }
+        return QIODevice::seek(pos);
+    }
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override
+    {
+        const qint64 remaining = m_length - (m_file.pos() - m_offset);
+        return remaining > 0 ? m_file.read(data, qMin(maxSize, remaining)) : 0;
+    }
+
+    qint64 writeData(const char *, qint64) override
+    {
+        return -1;
+    }
+
+private:
+    QFile m_file;
+    qint64 m_offset;
+    qint64 m_length;
+};
+
+}
+
 Syncer::Syncer(QObject *parent, Buteo::SyncProfile *syncProfile, Syncer::Operation operation)
     : WebDavSyncer(parent, syncProfile, QStringLiteral("nextcloud-backup"))
     , m_sailfishBackup(new QDBusInterface("org.sailfishos.backup", "/sailfishbackup", "org.sailfishos.backup", QDBusConnection::sessionBus(), this))
@@ -97,18 +194,27 @@ void Syncer::beginSync()
     switch (m_operation) {
     case Backup:
     {
-        QDBusReply<QString> createBackupReply =
-                m_sailfishBackup->call("createBackupForSyncProfile", m_syncProfile->name());
-        if (!createBackupReply.isValid() || createBackupReply.value().isEmpty()) {
-            WebDavSyncer::finishWithError("Call to createBackupForSyncProfile() failed: "
-                                          + createBackupReply.error().name()
-                                          + createBackupReply.error().message());
-            return;
+        const qint64 chunkSize = m_syncProfile->key(QStringLiteral("upload_chunk_size")).toLongLong();
+        m_uploadChunkSize = chunkSize > 0
+                ? qBound(MinimumUploadChunkSize, chunkSize, MaximumUploadChunkSize)
+                : DefaultUploadChunkSize;
+        const int maxActiveChunks = m_syncProfile->key(QStringLiteral("upload_parallel_chunks")).toInt();
+        m_maxActiveChunkUploads = maxActiveChunks > 0
+                ? qMin(maxActiveChunks, MaximumMaxActiveChunkUploads)
+                : DefaultMaxActiveChunkUploads;
+
+        if (loadPendingUpload()) {
+            // Finish the upload of the backup left behind by an earlier sync first.
+            qCDebug(lcNextcloud) << "Resuming upload of" << m_pendingUpload.localFilePath;
+            m_resumingPendingUpload = true;
+            m_localFileInfo = QFileInfo(m_pendingUpload.localFilePath);
+            if (!performDirListingRequest(m_remoteBackupDirPath)) {
+                WebDavSyncer::finishWithError("Directory list request failed");
+            }
+            break;
         }
 
-        // Save the file path, then wait for org.sailfish.backup service to finish creating the
-        // backup before continuing in cloudBackupStatusChanged().
-        m_localFileInfo = QFileInfo(createBackupReply.value());
+        createBackup();
         break;
     }
     case BackupQuery:
@@ -135,6 +241,23 @@ void Syncer::beginSync()
     }
 }
 
+bool Syncer::createBackup()
+{
+    QDBusReply<QString> createBackupReply =
+            m_sailfishBackup->call("createBackupForSyncProfile", m_syncProfile->name());
+    if (!createBackupReply.isValid() || createBackupReply.value().isEmpty()) {
+        WebDavSyncer::finishWithError("Call to createBackupForSyncProfile() failed: "
+                                      + createBackupReply.error().name()
+                                      + createBackupReply.error().message());
+        return false;
+    }
+
+    // Save the file path, then wait for org.sailfish.backup service to finish creating the
+    // backup before continuing in cloudBackupStatusChanged().
+    m_localFileInfo = QFileInfo(createBackupReply.value());
+    return true;
+}
+
 void Syncer::cloudBackupStatusChanged(int accountId, const QString &status)
 {
     if (accountId != m_accountId) {
@@ -244,6 +367,10 @@ bool Syncer::performDirListingRequest(const QString &remoteDirPath)
     QNetworkReply *reply = m_requestGenerator->dirListing(remoteDirPath);
     if (reply) {
         reply->setProperty("remoteDirPath", remoteDirPath);
+        m_dirListingParser.reset(new PropFindReplyParser);
+        m_remoteFiles.clear();
+        connect(reply, &QNetworkReply::readyRead,
+                this, &Syncer::handleDirListingData);
         connect(reply, &QNetworkReply::finished,
                 this, &Syncer::handleDirListingReply);
         return true;
@@ -252,14 +379,45 @@ bool Syncer::performDirListingRequest(const QString &remoteDirPath)
     return false;
 }
 
+void Syncer::handleDirListingData()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    if (m_operation == Backup || !m_dirListingParser
+            || reply->error() != QNetworkReply::NoError) {
+        // The listing contents are only needed to find existing backups.
+        return;
+    }
+
+    const QList<NetworkReplyParser::Resource> resourceList = m_dirListingParser->addData(reply->readAll());
+    for (const NetworkReplyParser::Resource &resource : resourceList) {
+        qCDebug(lcNextcloud) << "Found remote file or dir:" << resource.href;
+        if (!resource.isCollection) {
+            m_remoteFiles.append(resource);
+        }
+    }
+}
+
 void Syncer::handleDirListingReply()
 {
     QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
     reply->deleteLater();
-    const QByteArray replyData = reply->readAll();
     const int httpCode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
     const QString remoteDirPath = reply->property("remoteDirPath").toString();
 
+    if (reply->error() == QNetworkReply::NoError && m_operation != Backup) {
+        // Parse whatever was received after the last readyRead().
+        handleDirListingData();
+        if (m_dirListingParser->hasError() || !m_dirListingParser->atEnd()) {
+            // A truncated listing would miss existing backups.
+            qCWarning(lcNextcloud) << "Failed to parse directory listing for" << remoteDirPath
+                                   << ":" << m_dirListingParser->errorString();
+            m_dirListingParser.reset();
+            WebDavSyncer::finishWithError("Failed to parse directory listing");
+            return;
+        }
+    }
+    m_dirListingParser.reset();
+
     bool dirNotFound = (httpCode == 404);
     if (m_operation == Backup && dirNotFound) {
         // Remote backup directory doesn't exist, so create it.
@@ -287,13 +445,9 @@ void Syncer::handleDirListingReply()
     }
 
     if (m_operation == BackupQuery) {
-        const QList<NetworkReplyParser::Resource> resourceList = XmlReplyParser::parsePropFindResponse(replyData);
         QStringList fileNames;
-        for (const NetworkReplyParser::Resource &resource : resourceList) {
-            qCDebug(lcNextcloud) << "Found remote file or dir:" << resource.href;
-            if (!resource.isCollection) {
-                fileNames.append(resource.href.toUtf8());
-            }
+        for (const NetworkReplyParser::Resource &resource : m_remoteFiles) {
+            fileNames.append(resource.href.toUtf8());
         }
 
         QDBusReply<void> setCloudBackupsReply =
@@ -312,15 +466,13 @@ void Syncer::handleDirListingReply()
 
     } else if (m_operation == BackupRestore) {
         bool fileFound = false;
-        const QList<NetworkReplyParser::Resource> resourceList = XmlReplyParser::parsePropFindResponse(replyData);
-        for (const NetworkReplyParser::Resource &resource : resourceList) {
-            if (!resource.isCollection) {
-                int lastDirSep = resource.href.lastIndexOf('/');
-                const QString fileName = resource.href.mid(lastDirSep + 1);
-                if (fileName == m_localFileInfo.fileName()) {
-                    fileFound = true;
-                    break;
-                }
+        for (const NetworkReplyParser::Resource &resource : m_remoteFiles) {
+            int lastDirSep = resource.href.lastIndexOf('/');
+            const QString fileName = resource.href.mid(lastDirSep + 1);
+            if (fileName == m_localFileInfo.fileName()) {
+                fileFound = true;
+                m_restoreDownload.etag = resource.etag;
+                break;
             }
         }
         if (fileFound) {
@@ -345,19 +497,29 @@ bool Syncer::performUploadRequest(const QString &fileName)
     }
 
     const QString localFilePath = m_localFileInfo.dir().absoluteFilePath(fileName);
-    QFile file(localFilePath);
-    if (!file.open(QFile::ReadOnly)) {
-        qCWarning(lcNextcloud) << "Cannot open local file to be uploaded:" << file.fileName();
+    const QString remotePath = m_remoteBackupDirPath + '/' + fileName;
+    if (QFileInfo(localFilePath).size() > m_uploadChunkSize) {
+        if (!davUserId().isEmpty()) {
+            return performChunkedUploadRequest(localFilePath, remotePath);
+        }
+        qCWarning(lcNextcloud) << "Cannot find the DAV user id in" << m_webdavPath << ", uploading without chunks";
+    }
+
+    QFile *file = new QFile(localFilePath);
+    if (!file->open(QFile::ReadOnly)) {
+        qCWarning(lcNextcloud) << "Cannot open local file to be uploaded:" << file->fileName();
+        delete file;
         return false;
     }
+
+    // Only the start of the file is needed to detect its type, the rest is streamed
+    // from disk as the request is sent.
     QMimeDatabase mimeDb;
-    QMimeType mimeType = mimeDb.mimeTypeForData(&file);
-    const QByteArray fileData = file.readAll();
-    file.close();
+    const QMimeType mimeType = mimeDb.mimeTypeForData(file->peek(MimeTypeDetectionSize));
 
-    const QString remotePath = m_remoteBackupDirPath + '/' + fileName;
-    QNetworkReply *reply = m_requestGenerator->upload(mimeType.name(), fileData, remotePath);
+    QNetworkReply *reply = m_requestGenerator->upload(mimeType.name(), file, remotePath);
     if (reply) {
+        file->setParent(reply); // keep the file open until the reply is deleted.
         connect(reply, &QNetworkReply::uploadProgress,
                 this, &Syncer::handleUploadProgress);
         connect(reply, &QNetworkReply::finished,
@@ -365,6 +527,7 @@ bool Syncer::performUploadRequest(const QString &fileName)
         return true;
     }
 
+    delete file;
     return false;
 }
 
@@ -384,9 +547,463 @@ void Syncer::handleUploadReply()
         return;
     }
 
+    finishUpload();
+}
+
+bool Syncer::performChunkedUploadRequest(const QString &localFilePath, const QString &remoteFilePath)
+{
+    // Keep the backup, and the id of its upload collection, until the upload has finished.
+    if (!savePendingUpload(localFilePath)) {
+        qCWarning(lcNextcloud) << "Cannot save upload state, the upload cannot be resumed in a later sync";
+    }
+
+    // The uploads collection lives next to the files collection of the WebDAV path,
+    // e.g. /remote.php/dav/files/<uid> => /remote.php/dav/uploads/<uid>
+    const int davIndex = m_webdavPath.indexOf(QStringLiteral("/remote.php/"));
+    const QString davPrefix = davIndex > 0 ? m_webdavPath.left(davIndex) : QString();
+    const QByteArray profileKey = QStringLiteral("%1|%2")
+            .arg(m_remoteBackupDirPath, m_syncProfile->name()).toUtf8();
+
+    const QFileInfo fileInfo(localFilePath);
+    m_chunkedUpload = ChunkedUpload();
+    m_chunkedUpload.localFilePath = localFilePath;
+    m_chunkedUpload.remoteFilePath = remoteFilePath;
+    m_chunkedUpload.uploadsDirPath = QStringLiteral("%1/remote.php/dav/uploads/%2").arg(davPrefix, davUserId());
+    m_chunkedUpload.uploadDirPrefix = QStringLiteral("sailfish-backup-%1-")
+            .arg(QString::fromLatin1(QCryptographicHash::hash(profileKey, QCryptographicHash::Sha1).toHex().left(16)));
+    m_chunkedUpload.uploadDirPath = QStringLiteral("%1/%2%3").arg(m_chunkedUpload.uploadsDirPath,
+                                                                  m_chunkedUpload.uploadDirPrefix,
+                                                                  m_pendingUpload.uploadId);
+    m_chunkedUpload.fileSize = fileInfo.size();
+    m_chunkedUpload.chunkSize = m_uploadChunkSize;
+    m_chunkedUpload.chunkCount = (fileInfo.size() + m_uploadChunkSize - 1) / m_uploadChunkSize;
+
+    qCDebug(lcNextcloud) << "Uploading" << localFilePath << "in" << m_chunkedUpload.chunkCount
+                         << "chunks via" << m_chunkedUpload.uploadDirPath;
+
+    // Look for the upload collection, and for ones left behind by earlier backups.
+    QNetworkReply *reply = performUploadDirListingRequest(m_chunkedUpload.uploadsDirPath);
+    if (reply) {
+        connect(reply, &QNetworkReply::finished,
+                this, &Syncer::handleUploadsDirListingReply);
+        return true;
+    }
+
+    return false;
+}
+
+// The DAV user id, which differs from the login name for e.g. e-mail and LDAP logins,
+// is the last segment of a /remote.php/dav/files/<uid> WebDAV path.
+QString Syncer::davUserId() const
+{
+    const QString filesPath = QStringLiteral("/remote.php/dav/files/");
+    const int filesIndex = m_webdavPath.indexOf(filesPath);
+    return filesIndex < 0
+            ? QString()
+            : m_webdavPath.mid(filesIndex + filesPath.length()).section(QLatin1Char('/'), 0, 0);
+}
+
+QNetworkReply *Syncer::performUploadDirListingRequest(const QString &remoteDirPath)
+{
+    QNetworkReply *reply = m_requestGenerator->dirListing(remoteDirPath);
+    if (reply) {
+        m_dirListingParser.reset(new PropFindReplyParser);
+        m_chunkedUpload.listedResources.clear();
+        connect(reply, &QNetworkReply::readyRead,
+                this, &Syncer::handleUploadDirListingData);
+    }
+
+    return reply;
+}
+
+void Syncer::handleUploadDirListingData()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    if (!m_dirListingParser || reply->error() != QNetworkReply::NoError) {
+        return;
+    }
+
+    m_chunkedUpload.listedResources.append(m_dirListingParser->addData(reply->readAll()));
+}
+
+// Returns the complete listing, or false if the reply ended before the multistatus document did.
+bool Syncer::readUploadDirListing(QNetworkReply *reply, QList<NetworkReplyParser::Resource> *resources)
+{
+    // Parse whatever was received after the last readyRead().
+    m_chunkedUpload.listedResources.append(m_dirListingParser->addData(reply->readAll()));
+    const bool complete = !m_dirListingParser->hasError() && m_dirListingParser->atEnd();
+    if (!complete) {
+        qCWarning(lcNextcloud) << "Failed to parse upload dir listing for" << reply->url().path()
+                               << ":" << m_dirListingParser->errorString();
+    }
+
+    m_dirListingParser.reset();
+    *resources = m_chunkedUpload.listedResources;
+    m_chunkedUpload.listedResources.clear();
+    return complete;
+}
+
+void Syncer::handleUploadsDirListingReply()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    reply->deleteLater();
+
+    QList<NetworkReplyParser::Resource> resourceList;
+    if (reply->error() != QNetworkReply::NoError) {
+        // Stale uploads are only cleaned up here, so carry on with the upload itself.
+        qCWarning(lcNextcloud) << "Uploads dir listing failed:" << reply->errorString();
+        m_dirListingParser.reset();
+    } else if (!readUploadDirListing(reply, &resourceList)) {
+        // Only delete upload dirs that a complete listing shows.
+        resourceList.clear();
+    }
+
+    // Uploads of earlier backups of this profile are not resumed, so delete them.
+    const QString uploadDirName = m_chunkedUpload.uploadDirPrefix + m_pendingUpload.uploadId;
+    for (const NetworkReplyParser::Resource &resource : resourceList) {
+        if (!resource.isCollection) {
+            continue;
+        }
+        QString dirName = resource.href;
+        while (dirName.endsWith('/')) {
+            dirName.chop(1);
+        }
+        dirName = dirName.mid(dirName.lastIndexOf('/') + 1);
+        if (dirName.startsWith(m_chunkedUpload.uploadDirPrefix) && dirName != uploadDirName) {
+            qCDebug(lcNextcloud) << "Deleting stale upload dir" << dirName;
+            QNetworkReply *deletionReply = m_requestGenerator->dirDeletion(m_chunkedUpload.uploadsDirPath + '/' + dirName);
+            if (deletionReply) {
+                connect(deletionReply, &QNetworkReply::finished,
+                        this, &Syncer::handleStaleUploadDeletionReply);
+            }
+        }
+    }
+
+    if (!performChunkedUploadDirListingRequest()) {
+        WebDavSyncer::finishWithError("Upload dir listing request failed");
+    }
+}
+
+void Syncer::handleStaleUploadDeletionReply()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    reply->deleteLater();
+
+    if (reply->error() != QNetworkReply::NoError) {
+        qCWarning(lcNextcloud) << "Failed to delete stale upload dir:" << reply->errorString();
+    }
+}
+
+bool Syncer::performChunkedUploadDirListingRequest()
+{
+    // Find out which chunks are already on the server.
+    QNetworkReply *reply = performUploadDirListingRequest(m_chunkedUpload.uploadDirPath);
+    if (reply) {
+        connect(reply, &QNetworkReply::finished,
+                this, &Syncer::handleChunkedUploadDirListingReply);
+        return true;
+    }
+
+    return false;
+}
+
+void Syncer::handleChunkedUploadDirListingReply()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    reply->deleteLater();
+    const int httpCode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+
+    if (httpCode == HttpNotFound) {
+        // Nothing uploaded yet, or the server has expired the earlier upload.
+        m_dirListingParser.reset();
+        QNetworkReply *creationReply = m_requestGenerator->chunkedUploadDirCreation(
+                    m_chunkedUpload.uploadDirPath, m_chunkedUpload.remoteFilePath);
+        if (!creationReply) {
+            WebDavSyncer::finishWithError("Upload dir creation request failed");
+            return;
+        }
+        connect(creationReply, &QNetworkReply::finished,
+                this, &Syncer::handleChunkedUploadDirCreationReply);
+        return;
+    }
+
+    if (reply->error() != QNetworkReply::NoError) {
+        m_dirListingParser.reset();
+        WebDavSyncer::finishWithHttpError("Upload dir listing failed", httpCode);
+        return;
+    }
+
+    // A truncated listing would miss uploaded chunks, or report missing ones as uploaded.
+    QList<NetworkReplyParser::Resource> resourceList;
+    if (!readUploadDirListing(reply, &resourceList)) {
+        WebDavSyncer::finishWithError("Failed to parse upload dir listing");
+        return;
+    }
+
+    // Chunks are only visible once the server has received them completely, but
+    // check the size in case the chunk size has been changed since. Nodes in the
+    // uploads collection report getcontentlength, not oc:size.
+    QSet<int> uploadedChunks;
+    for (const NetworkReplyParser::Resource &resource : resourceList) {
+        if (!resource.isCollection) {
+            bool ok = false;
+            const int chunkNumber = resource.href.mid(resource.href.lastIndexOf('/') + 1).toInt(&ok);
+            if (ok && chunkNumber >= 1 && chunkNumber <= m_chunkedUpload.chunkCount
+                    && resource.contentLength == m_chunkedUpload.chunkLength(chunkNumber)) {
+                uploadedChunks.insert(chunkNumber);
+            }
+        }
+    }
+
+    for (int chunkNumber = 1; chunkNumber <= m_chunkedUpload.chunkCount; ++chunkNumber) {
+        if (!uploadedChunks.contains(chunkNumber)) {
+            m_chunkedUpload.pendingChunks.append(chunkNumber);
+        }
+    }
+
+    qCDebug(lcNextcloud) << "Resuming upload," << uploadedChunks.count() << "of"
+                         << m_chunkedUpload.chunkCount << "chunks already uploaded";
+
+    if (!performPendingChunkUploads()) {
+        abortChunkUploads();
+        WebDavSyncer::finishWithError("Chunk upload request failed");
+    }
+}
+
+void Syncer::handleChunkedUploadDirCreationReply()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    reply->deleteLater();
+    const int httpCode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+
+    if (reply->error() != QNetworkReply::NoError) {
+        WebDavSyncer::finishWithHttpError("Upload dir creation failed", httpCode);
+        return;
+    }
+
+    for (int chunkNumber = 1; chunkNumber <= m_chunkedUpload.chunkCount; ++chunkNumber) {
+        m_chunkedUpload.pendingChunks.append(chunkNumber);
+    }
+
+    if (!performPendingChunkUploads()) {
+        abortChunkUploads();
+        WebDavSyncer::finishWithError("Chunk upload request failed");
+    }
+}
+
+bool Syncer::performPendingChunkUploads()
+{
+    if (m_chunkedUpload.pendingChunks.isEmpty() && m_chunkedUpload.activeChunkReplies.isEmpty()) {
+        // All chunks are on the server, so assemble the file.
+        QNetworkReply *reply = m_requestGenerator->chunkedUploadAssembly(
+                    m_chunkedUpload.uploadDirPath, m_chunkedUpload.remoteFilePath, m_chunkedUpload.fileSize);
+        if (!reply) {
+            return false;
+        }
+        connect(reply, &QNetworkReply::finished,
+                this, &Syncer::handleChunkedUploadAssemblyReply);
+        return true;
+    }
+
+    while (m_chunkedUpload.activeChunkReplies.count() < m_maxActiveChunkUploads
+           && !m_chunkedUpload.pendingChunks.isEmpty()) {
+        const int chunkNumber = m_chunkedUpload.pendingChunks.takeFirst();
+        FileChunkDevice *device = new FileChunkDevice(m_chunkedUpload.localFilePath,
+                                                      m_chunkedUpload.chunkOffset(chunkNumber),
+                                                      m_chunkedUpload.chunkLength(chunkNumber));
+        if (!device->open(QIODevice::ReadOnly)) {
+            qCWarning(lcNextcloud) << "Cannot open local file to be uploaded:" << m_chunkedUpload.localFilePath
+                                   << device->errorString();
+            delete device;
+            return false;
+        }
+
+        // Chunk names must sort in upload order.
+        const QString chunkPath = QStringLiteral("%1/%2").arg(m_chunkedUpload.uploadDirPath)
+                                                          .arg(chunkNumber, 5, 10, QLatin1Char('0'));
+        QNetworkReply *reply = m_requestGenerator->chunkedUploadChunk(
+                    device, chunkPath, m_chunkedUpload.remoteFilePath, m_chunkedUpload.fileSize);
+        if (!reply) {
+            delete device;
+            return false;
+        }
+
+        device->setParent(reply); // keep the file open until the reply is deleted.
+        reply->setProperty("chunkNumber", chunkNumber);
+        connect(reply, &QNetworkReply::finished,
+                this, &Syncer::handleChunkUploadReply);
+        m_chunkedUpload.activeChunkReplies.insert(reply);
+    }
+
+    return true;
+}
+
+void Syncer::handleChunkUploadReply()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    reply->deleteLater();
+    m_chunkedUpload.activeChunkReplies.remove(reply);
+
+    if (m_chunkedUpload.failed || m_syncAborted) {
+        // The sync has already finished, ignore the remaining replies.
+        return;
+    }
+
+    const int httpCode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    const int chunkNumber = reply->property("chunkNumber").toInt();
+
+    if (reply->error() != QNetworkReply::NoError) {
+        int &retries = m_chunkedUpload.chunkRetries[chunkNumber];
+        if (retries++ < MaxChunkUploadRetries) {
+            qCWarning(lcNextcloud) << "Upload of chunk" << chunkNumber << "failed, retrying:" << reply->errorString();
+            m_chunkedUpload.pendingChunks.prepend(chunkNumber);
+        } else {
+            // The uploaded chunks are kept on the server, so that the next sync can resume.
+            abortChunkUploads();
+            WebDavSyncer::finishWithHttpError("Chunk upload failed", httpCode);
+            return;
+        }
+    } else {
+        qCDebug(lcNextcloud) << "Uploaded chunk" << chunkNumber << "of" << m_chunkedUpload.chunkCount;
+    }
+
+    if (!performPendingChunkUploads()) {
+        abortChunkUploads();
+        WebDavSyncer::finishWithError("Chunk upload request failed");
+    }
+}
+
+void Syncer::abortChunkUploads()
+{
+    m_chunkedUpload.failed = true;
+
+    // Aborting emits finished(), which removes the reply from the active set.
+    const QSet<QNetworkReply *> activeReplies = m_chunkedUpload.activeChunkReplies;
+    for (QNetworkReply *reply : activeReplies) {
+        reply->abort();
+    }
+}
+
+void Syncer::handleChunkedUploadAssemblyReply()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    reply->deleteLater();
+    const int httpCode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+
+    if (reply->error() != QNetworkReply::NoError) {
+        if (httpCode >= 400 && httpCode < 500) {
+            // The server rejected the uploaded chunks, so start over in the next sync.
+            removePendingUpload();
+        }
+        WebDavSyncer::finishWithHttpError("Upload assembly failed", httpCode);
+        return;
+    }
+
+    finishUpload();
+}
+
+void Syncer::finishUpload()
+{
+    removePendingUpload();
+
+    if (m_resumingPendingUpload) {
+        // The backup left behind by an earlier sync is now on the server, so delete
+        // it and continue with a new backup.
+        m_resumingPendingUpload = false;
+        cleanUp();
+        createBackup();
+        return;
+    }
+
     WebDavSyncer::finishWithSuccess();
 }
 
+QString Syncer::pendingUploadStatePath() const
+{
+    return QStringLiteral("%1/system/privileged/Backups/nextcloud-upload-%2.state")
+            .arg(QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation),
+                 m_syncProfile->name());
+}
+
+bool Syncer::loadPendingUpload()
+{
+    m_pendingUpload = PendingUpload();
+
+    QFile stateFile(pendingUploadStatePath());
+    if (!stateFile.open(QFile::ReadOnly)) {
+        return false;
+    }
+
+    PendingUpload upload;
+    QTextStream stream(&stateFile);
+    upload.uploadId = stream.readLine();
+    upload.localFilePath = stream.readLine();
+    upload.fileSize = stream.readLine().toLongLong();
+    upload.lastModified = stream.readLine().toLongLong();
+    upload.created = stream.readLine().toLongLong();
+    stateFile.close();
+
+    const QFileInfo fileInfo(upload.localFilePath);
+    const bool fileUnchanged = !upload.localFilePath.isEmpty()
+            && fileInfo.exists()
+            && fileInfo.size() == upload.fileSize
+            && fileInfo.lastModified().toMSecsSinceEpoch() == upload.lastModified;
+    const qint64 age = QDateTime::currentMSecsSinceEpoch() - upload.created;
+    if (upload.isValid() && fileUnchanged && age >= 0 && age < MaxPendingUploadAge) {
+        m_pendingUpload = upload;
+        return true;
+    }
+
+    // Only delete the backup if it is still the one which was being uploaded. Its upload
+    // collection is deleted when the next chunked upload starts.
+    qCDebug(lcNextcloud) << "Discarding stale upload of" << upload.localFilePath;
+    if (fileUnchanged) {
+        QFile::remove(fileInfo.absoluteFilePath());
+        QDir().rmdir(fileInfo.absolutePath());
+    }
+    QFile::remove(stateFile.fileName());
+    return false;
+}
+
+bool Syncer::savePendingUpload(const QString &localFilePath)
+{
+    const QFileInfo fileInfo(localFilePath);
+    if (!m_pendingUpload.isValid() || m_pendingUpload.localFilePath != fileInfo.absoluteFilePath()) {
+        m_pendingUpload = PendingUpload();
+        m_pendingUpload.uploadId = QUuid::createUuid().toString().mid(1, 36);
+        m_pendingUpload.localFilePath = fileInfo.absoluteFilePath();
+        m_pendingUpload.created = QDateTime::currentMSecsSinceEpoch();
+    }
+    m_pendingUpload.fileSize = fileInfo.size();
+    m_pendingUpload.lastModified = fileInfo.lastModified().toMSecsSinceEpoch();
+
+    const QString statePath = pendingUploadStatePath();
+    if (!QDir().mkpath(QFileInfo(statePath).absolutePath())) {
+        return false;
+    }
+
+    QSaveFile stateFile(statePath);
+    if (!stateFile.open(QFile::WriteOnly)) {
+        return false;
+    }
+    QTextStream stream(&stateFile);
+    stream << m_pendingUpload.uploadId << '\n'
+           << m_pendingUpload.localFilePath << '\n'
+           << m_pendingUpload.fileSize << '\n'
+           << m_pendingUpload.lastModified << '\n'
+           << m_pendingUpload.created << '\n';
+    stream.flush();
+    return stateFile.commit();
+}
+
+void Syncer::removePendingUpload()
+{
+    if (m_pendingUpload.isValid()) {
+        QFile::remove(pendingUploadStatePath());
+        m_pendingUpload = PendingUpload();
+    }
+}
+
 bool Syncer::performDownloadRequest(const QString &fileName)
 {
     if (fileName.isEmpty()) {
@@ -394,21 +1011,62 @@ bool Syncer::performDownloadRequest(const QString &fileName)
         return false;
     }
 
-    const QString localFilePath = m_localFileInfo.dir().absoluteFilePath(fileName);
+    m_restoreDownload.remoteFilePath = m_remoteBackupDirPath + '/' + fileName;
+    m_restoreDownload.filePath = m_localFileInfo.dir().absoluteFilePath(fileName);
+    m_restoreDownload.offset = 0;
+    m_restoreDownload.retries = 0;
+
+    // Continue an earlier download if it was for the same version of the remote file.
+    QFile checkpointFile(m_restoreDownload.checkpointFilePath());
+    if (!m_restoreDownload.etag.isEmpty() && checkpointFile.open(QFile::ReadOnly)) {
+        QTextStream stream(&checkpointFile);
+        const QString etag = stream.readLine();
+        const qint64 bytes = stream.readLine().toLongLong();
+        if (etag == m_restoreDownload.etag
+                && bytes > 0
+                && QFileInfo(m_restoreDownload.partialFilePath()).size() >= bytes) {
+            qCDebug(lcNextcloud) << "Resuming download of" << fileName << "from" << bytes << "bytes";
+            m_restoreDownload.offset = bytes;
+        }
+    }
+
+    return startDownload();
+}
+
+bool Syncer::startDownload()
+{
     if (m_downloadedFile) {
         delete m_downloadedFile;
     }
-    m_downloadedFile = new QFile(localFilePath);
-    if (!m_downloadedFile->open(QFile::WriteOnly)) {
+    m_downloadedFile = new QFile(m_restoreDownload.partialFilePath());
+    if (!m_downloadedFile->open(QFile::ReadWrite)
+            || !m_downloadedFile->seek(m_restoreDownload.offset)) {
         qCWarning(lcNextcloud) << "Cannot open file for writing: " + m_downloadedFile->fileName();
         delete m_downloadedFile;
         m_downloadedFile = nullptr;
         return false;
     }
 
-    const QString remoteFilePath = m_remoteBackupDirPath + '/' + fileName;
-    QNetworkReply *reply = m_requestGenerator->download(remoteFilePath);
+    m_restoreDownload.receivedBytes = m_restoreDownload.offset;
+    m_restoreDownload.checkpointBytes = m_restoreDownload.offset;
+    m_restoreDownload.totalSize = -1;
+    m_restoreDownload.started = false;
+    m_restoreDownload.writeFailed = false;
+    m_restoreDownload.rangeMismatch = false;
+    if (m_downloadBuffer.size() != DownloadBufferSize) {
+        m_downloadBuffer.resize(DownloadBufferSize);
+    }
+
+    QNetworkReply *reply = m_requestGenerator->download(m_restoreDownload.remoteFilePath,
+                                                        m_restoreDownload.offset,
+                                                        m_restoreDownload.etag);
     if (reply) {
+        // Limit how much data is buffered in memory if the disk is slower than the network.
+        reply->setReadBufferSize(4 * DownloadBufferSize);
+        connect(reply, &QNetworkReply::metaDataChanged,
+                this, &Syncer::handleDownloadMetaData);
+        connect(reply, &QNetworkReply::readyRead,
+                this, &Syncer::handleDownloadData);
         connect(reply, &QNetworkReply::downloadProgress,
                 this, &Syncer::handleDownloadProgress);
         connect(reply, &QNetworkReply::finished,
@@ -419,24 +1077,96 @@ bool Syncer::performDownloadRequest(const QString &fileName)
     return false;
 }
 
-void Syncer::handleDownloadProgress(qint64 bytesReceived, qint64 bytesTotal)
+void Syncer::handleDownloadMetaData()
 {
-    qCDebug(lcNextcloud) << "Nextcloud downloaded" << bytesReceived << "bytes of" << bytesTotal;
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    const int httpCode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    if (m_restoreDownload.started || !m_downloadedFile
+            || (httpCode != HttpOk && httpCode != HttpPartialContent)) {
+        // Error replies are handled once finished.
+        return;
+    }
+
+    if (httpCode == HttpPartialContent) {
+        const QByteArray expectedRange = "bytes " + QByteArray::number(m_restoreDownload.offset) + '-';
+        if (!reply->rawHeader("Content-Range").startsWith(expectedRange)) {
+            qCWarning(lcNextcloud) << "Unexpected content range" << reply->rawHeader("Content-Range")
+                                   << "expected" << expectedRange;
+            // Drop the partial file and its checkpoint, so that the retry (or a later restore)
+            // does not ask for the same range again.
+            removeDownloadCheckpoint();
+            m_downloadedFile->resize(0);
+            m_restoreDownload.offset = 0;
+            m_restoreDownload.receivedBytes = 0;
+            m_restoreDownload.checkpointBytes = 0;
+            m_restoreDownload.rangeMismatch = true;
+            reply->abort();
+            return;
+        }
+    } else if (m_restoreDownload.offset > 0) {
+        // The remote file has changed, so the server sent all of it.
+        qCDebug(lcNextcloud) << "Cannot resume download, restarting from the beginning";
+        m_restoreDownload.offset = 0;
+        m_restoreDownload.receivedBytes = 0;
+        m_restoreDownload.checkpointBytes = 0;
+        m_downloadedFile->seek(0);
+    }
+    m_restoreDownload.started = true;
+
+    // Allocate the whole file up front, so that a full disk is detected before the download.
+    const qint64 contentLength = reply->header(QNetworkRequest::ContentLengthHeader).toLongLong();
+    if (contentLength > 0) {
+        m_restoreDownload.totalSize = m_restoreDownload.offset + contentLength;
+        const int result = posix_fallocate(m_downloadedFile->handle(), 0, m_restoreDownload.totalSize);
+        if (result != 0 && result != EOPNOTSUPP && result != EINVAL) {
+            qCWarning(lcNextcloud) << "Cannot allocate" << m_restoreDownload.totalSize
+                                   << "bytes for file:" << m_downloadedFile->fileName() << strerror(result);
+            m_restoreDownload.writeFailed = true;
+            reply->abort();
+        }
+    }
+}
 
+void Syncer::handleDownloadData()
+{
     QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    if (!readDownloadData(reply)) {
+        reply->abort();
+    }
+}
+
+bool Syncer::readDownloadData(QNetworkReply *reply)
+{
+    if (!m_restoreDownload.started || m_restoreDownload.writeFailed) {
+        return true;
+    }
 
     if (!m_downloadedFile) {
         qCWarning(lcNextcloud) << "Download file is not set!";
-        reply->abort();
-        return;
+        return false;
     }
 
-    if (reply->bytesAvailable() > 0
-            && m_downloadedFile->write(reply->readAll()) < 0) {
-        qCWarning(lcNextcloud) << "Failed to write" << reply->bytesAvailable()
-                    << "bytes to file:" << m_downloadedFile->fileName();
-        reply->abort();
+    qint64 bytesRead = 0;
+    while ((bytesRead = reply->read(m_downloadBuffer.data(), m_downloadBuffer.size())) > 0) {
+        if (m_downloadedFile->write(m_downloadBuffer.constData(), bytesRead) != bytesRead) {
+            qCWarning(lcNextcloud) << "Failed to write" << bytesRead
+                        << "bytes to file:" << m_downloadedFile->fileName();
+            m_restoreDownload.writeFailed = true;
+            return false;
+        }
+        m_restoreDownload.receivedBytes += bytesRead;
+    }
+
+    if (m_restoreDownload.receivedBytes - m_restoreDownload.checkpointBytes >= DownloadCheckpointInterval) {
+        saveDownloadCheckpoint();
     }
+    return true;
+}
+
+void Syncer::handleDownloadProgress(qint64 bytesReceived, qint64 bytesTotal)
+{
+    qCDebug(lcNextcloud) << "Nextcloud downloaded" << (m_restoreDownload.offset + bytesReceived)
+                         << "bytes of" << (bytesTotal < 0 ? bytesTotal : m_restoreDownload.offset + bytesTotal);
 }
 
 void Syncer::handleDownloadReply()
@@ -445,23 +1175,101 @@ void Syncer::handleDownloadReply()
     reply->deleteLater();
     const int httpCode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
 
-    if (m_downloadedFile) {
-        m_downloadedFile->close();
+    bool downloadOk = reply->error() == QNetworkReply::NoError
+            && m_restoreDownload.started
+            && readDownloadData(reply);
+    if (downloadOk && m_restoreDownload.totalSize >= 0
+            && m_restoreDownload.receivedBytes != m_restoreDownload.totalSize) {
+        qCWarning(lcNextcloud) << "Download incomplete, received" << m_restoreDownload.receivedBytes
+                               << "of" << m_restoreDownload.totalSize << "bytes";
+        downloadOk = false;
+    }
+
+    if (!downloadOk) {
+        if (m_downloadedFile && m_restoreDownload.started && !m_restoreDownload.writeFailed) {
+            saveDownloadCheckpoint();
+        }
         delete m_downloadedFile;
         m_downloadedFile = nullptr;
-    }
 
-    if (reply->error() != QNetworkReply::NoError) {
+        const bool retry = !m_syncAborted
+                && !m_restoreDownload.writeFailed
+                && m_restoreDownload.retries < MaxDownloadRetries
+                && (httpCode == 0 || httpCode >= 500 || httpCode == HttpRangeNotSatisfiable
+                    || m_restoreDownload.rangeMismatch
+                    || (reply->error() == QNetworkReply::NoError && m_restoreDownload.started));
+        if (retry) {
+            m_restoreDownload.retries++;
+            m_restoreDownload.offset = (httpCode == HttpRangeNotSatisfiable
+                                        || m_restoreDownload.rangeMismatch
+                                        || m_restoreDownload.etag.isEmpty())
+                    ? 0
+                    : m_restoreDownload.checkpointBytes;
+
+            // Back off, so that a server which is briefly unavailable is not retried at once.
+            const int delay = DownloadRetryDelay << (m_restoreDownload.retries - 1);
+            qCWarning(lcNextcloud) << "Download failed:" << reply->errorString()
+                                   << "retrying from" << m_restoreDownload.offset << "bytes in" << delay << "ms";
+            QTimer::singleShot(delay, this, [this, httpCode] {
+                if (m_syncAborted) {
+                    return;
+                }
+                if (!startDownload()) {
+                    WebDavSyncer::finishWithHttpError("Download failed", httpCode);
+                }
+            });
+            return;
+        }
         WebDavSyncer::finishWithHttpError("Download failed", httpCode);
         return;
     }
 
+    // Drop any pre-allocated space beyond the received data, then move the complete
+    // file into place.
+    const bool flushed = m_downloadedFile->flush()
+            && m_downloadedFile->resize(m_restoreDownload.receivedBytes);
+    m_downloadedFile->close();
+    delete m_downloadedFile;
+    m_downloadedFile = nullptr;
+
+    if (!flushed || ::rename(QFile::encodeName(m_restoreDownload.partialFilePath()).constData(),
+                             QFile::encodeName(m_restoreDownload.filePath).constData()) != 0) {
+        WebDavSyncer::finishWithError("Cannot move downloaded file into place: " + m_restoreDownload.filePath);
+        return;
+    }
+    removeDownloadCheckpoint();
+
     WebDavSyncer::finishWithSuccess();
 }
 
+void Syncer::saveDownloadCheckpoint()
+{
+    if (!m_downloadedFile || m_restoreDownload.etag.isEmpty() || !m_downloadedFile->flush()) {
+        return;
+    }
+
+    QSaveFile checkpointFile(m_restoreDownload.checkpointFilePath());
+    if (checkpointFile.open(QFile::WriteOnly)) {
+        QTextStream stream(&checkpointFile);
+        stream << m_restoreDownload.etag << '\n' << m_restoreDownload.receivedBytes << '\n';
+        stream.flush();
+        if (checkpointFile.commit()) {
+            m_restoreDownload.checkpointBytes = m_restoreDownload.receivedBytes;
+        }
+    }
+}
+
+void Syncer::removeDownloadCheckpoint()
+{
+    QFile::remove(m_restoreDownload.checkpointFilePath());
+}
+
 void Syncer::cleanUp()
 {
-    if (m_operation == Backup) {
+    if (m_operation == Backup && m_pendingUpload.isValid()) {
+        qCDebug(lcNextcloud) << "Keeping backup file" << m_localFileInfo.absoluteFilePath()
+                             << "to resume its upload in the next sync";
+    } else if (m_operation == Backup) {
         qCDebug(lcNextcloud) << "Deleting created backup file" << m_localFileInfo.absoluteFilePath();
         QFile::remove(m_localFileInfo.absoluteFilePath());
         QDir().rmdir(m_localFileInfo.absolutePath());
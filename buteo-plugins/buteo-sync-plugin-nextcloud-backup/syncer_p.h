@@ -39,12 +39,16 @@
 #define NEXTCLOUD_BACKUP_SYNCER_P_H
 
 #include "webdavsyncer_p.h"
+#include "networkreplyparser_p.h"
 
 // libaccounts-qt5
 #include <Accounts/Manager>
 
 #include <QFileInfo>
 #include <QDir>
+#include <QHash>
+#include <QSet>
+#include <QScopedPointer>
 
 class QFile;
 class WebDavRequestGenerator;
@@ -75,20 +79,49 @@ private Q_SLOTS:
 
 private:
     void beginSync() override;
+    bool createBackup();
 
     bool performDirCreationRequest(const QStringList &remotePathParts, int remotePathPartsIndex);
     void handleDirCreationReply();
 
     bool performDirListingRequest(const QString &remoteDirPath);
+    void handleDirListingData();
     void handleDirListingReply();
 
     bool performUploadRequest(const QString &fileNameList);
     void handleUploadProgress(qint64 bytesSent, qint64 bytesTotal);
     void handleUploadReply();
 
+    bool performChunkedUploadRequest(const QString &localFilePath, const QString &remoteFilePath);
+    QString davUserId() const;
+    QNetworkReply *performUploadDirListingRequest(const QString &remoteDirPath);
+    void handleUploadDirListingData();
+    bool readUploadDirListing(QNetworkReply *reply, QList<NetworkReplyParser::Resource> *resources);
+    void handleUploadsDirListingReply();
+    void handleStaleUploadDeletionReply();
+    bool performChunkedUploadDirListingRequest();
+    void handleChunkedUploadDirListingReply();
+    void handleChunkedUploadDirCreationReply();
+    bool performPendingChunkUploads();
+    void handleChunkUploadReply();
+    void abortChunkUploads();
+    void handleChunkedUploadAssemblyReply();
+    void finishUpload();
+
+    QString pendingUploadStatePath() const;
+    bool loadPendingUpload();
+    bool savePendingUpload(const QString &localFilePath);
+    void removePendingUpload();
+
     bool performDownloadRequest(const QString &fileName);
+    bool startDownload();
+    void handleDownloadMetaData();
+    void handleDownloadData();
     void handleDownloadProgress(qint64 bytesReceived, qint64 bytesTotal);
     void handleDownloadReply();
+    bool readDownloadData(QNetworkReply *reply);
+    void saveDownloadCheckpoint();
+    void removeDownloadCheckpoint();
 
     void finishWithHttpError(const QString &errorMessage, int httpCode);
     void finishWithError(const QString &errorMessage);
@@ -103,7 +136,72 @@ private:
     QDBusInterface *m_sailfishBackup = nullptr;
     QFileInfo m_localFileInfo;
     QString m_remoteBackupDirPath;
+    QScopedPointer<PropFindReplyParser> m_dirListingParser;
+    QList<NetworkReplyParser::Resource> m_remoteFiles;
     Operation m_operation = BackupQuery;
+
+    // Large backups are uploaded in chunks, so that a dropped connection only requires the
+    // failed chunks to be sent again. The upload dir name contains the id of the pending
+    // upload, so chunks which reached the server in an earlier sync are reused.
+    struct ChunkedUpload {
+        QString localFilePath;
+        QString remoteFilePath;
+        QString uploadsDirPath;
+        QString uploadDirPrefix;
+        QString uploadDirPath;
+        qint64 fileSize = 0;
+        qint64 chunkSize = 0;
+        int chunkCount = 0;
+        QList<int> pendingChunks;
+        QHash<int, int> chunkRetries;
+        QSet<QNetworkReply *> activeChunkReplies;
+        QList<NetworkReplyParser::Resource> listedResources;
+        bool failed = false;
+
+        qint64 chunkOffset(int chunkNumber) const { return (chunkNumber - 1) * chunkSize; }
+        qint64 chunkLength(int chunkNumber) const { return qMin(chunkSize, fileSize - chunkOffset(chunkNumber)); }
+    };
+
+    // The restore file is downloaded to <file>.part, and renamed once complete. The number of
+    // bytes received for the remote etag is checkpointed to <file>.part.state, so that an
+    // interrupted download can continue with a range request.
+    struct RestoreDownload {
+        QString remoteFilePath;
+        QString filePath;
+        QString etag;
+        qint64 offset = 0;
+        qint64 receivedBytes = 0;
+        qint64 checkpointBytes = 0;
+        qint64 totalSize = -1;
+        int retries = 0;
+        bool started = false;
+        bool writeFailed = false;
+        bool rangeMismatch = false;
+
+        QString partialFilePath() const { return filePath + QStringLiteral(".part"); }
+        QString checkpointFilePath() const { return filePath + QStringLiteral(".part.state"); }
+    };
+
+    // A backup archive is kept until a chunked upload of it has finished. Its upload id is
+    // saved with the file size and modification time, so that the next sync can resume the
+    // upload before it creates a new backup.
+    struct PendingUpload {
+        QString uploadId;
+        QString localFilePath;
+        qint64 fileSize = -1;
+        qint64 lastModified = 0;
+        qint64 created = 0;
+
+        bool isValid() const { return !uploadId.isEmpty(); }
+    };
+
+    ChunkedUpload m_chunkedUpload;
+    PendingUpload m_pendingUpload;
+    bool m_resumingPendingUpload = false;
+    RestoreDownload m_restoreDownload;
+    QByteArray m_downloadBuffer;
+    qint64 m_uploadChunkSize = 0;
+    int m_maxActiveChunkUploads = 0;
 };
 
 #endif // NEXTCLOUD_BACKUP_SYNCER_P_H
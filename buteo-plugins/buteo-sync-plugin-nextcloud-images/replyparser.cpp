@@ -67,7 +67,18 @@ ReplyParser::GalleryMetadata ReplyParser::galleryMetadataFromResources(Syncer *i
                                                                        const QList<NetworkReplyParser::Resource> &resources)
 {
     ReplyParser::GalleryMetadata metadata;
-    int queriedAlbumPhotoCount = 0;
+    appendResources(&metadata, imageSyncer, rootPath, queriedAlbumPath, resources);
+    return metadata;
+}
+
+// Resources may be passed in several batches as the PROPFIND reply arrives;
+// the queried album's photo count always reflects all photos appended so far.
+void ReplyParser::appendResources(GalleryMetadata *metadata,
+                                  Syncer *imageSyncer,
+                                  const QString &rootPath,
+                                  const QString &queriedAlbumPath,
+                                  const QList<NetworkReplyParser::Resource> &resources)
+{
     const QString normalizedRootPath = appendDirSeparator(rootPath);
     const QString normalizedQueriedAlbumPath = appendDirSeparator(queriedAlbumPath);
 
@@ -96,7 +107,7 @@ ReplyParser::GalleryMetadata ReplyParser::galleryMetadataFromResources(Syncer *i
 
         if (resource.isCollection) {
             SyncCache::Album newAlbum;
-            SyncCache::Album *album = isQueriedAlbum ? &metadata.album : &newAlbum;
+            SyncCache::Album *album = isQueriedAlbum ? &metadata->album : &newAlbum;
 
             album->accountId = imageSyncer->accountId();
             album->userId = resource.ownerId;
@@ -113,7 +124,7 @@ ReplyParser::GalleryMetadata ReplyParser::galleryMetadataFromResources(Syncer *i
             album->etag = resource.etag;
 
             if (!isQueriedAlbum) {
-                metadata.subAlbums.append(newAlbum);
+                metadata->subAlbums.append(newAlbum);
             }
         } else {
             SyncCache::Photo photo;
@@ -131,11 +142,9 @@ ReplyParser::GalleryMetadata ReplyParser::galleryMetadataFromResources(Syncer *i
             photo.fileType = resource.contentType;
             photo.etag = resource.etag;
 
-            metadata.photos.append(photo);
-            queriedAlbumPhotoCount++;
+            metadata->photos.append(photo);
         }
     }
 
-    metadata.album.photoCount = queriedAlbumPhotoCount;
-    return metadata;
+    metadata->album.photoCount = metadata->photos.count();
 }
@@ -58,6 +58,11 @@ public:
                                                         const QString &rootPath,
                                                         const QString &queriedAlbumPath,
                                                         const QList<NetworkReplyParser::Resource> &resources);
+    static void appendResources(GalleryMetadata *metadata,
+                                Syncer *imageSyncer,
+                                const QString &rootPath,
+                                const QString &queriedAlbumPath,
+                                const QList<NetworkReplyParser::Resource> &resources);
 };
 
 Q_DECLARE_METATYPE(ReplyParser::GalleryMetadata)
@@ -63,10 +63,29 @@ void Syncer::SyncProgressInfo::reset()
     removedAlbumCount = 0;
 
     addedPhotoCount = 0;
-    modifiedAlbumCount = 0;
+    modifiedPhotoCount = 0;
     removedPhotoCount = 0;
 
     pendingAlbumListings.clear();
+    activeAlbumListings = 0;
+    listingFailed = false;
+}
+
+void Syncer::SyncProgressInfo::restoreChangeCounts(const SyncProgressInfo &other)
+{
+    addedAlbumCount = other.addedAlbumCount;
+    modifiedAlbumCount = other.modifiedAlbumCount;
+    removedAlbumCount = other.removedAlbumCount;
+
+    addedPhotoCount = other.addedPhotoCount;
+    modifiedPhotoCount = other.modifiedPhotoCount;
+    removedPhotoCount = other.removedPhotoCount;
+}
+
+int Syncer::SyncProgressInfo::changeCount() const
+{
+    return addedAlbumCount + modifiedAlbumCount + removedAlbumCount
+            + addedPhotoCount + modifiedPhotoCount + removedPhotoCount;
 }
 
 
@@ -80,21 +99,129 @@ Syncer::~Syncer()
 {
 }
 
-void Syncer::purgeDeletedAccounts()
+void Syncer::abortSync()
 {
-    SyncCache::ImageDatabase db;
+    WebDavSyncer::abortSync();
+
+    // Drop the batched album deltas of the aborted sync, and release the writer lock.
+    if (m_databaseOpen && m_db.inTransaction()) {
+        rollbackBatch();
+    }
+}
+
+bool Syncer::openDatabase()
+{
+    // The database is opened once and kept open for the lifetime of the syncer,
+    // so that its connection and prepared queries are reused for every album.
+    if (m_databaseOpen) {
+        return true;
+    }
+
     SyncCache::DatabaseError error;
-    db.openDatabase(
+    m_db.openDatabase(
             QStringLiteral("%1/system/privileged/Images/nextcloud.db").arg(QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation)),
             &error);
-
     if (error.errorCode != SyncCache::DatabaseError::NoError) {
-        qCWarning(lcNextcloud) << "Failed to open database:" << error.errorMessage;
+        qCWarning(lcNextcloud) << "Failed to open database:" << error.errorCode << error.errorMessage;
+        return false;
+    }
+
+    // Query instrumentation is opt-in, for attaching to bug reports.
+    m_db.setQueryStatisticsEnabled(m_syncProfile->key(QStringLiteral("query_statistics")) == QStringLiteral("true"));
+    const QString slowQueryThreshold = m_syncProfile->key(QStringLiteral("slow_query_threshold"));
+    m_db.setSlowQueryThreshold(slowQueryThreshold.isEmpty() ? -1 : slowQueryThreshold.toInt());
+
+    const QString changeNotificationInterval = m_syncProfile->key(QStringLiteral("change_notification_interval"));
+    if (!changeNotificationInterval.isEmpty()) {
+        m_db.setChangeNotificationInterval(changeNotificationInterval.toInt());
+    }
+
+    m_databaseOpen = true;
+    return true;
+}
+
+bool Syncer::batchTransactionLimitReached() const
+{
+    if (m_transactionBatchRows <= 0 && m_transactionBatchInterval <= 0) {
+        return true;
+    }
+
+    return (m_transactionBatchRows > 0 && m_batchedRowCount >= m_transactionBatchRows)
+            || (m_transactionBatchInterval > 0 && m_batchTimer.hasExpired(m_transactionBatchInterval));
+}
+
+void Syncer::beginBatch()
+{
+    m_batchedRowCount = 0;
+    m_batchTimer.start();
+    m_batchStartProgressInfo.restoreChangeCounts(m_syncProgressInfo);
+}
+
+void Syncer::rollbackBatch()
+{
+    SyncCache::DatabaseError error;
+    if (!m_db.rollbackTransaction(&error)) {
+        qCWarning(lcNextcloud) << Q_FUNC_INFO << "failed to roll back transaction:" << error.errorCode << error.errorMessage;
+    }
+
+    // The changes of every album in the batch are gone, not just those of the last one.
+    m_syncProgressInfo.restoreChangeCounts(m_batchStartProgressInfo);
+    m_batchedRowCount = 0;
+}
+
+void Syncer::cleanUp()
+{
+    // Commit any album deltas which are still batched in an open transaction, unless
+    // the sync failed or was aborted.
+    const bool syncSucceeded = !m_syncError && !m_syncAborted;
+    if (m_databaseOpen && m_db.inTransaction()) {
+        if (!syncSucceeded) {
+            rollbackBatch();
+        } else {
+            SyncCache::DatabaseError error;
+            if (!m_db.commitTransaction(&error)) {
+                qCWarning(lcNextcloud) << Q_FUNC_INFO << "failed to commit transaction:" << error.errorCode << error.errorMessage;
+                rollbackBatch();
+            }
+        }
+    }
+    // The sync run is over, so return the WAL to empty rather than leaving it
+    // for the next reader to wade through.
+    if (syncSucceeded && m_databaseOpen && !m_db.inTransaction()) {
+        SyncCache::DatabaseError error;
+        if (m_db.checkpoint(SyncCache::Database::TruncateCheckpoint, &error)) {
+            const SyncCache::WalStatus status = m_db.walStatus();
+            qCDebug(lcNextcloud) << "Checkpointed WAL, frames:" << status.checkpointedFrames << "/" << status.logFrames
+                                 << "busy:" << status.busy << "size:" << status.walFileSize;
+        } else {
+            qCWarning(lcNextcloud) << Q_FUNC_INFO << "failed to checkpoint:" << error.errorCode << error.errorMessage;
+        }
+    }
+    if (m_databaseOpen && lcNextcloud().isDebugEnabled()) {
+        const QVector<SyncCache::QueryStatistics> statistics = m_db.queryStatistics();
+        for (const SyncCache::QueryStatistics &query : statistics) {
+            qCDebug(lcNextcloud) << "Query" << query.queryName << "calls:" << query.calls << "rows:" << query.rows
+                                 << "total us:" << query.totalTime << "max us:" << query.maxTime << "p95 us:" << query.p95Time;
+        }
+        m_db.resetQueryStatistics();
+
+        const SyncCache::ChangeNotificationStatistics notifications = m_db.changeNotificationStatistics();
+        qCDebug(lcNextcloud) << "Change notifications sent:" << notifications.sent
+                             << "merged into later ones:" << notifications.sendsMerged;
+    }
+    m_batchedRowCount = 0;
+    m_dirListings.clear();
+}
+
+void Syncer::purgeDeletedAccounts()
+{
+    if (!openDatabase()) {
         return;
     }
 
+    SyncCache::DatabaseError error;
     QVector<SyncCache::User> usersToDelete;
-    const QVector<SyncCache::User> users = db.users(&error);
+    const QVector<SyncCache::User> users = m_db.users(&error);
     for (const SyncCache::User &user : users) {
         if (!m_manager->account(user.accountId)) {
             usersToDelete.append(user);
@@ -102,7 +229,7 @@ void Syncer::purgeDeletedAccounts()
     }
 
     if (usersToDelete.count() > 0) {
-        if (!db.beginTransaction(&error)) {
+        if (!m_db.beginTransaction(&error)) {
             qCWarning(lcNextcloud) << Q_FUNC_INFO << "failed to begin transaction:" << error.errorCode << error.errorMessage;
             return;
         }
@@ -110,7 +237,7 @@ void Syncer::purgeDeletedAccounts()
         for (const SyncCache::User &user : usersToDelete) {
             qCDebug(lcNextcloud) << Q_FUNC_INFO << "Account" << user.accountId
                       << "has been deleted, purge associated user:" << user.userId << user.displayName;
-            db.deleteUser(user, &error);
+            m_db.deleteUser(user, &error);
             if (error.errorCode != SyncCache::DatabaseError::NoError) {
                 qCWarning(lcNextcloud) << "Failed to delete user for account:" << user.accountId
                             << ":" << error.errorMessage;
@@ -119,8 +246,8 @@ void Syncer::purgeDeletedAccounts()
         }
 
         if (error.errorCode != SyncCache::DatabaseError::NoError) {
-            db.rollbackTransaction(&error);
-        } else if (!db.commitTransaction(&error)) {
+            m_db.rollbackTransaction(&error);
+        } else if (!m_db.commitTransaction(&error)) {
             qCWarning(lcNextcloud) << Q_FUNC_INFO << "failed to commit transaction:" << error.errorCode << error.errorMessage;
         }
     }
@@ -158,21 +285,16 @@ void Syncer::handleUserInfoReply()
     }
 
     // Store the user.
-    SyncCache::ImageDatabase db;
-    SyncCache::DatabaseError error;
-    db.openDatabase(
-            QStringLiteral("%1/system/privileged/Images/nextcloud.db").arg(QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation)),
-            &error);
-    if (error.errorCode != SyncCache::DatabaseError::NoError) {
-        qCWarning(lcNextcloud) << "Failed to open database to store user for account:" << m_accountId
-                    << ":" << error.errorMessage;
+    if (!openDatabase()) {
+        qCWarning(lcNextcloud) << "Failed to open database to store user for account:" << m_accountId;
         return;
     }
+    SyncCache::DatabaseError error;
     SyncCache::User currentUser;
     currentUser.accountId = m_accountId;
     currentUser.userId = user.userId;
     currentUser.displayName = user.displayName;
-    db.storeUser(currentUser, &error);
+    m_db.storeUser(currentUser, &error);
     if (error.errorCode != SyncCache::DatabaseError::NoError) {
         qCWarning(lcNextcloud) << "Failed to store user:" << currentUser.userId
                     << error.errorCode << error.errorMessage;
@@ -199,6 +321,13 @@ void Syncer::handleUserInfoReply()
     m_forceFullSync = !m_syncProfile->lastSuccessfulSyncTime().isValid();
     m_syncProgressInfo.reset();
 
+    m_transactionBatchRows = m_syncProfile->key(QStringLiteral("transaction_batch_rows")).toInt();
+    m_transactionBatchInterval = m_syncProfile->key(QStringLiteral("transaction_batch_interval")).toInt();
+    m_batchedRowCount = 0;
+
+    const int maxActiveListings = m_syncProfile->key(QStringLiteral("max_concurrent_listings")).toInt();
+    m_maxActiveAlbumListings = maxActiveListings > 0 ? maxActiveListings : DefaultMaxActiveAlbumListings;
+
     qCDebug(lcNextcloud) << "Starting sync for account:" << m_accountId
               << "user:" << m_userId
               << "root path:" << m_dirListingRootPath
@@ -217,35 +346,89 @@ bool Syncer::performDirListingRequest(const QString &remoteDirPath)
     QNetworkReply *reply = m_requestGenerator->dirListing(remoteDirPath);
     if (reply) {
         reply->setProperty("remoteDirPath", remoteDirPath);
+        m_dirListings.insert(reply, QSharedPointer<DirListing>(new DirListing));
+        connect(reply, &QNetworkReply::readyRead,
+                this, &Syncer::handleDirListingData);
         connect(reply, &QNetworkReply::finished,
                 this, &Syncer::handleDirListingReply);
+        m_syncProgressInfo.activeAlbumListings++;
         return true;
     }
 
     return false;
 }
 
+bool Syncer::performPendingDirListingRequests()
+{
+    // Keep up to m_maxActiveAlbumListings directory listings in flight at once.
+    while (m_syncProgressInfo.activeAlbumListings < m_maxActiveAlbumListings
+           && !m_syncProgressInfo.pendingAlbumListings.isEmpty()) {
+        if (!performDirListingRequest(m_syncProgressInfo.pendingAlbumListings.takeLast())) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void Syncer::handleDirListingData()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    const QSharedPointer<DirListing> listing = m_dirListings.value(reply);
+    if (!listing || m_syncProgressInfo.listingFailed || m_syncAborted
+            || reply->error() != QNetworkReply::NoError) {
+        return;
+    }
+
+    // Convert each completed <d:response> to gallery metadata as soon as it has been received.
+    const QList<NetworkReplyParser::Resource> resourceList = listing->parser.addData(reply->readAll());
+    if (!resourceList.isEmpty()) {
+        ReplyParser::appendResources(&listing->metadata, this, m_dirListingRootPath,
+                                     reply->property("remoteDirPath").toString(), resourceList);
+    }
+}
+
 void Syncer::handleDirListingReply()
 {
     QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
     reply->deleteLater();
-    const QByteArray replyData = reply->readAll();
+    m_syncProgressInfo.activeAlbumListings--;
+    const QSharedPointer<DirListing> listing = m_dirListings.take(reply);
+
+    if (m_syncProgressInfo.listingFailed || m_syncAborted || !listing) {
+        // The sync has already finished, ignore the remaining replies.
+        return;
+    }
+
     const int httpCode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
     const QString remoteDirPath = reply->property("remoteDirPath").toString();
 
     if (reply->error() != QNetworkReply::NoError) {
+        m_syncProgressInfo.listingFailed = true;
         WebDavSyncer::finishWithHttpError("Remote directory listing failed", httpCode);
         return;
     }
 
-    const QList<NetworkReplyParser::Resource> resourceList = XmlReplyParser::parsePropFindResponse(replyData);
-    const ReplyParser::GalleryMetadata metadata =
-            ReplyParser::galleryMetadataFromResources(this, m_dirListingRootPath, remoteDirPath, resourceList);
-
-    if (processQueriedAlbum(metadata.album, metadata.photos, metadata.subAlbums)) {
-        if (m_syncProgressInfo.pendingAlbumListings.count() > 0) {
-            performDirListingRequest(m_syncProgressInfo.pendingAlbumListings.takeLast());
-        }
+    // Parse whatever was received after the last readyRead().
+    const QList<NetworkReplyParser::Resource> resourceList = listing->parser.addData(reply->readAll());
+    if (listing->parser.hasError() || !listing->parser.atEnd()) {
+        // A truncated listing would make the delta remove photos which still exist on the server.
+        qCWarning(lcNextcloud) << "Failed to parse directory listing for" << remoteDirPath
+                               << ":" << listing->parser.errorString();
+        m_syncProgressInfo.listingFailed = true;
+        WebDavSyncer::finishWithError("Failed to parse directory listing");
+        return;
+    }
+    ReplyParser::appendResources(&listing->metadata, this, m_dirListingRootPath, remoteDirPath, resourceList);
+
+    // The database delta is still applied once per album: deletions can only be detected
+    // against the complete listing.
+    const ReplyParser::GalleryMetadata &metadata = listing->metadata;
+    if (!processQueriedAlbum(metadata.album, metadata.photos, metadata.subAlbums)) {
+        m_syncProgressInfo.listingFailed = true;
+    } else if (!performPendingDirListingRequests()) {
+        m_syncProgressInfo.listingFailed = true;
+        WebDavSyncer::finishWithError("Directory list request failed");
     }
 }
 
@@ -257,32 +440,31 @@ bool Syncer::processQueriedAlbum(const SyncCache::Album &queriedAlbum,
               << "with" << photos.count() << "photos and"
               << subAlbums.count() << "sub-albums";
 
-    SyncCache::ImageDatabase db;
-    SyncCache::DatabaseError error;
-    db.openDatabase(
-            QStringLiteral("%1/system/privileged/Images/nextcloud.db").arg(QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation)),
-            &error);
-
-    if (error.errorCode != SyncCache::DatabaseError::NoError) {
-        qCWarning(lcNextcloud) << Q_FUNC_INFO << "failed to open database:" << error.errorCode << error.errorMessage;
+    if (!openDatabase()) {
         emit syncFailed();
         return false;
     }
 
-    if (!db.beginTransaction(&error)) {
-        qCWarning(lcNextcloud) << Q_FUNC_INFO << "failed to begin transaction:" << error.errorCode << error.errorMessage;
-        emit syncFailed();
-        return false;
+    // A transaction may still be open if the previous album's delta was batched.
+    SyncCache::DatabaseError error;
+    if (!m_db.inTransaction()) {
+        if (!m_db.beginTransaction(&error)) {
+            qCWarning(lcNextcloud) << Q_FUNC_INFO << "failed to begin transaction:" << error.errorCode << error.errorMessage;
+            emit syncFailed();
+            return false;
+        }
+        beginBatch();
     }
 
     // Update the db for the main fetched album and its photos
-    if (calculateAndApplyDelta(queriedAlbum, photos, subAlbums, &db, &error)) {
+    const int previousChangeCount = m_syncProgressInfo.changeCount();
+    if (calculateAndApplyDelta(queriedAlbum, photos, subAlbums, &m_db, &error)) {
 
         // Look for sub-albums that have changed and need to be refreshed from the server.
         for (QVector<SyncCache::Album>::ConstIterator it = subAlbums.constBegin();
              it != subAlbums.constEnd(); ++it) {
             const SyncCache::Album &serverAlbum = *it;
-            SyncCache::Album dbAlbum = db.album(m_accountId, m_userId, serverAlbum.albumId, &error);
+            SyncCache::Album dbAlbum = m_db.album(m_accountId, m_userId, serverAlbum.albumId, &error);
             if (error.errorCode != SyncCache::DatabaseError::NoError) {
                 qCWarning(lcNextcloud) << Q_FUNC_INFO << "db album() failed for:"
                             << dbAlbum.albumId
@@ -306,19 +488,25 @@ bool Syncer::processQueriedAlbum(const SyncCache::Album &queriedAlbum,
         }
     }
 
+    // The sync is complete once no listings are pending nor in flight; the reply being
+    // processed has already been removed from the in-flight count.
+    const bool allRequestsDone = m_syncProgressInfo.pendingAlbumListings.isEmpty()
+            && m_syncProgressInfo.activeAlbumListings == 0;
+    m_batchedRowCount += m_syncProgressInfo.changeCount() - previousChangeCount;
+
     if (error.errorCode != SyncCache::DatabaseError::NoError) {
-        db.rollbackTransaction(&error);
+        rollbackBatch();
         emit syncFailed();
         return false;
 
-    } else if (!db.commitTransaction(&error)) {
+    } else if ((allRequestsDone || batchTransactionLimitReached())
+               && !m_db.commitTransaction(&error)) {
         qCWarning(lcNextcloud) << Q_FUNC_INFO << "failed to commit transaction:" << error.errorCode << error.errorMessage;
-        db.rollbackTransaction(&error);
+        rollbackBatch();
         emit syncFailed();
         return false;
     }
 
-    const bool allRequestsDone = m_syncProgressInfo.pendingAlbumListings.isEmpty();
     if (allRequestsDone) {
         qCDebug(lcNextcloud) << Q_FUNC_INFO << "Nextcloud images albums A/M/R:"
                   << m_syncProgressInfo.addedAlbumCount
@@ -334,7 +522,8 @@ bool Syncer::processQueriedAlbum(const SyncCache::Album &queriedAlbum,
         // of doing a complete sync of the full remote directory tree.
         WebDavSyncer::finishWithSuccess();
     } else {
-        qCDebug(lcNextcloud) << Q_FUNC_INFO << "Remaining albums to fetch:" << m_syncProgressInfo.pendingAlbumListings.count();
+        qCDebug(lcNextcloud) << Q_FUNC_INFO << "Remaining albums to fetch:" << m_syncProgressInfo.pendingAlbumListings.count()
+                  << "in progress:" << m_syncProgressInfo.activeAlbumListings;
     }
 
     return true;
@@ -404,47 +593,56 @@ bool Syncer::calculateAndApplyDelta(const SyncCache::Album &mainAlbum,
         }
     }
 
+    // Load the existing photos of this album once, rather than querying each photo individually.
+    const QVector<SyncCache::Photo> dbPhotos = db->photos(m_accountId, m_userId, mainAlbum.albumId, error);
+    if (error->errorCode != SyncCache::DatabaseError::NoError) {
+        qCWarning(lcNextcloud) << Q_FUNC_INFO << "db photos() failed for:"
+                    << mainAlbum.albumId
+                    << error->errorCode << error->errorMessage;
+        return false;
+    }
+    QHash<QString, SyncCache::Photo> dbPhotosById;
+    dbPhotosById.reserve(dbPhotos.count());
+    for (const SyncCache::Photo &dbPhoto : dbPhotos) {
+        dbPhotosById.insert(dbPhoto.photoId, dbPhoto);
+    }
+
     // Check for new and modified photos
-    QSet<QString> serverPhotoIds;
+    QVector<SyncCache::Photo> photosToStore;
     for (const SyncCache::Photo &serverPhoto : photos) {
-        SyncCache::Photo dbPhoto = db->photo(m_accountId, m_userId, serverPhoto.albumId, serverPhoto.photoId, nullptr);
-        const bool isNewPhoto = dbPhoto.photoId.isEmpty();
-        if (dbPhoto.etag != serverPhoto.etag) {
-            db->storePhoto(serverPhoto, error);
-            if (error->errorCode != SyncCache::DatabaseError::NoError) {
-                qCWarning(lcNextcloud) << Q_FUNC_INFO << "failed to update photo:"
-                            << serverPhoto.photoId
-                            << serverPhoto.fileName
-                            << serverPhoto.albumId
-                            << error->errorCode << error->errorMessage;
-                return false;
-            }
-
-            if (isNewPhoto) {
-                m_syncProgressInfo.addedPhotoCount++;
-            } else {
+        QHash<QString, SyncCache::Photo>::iterator it = dbPhotosById.find(serverPhoto.photoId);
+        if (it == dbPhotosById.end()) {
+            photosToStore.append(serverPhoto);
+            m_syncProgressInfo.addedPhotoCount++;
+        } else {
+            if (it->etag != serverPhoto.etag) {
+                photosToStore.append(serverPhoto);
                 m_syncProgressInfo.modifiedPhotoCount++;
             }
+            dbPhotosById.erase(it);
         }
+    }
 
-        serverPhotoIds.insert(serverPhoto.photoId);
+    db->storePhotos(photosToStore, error);
+    if (error->errorCode != SyncCache::DatabaseError::NoError) {
+        qCWarning(lcNextcloud) << Q_FUNC_INFO << "failed to update photos in album:"
+                    << mainAlbum.albumId
+                    << error->errorCode << error->errorMessage;
+        return false;
     }
 
     // Check for photos deleted from this album.
     // Delete any db photos in this album that are not present on the server.
-    const QVector<SyncCache::Photo> dbPhotos = db->photos(m_accountId, m_userId, mainAlbum.albumId, error);
-    for (const SyncCache::Photo &dbPhoto : dbPhotos) {
-        if (!serverPhotoIds.remove(dbPhoto.photoId)) {
-            qCDebug(lcNextcloud) << Q_FUNC_INFO << "Delete photo:" << dbPhoto.photoId << dbPhoto.fileName;
-            db->deletePhoto(dbPhoto, error);
-            if (error->errorCode != SyncCache::DatabaseError::NoError) {
-                qCWarning(lcNextcloud) << Q_FUNC_INFO << "failed to delete photo:"
-                            << dbPhoto.photoId
-                            << error->errorCode << error->errorMessage;
-                return false;
-            }
-            m_syncProgressInfo.removedPhotoCount++;
+    for (const SyncCache::Photo &dbPhoto : dbPhotosById) {
+        qCDebug(lcNextcloud) << Q_FUNC_INFO << "Delete photo:" << dbPhoto.photoId << dbPhoto.fileName;
+        db->deletePhoto(dbPhoto, error);
+        if (error->errorCode != SyncCache::DatabaseError::NoError) {
+            qCWarning(lcNextcloud) << Q_FUNC_INFO << "failed to delete photo:"
+                        << dbPhoto.photoId
+                        << error->errorCode << error->errorMessage;
+            return false;
         }
+        m_syncProgressInfo.removedPhotoCount++;
     }
 
     return true;
@@ -452,23 +650,17 @@ bool Syncer::calculateAndApplyDelta(const SyncCache::Album &mainAlbum,
 
 void Syncer::purgeAccount(int accountId)
 {
-    SyncCache::ImageDatabase db;
     SyncCache::DatabaseError error;
-    db.openDatabase(
-            QStringLiteral("%1/system/privileged/Images/nextcloud.db").arg(QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation)),
-            &error);
-
-    if (error.errorCode != SyncCache::DatabaseError::NoError) {
-        qCWarning(lcNextcloud) << "Failed to open database in order to purge Nextcloud images for account:" << accountId
-                    << ":" << error.errorMessage;
+    if (!openDatabase()) {
+        qCWarning(lcNextcloud) << "Failed to open database in order to purge Nextcloud images for account:" << accountId;
     } else {
-        SyncCache::User user = db.user(accountId, &error);
+        SyncCache::User user = m_db.user(accountId, &error);
         if (error.errorCode == SyncCache::DatabaseError::NoError) {
             if (user.userId.isEmpty()) {
                 qCWarning(lcNextcloud) << "Failed to find Nextcloud user ID for account:" << accountId
                             << ":" << error.errorMessage;
             } else {
-                db.deleteUser(user, &error);
+                m_db.deleteUser(user, &error);
                 if (error.errorCode != SyncCache::DatabaseError::NoError) {
                     qCWarning(lcNextcloud) << "Failed to delete user for account:" << accountId
                                 << ":" << error.errorMessage;
@@ -48,6 +48,8 @@
 #include <QList>
 #include <QHash>
 #include <QVector>
+#include <QElapsedTimer>
+#include <QSharedPointer>
 
 class QNetworkReply;
 
@@ -62,17 +64,26 @@ public:
     Syncer(QObject *parent, Buteo::SyncProfile *profile);
    ~Syncer();
 
+    void abortSync() override;
     void purgeAccount(int accountId) override;
 
 private:
     void handleUserInfoReply();
     bool performDirListingRequest(const QString &remoteDirPath);
+    bool performPendingDirListingRequests();
+    void handleDirListingData();
     void handleDirListingReply();
 
     void purgeDeletedAccounts();
     void deleteFilesForAccount(int accountId);
 
+    bool openDatabase();
+    bool batchTransactionLimitReached() const;
+    void beginBatch();
+    void rollbackBatch();
+
     void beginSync() override;
+    void cleanUp() override;
 
     bool processQueriedAlbum(const SyncCache::Album &mainAlbum,
                              const QVector<SyncCache::Photo> &photos,
@@ -88,6 +99,7 @@ private:
     {
     public:
         void reset();
+        void restoreChangeCounts(const SyncProgressInfo &other);
 
         int addedAlbumCount = 0;
         int modifiedAlbumCount = 0;
@@ -97,14 +109,40 @@ private:
         int modifiedPhotoCount = 0;
         int removedPhotoCount = 0;
 
+        int changeCount() const;
+
         QStringList pendingAlbumListings;
+        int activeAlbumListings = 0;
+        bool listingFailed = false;
     };
 
+    // Directory listings are parsed as the reply data arrives, so that the full
+    // PROPFIND body is never buffered.
+    struct DirListing {
+        PropFindReplyParser parser;
+        ReplyParser::GalleryMetadata metadata;
+    };
+
+    enum { DefaultMaxActiveAlbumListings = 4 };
+
     SyncProgressInfo m_syncProgressInfo;
+    SyncProgressInfo m_batchStartProgressInfo;
+    QHash<QNetworkReply *, QSharedPointer<DirListing> > m_dirListings;
+    SyncCache::ImageDatabase m_db;
+    bool m_databaseOpen = false;
+
+    // Album deltas may be grouped into a single transaction until either limit is reached.
+    // Both limits are read from the sync profile; if neither is set, each album is committed
+    // separately.
+    int m_transactionBatchRows = 0;
+    int m_transactionBatchInterval = 0;
+    int m_batchedRowCount = 0;
+    QElapsedTimer m_batchTimer;
     Accounts::Manager *m_manager = nullptr;
     ReplyParser *m_replyParser = nullptr;
     QString m_userId;
     QString m_dirListingRootPath;
+    int m_maxActiveAlbumListings = DefaultMaxActiveAlbumListings;
     bool m_forceFullSync = false;
 };
 
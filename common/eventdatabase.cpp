@@ -38,7 +38,6 @@
 #include "synccacheevents.h"
 #include "synccacheevents_p.h"
 
-#include <QtCore/QFile>
 #include <QtCore/QDir>
 #include <QtCore/QUuid>
 
@@ -88,6 +87,14 @@ static bool upgradeVersion2to3Fn(QSqlDatabase &database)
     return true;
 }
 
+static bool upgradeVersion3to4Fn(QSqlDatabase &database)
+{
+    // The column affinity is changed to INTEGER by the table rebuild in the upgrade statements,
+    // which converts the numeric text written here.
+    return DatabaseImpl::convertTimestampColumns(database, QStringLiteral("Events"),
+                                                 QStringList() << QStringLiteral("timestamp"));
+}
+
 EventDatabasePrivate::EventDatabasePrivate(EventDatabase *parent)
     : DatabasePrivate(parent), m_eventDbParent(parent)
 {
@@ -95,7 +102,7 @@ EventDatabasePrivate::EventDatabasePrivate(EventDatabase *parent)
 
 int EventDatabasePrivate::currentSchemaVersion() const
 {
-    return 3;
+    return 6;
 }
 
 QVector<const char *> EventDatabasePrivate::createStatements() const
@@ -109,10 +116,14 @@ QVector<const char *> EventDatabasePrivate::createStatements() const
             "\n eventUrl TEXT,"
             "\n imageUrl TEXT,"
             "\n imagePath TEXT,"
-            "\n timestamp TEXT,"
+            "\n timestamp INTEGER,"
             "\n deletedLocally BOOL,"
             "\n PRIMARY KEY (accountId, eventId));";
-    static QVector<const char *> retn { createEventsTable };
+    // Serves the ordering of events() without a temporary sort.
+    static const char *createEventsTimestampIndex =
+            "\n CREATE INDEX EventsTimestampIndex ON Events (accountId, timestamp DESC, eventId);";
+    static QVector<const char *> retn { createEventsTable, createEventsTimestampIndex,
+                                        DatabaseImpl::createFileTombstonesTable };
     return retn;
 }
 
@@ -132,19 +143,66 @@ QVector<UpgradeOperation> EventDatabasePrivate::upgradeVersions() const
         "PRAGMA user_version=3",
         0 // NULL-terminated
     };
+
+    static const char *upgradeVersion3to4[] = {
+        "\n CREATE TABLE Events_new ("
+        "\n accountId INTEGER,"
+        "\n eventId TEXT,"
+        "\n eventSubject TEXT,"
+        "\n eventText TEXT,"
+        "\n eventUrl TEXT,"
+        "\n imageUrl TEXT,"
+        "\n imagePath TEXT,"
+        "\n timestamp INTEGER,"
+        "\n deletedLocally BOOL,"
+        "\n PRIMARY KEY (accountId, eventId));",
+        "INSERT INTO Events_new (accountId, eventId, eventSubject, eventText, eventUrl, imageUrl, imagePath, timestamp, deletedLocally)"
+        " SELECT accountId, eventId, eventSubject, eventText, eventUrl, imageUrl, imagePath, timestamp, deletedLocally FROM Events",
+        "DROP TABLE Events",
+        "ALTER TABLE Events_new RENAME TO Events",
+        "PRAGMA user_version=4",
+        0 // NULL-terminated
+    };
+
+    static const char *upgradeVersion4to5[] = {
+        "CREATE INDEX EventsTimestampIndex ON Events (accountId, timestamp DESC, eventId)",
+        "PRAGMA user_version=5",
+        0 // NULL-terminated
+    };
+
+    static const char *upgradeVersion5to6[] = {
+        DatabaseImpl::createFileTombstonesTable,
+        "PRAGMA user_version=6",
+        0 // NULL-terminated
+    };
+
     static QVector<UpgradeOperation> retn {
         { 0, upgradeVersion0to1 },
         { upgradeVersion1to2Fn, upgradeVersion1to2 },
         { upgradeVersion2to3Fn, upgradeVersion2to3 },
+        { upgradeVersion3to4Fn, upgradeVersion3to4 },
+        { 0, upgradeVersion4to5 },
+        { 0, upgradeVersion5to6 },
     };
 
     return retn;
 }
 
+DatabaseOptions EventDatabasePrivate::defaultOptions() const
+{
+    // The event cache can always be re-synced from the server.
+    return DatabaseOptions::throughput();
+}
+
 bool EventDatabasePrivate::preTransactionCommit()
 {
-    // nothing to do.
-    return true;
+    // Record the files to delete, keeping any still referenced by a stored event.
+    QVector<QString> liveFiles;
+    for (const SyncCache::Event &event : m_storedEvents) {
+        liveFiles.append(event.imagePath.toString());
+    }
+    SyncCache::DatabaseError tombstoneError;
+    return storeFileTombstones(m_filesToDelete, liveFiles, &tombstoneError);
 }
 
 void EventDatabasePrivate::transactionCommittedPreUnlock()
@@ -161,11 +219,7 @@ void EventDatabasePrivate::transactionCommittedPreUnlock()
 
 void EventDatabasePrivate::transactionCommittedPostUnlock()
 {
-    for (const QString &doomed : m_tempFilesToDelete) {
-        if (QFile::exists(doomed)) {
-            QFile::remove(doomed);
-        }
-    }
+    reapFiles(m_tempFilesToDelete);
     if (!m_tempDeletedEvents.isEmpty()) {
         emit m_eventDbParent->eventsDeleted(m_tempDeletedEvents);
     }
@@ -199,14 +253,14 @@ QVector<SyncCache::Event> EventDatabase::events(int accountId, DatabaseError *er
     SYNCCACHE_DB_D(const EventDatabase);
 
     QString queryString = QStringLiteral("SELECT eventId, eventSubject, eventText, eventUrl, imageUrl, imagePath, timestamp, deletedLocally FROM Events"
-                                         " WHERE accountId = :accountId");
+                                         " WHERE accountId = ?");
     if (!includeLocallyDeleted) {
         queryString += QStringLiteral(" AND deletedLocally = 0");
     }
     queryString += QStringLiteral(" ORDER BY timestamp DESC, eventId ASC");
 
-    const QList<QPair<QString, QVariant> > bindValues {
-        qMakePair<QString, QVariant>(QStringLiteral(":accountId"), accountId)
+    auto binder = [accountId](DatabaseQuery &query) {
+        DatabaseImpl::bindValues(query, accountId);
     };
 
     auto resultHandler = [accountId](DatabaseQuery &selectQuery) -> SyncCache::Event {
@@ -219,7 +273,7 @@ QVector<SyncCache::Event> EventDatabase::events(int accountId, DatabaseError *er
         currEvent.eventUrl = QUrl(selectQuery.value(whichValue++).toString());
         currEvent.imageUrl = QUrl(selectQuery.value(whichValue++).toString());
         currEvent.imagePath = QUrl(selectQuery.value(whichValue++).toString());
-        currEvent.timestamp = QDateTime::fromString(selectQuery.value(whichValue++).toString(), Qt::ISODate);
+        currEvent.timestamp = DatabaseImpl::timestampFromVariant(selectQuery.value(whichValue++));
         currEvent.deletedLocally = selectQuery.value(whichValue++).toBool();
         return currEvent;
     };
@@ -227,10 +281,11 @@ QVector<SyncCache::Event> EventDatabase::events(int accountId, DatabaseError *er
     return DatabaseImpl::fetchMultiple<SyncCache::Event>(
             d,
             queryString,
-            bindValues,
+            binder,
             resultHandler,
             QStringLiteral("events"),
-            error);
+            error,
+            DatabaseImpl::SnapshotConnection);
 }
 
 Event EventDatabase::event(int accountId, const QString &eventId, DatabaseError *error) const
@@ -238,11 +293,10 @@ Event EventDatabase::event(int accountId, const QString &eventId, DatabaseError
     SYNCCACHE_DB_D(const EventDatabase);
 
     const QString queryString = QStringLiteral("SELECT eventSubject, eventText, eventUrl, imageUrl, imagePath, timestamp, deletedLocally FROM Events"
-                                               " WHERE accountId = :accountId AND eventId = :eventId");
+                                               " WHERE accountId = ? AND eventId = ?");
 
-    const QList<QPair<QString, QVariant> > bindValues {
-        qMakePair<QString, QVariant>(QStringLiteral(":accountId"), accountId),
-        qMakePair<QString, QVariant>(QStringLiteral(":eventId"), eventId)
+    auto binder = [accountId, &eventId](DatabaseQuery &query) {
+        DatabaseImpl::bindValues(query, accountId, eventId);
     };
 
     auto resultHandler = [accountId, eventId](DatabaseQuery &selectQuery) -> SyncCache::Event {
@@ -255,7 +309,7 @@ Event EventDatabase::event(int accountId, const QString &eventId, DatabaseError
         currEvent.eventUrl = QUrl(selectQuery.value(whichValue++).toString());
         currEvent.imageUrl = QUrl(selectQuery.value(whichValue++).toString());
         currEvent.imagePath = QUrl(selectQuery.value(whichValue++).toString());
-        currEvent.timestamp = QDateTime::fromString(selectQuery.value(whichValue++).toString(), Qt::ISODate);
+        currEvent.timestamp = DatabaseImpl::timestampFromVariant(selectQuery.value(whichValue++));
         currEvent.deletedLocally = selectQuery.value(whichValue++).toBool();
         return currEvent;
     };
@@ -263,7 +317,7 @@ Event EventDatabase::event(int accountId, const QString &eventId, DatabaseError
     return DatabaseImpl::fetch<SyncCache::Event>(
             d,
             queryString,
-            bindValues,
+            binder,
             resultHandler,
             QStringLiteral("event"),
             error);
@@ -298,7 +352,7 @@ void EventDatabase::storeEvent(const Event &event, DatabaseError *error)
         qMakePair<QString, QVariant>(QStringLiteral(":eventUrl"), event.eventUrl),
         qMakePair<QString, QVariant>(QStringLiteral(":imageUrl"), event.imageUrl),
         qMakePair<QString, QVariant>(QStringLiteral(":imagePath"), event.imagePath),
-        qMakePair<QString, QVariant>(QStringLiteral(":timestamp"), event.timestamp.toString(Qt::ISODate)),
+        qMakePair<QString, QVariant>(QStringLiteral(":timestamp"), DatabaseImpl::timestampToVariant(event.timestamp)),
         qMakePair<QString, QVariant>(QStringLiteral(":deletedLocally"), event.deletedLocally),
     };
 
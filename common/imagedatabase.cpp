@@ -40,9 +40,10 @@
 
 #include "synccacheimagechangenotifier_p.h"
 
-#include <QtCore/QFile>
 #include <QtCore/QDir>
 #include <QtCore/QUuid>
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QtEndian>
 #include <QtCore/QDebug>
 
 #include <QtSql/QSqlQuery>
@@ -58,6 +59,99 @@ QString constructAlbumIdentifier(int accountId, const QString &userId, const QSt
     return QStringLiteral("%1|%2|%3").arg(accountId).arg(userId, albumId);
 }
 
+// The change journal holds the latest change of each item.  A stored item is keyed
+// by its item type and integer key: the rowid of its Users or Photos row, or its
+// albumKey.  changesSince() looks its identifiers up from there, so they are not
+// duplicated into the journal.  A deleted item has no row left to look them up in,
+// so they are copied in, and its key cleared so that an item which reuses the key
+// does not replace the deletion.  The triggers replace the row on every change,
+// giving it a new, higher sequence number.  They delete and insert rather than
+// INSERT OR REPLACE, as the conflict policy of an upsert into the triggering table
+// would override OR REPLACE.
+enum ChangeItemType {
+    UserChange = 1,
+    AlbumChange = 2,
+    PhotoChange = 3
+};
+
+// Deleted items are forgotten beyond this many, recording the pruned sequence
+// number so that clients which are further behind know to reload everything.
+const int MaxDeletedChanges = 10000;
+
+const char *createChangesTable =
+        "\n CREATE TABLE Changes ("
+        "\n sequence INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "\n itemType INTEGER NOT NULL,"
+        "\n itemKey INTEGER,"
+        "\n deleted INTEGER NOT NULL,"
+        "\n accountId INTEGER,"
+        "\n userId TEXT,"
+        "\n albumId TEXT,"
+        "\n photoId TEXT,"
+        "\n UNIQUE (itemType, itemKey));";
+
+const char *createChangesDeletedIndex =
+        "\n CREATE INDEX ChangesDeletedIndex ON Changes (deleted, sequence);";
+
+const char *createChangeJournalTable =
+        "\n CREATE TABLE ChangeJournal (prunedSequence INTEGER NOT NULL);";
+
+const char *initChangeJournal =
+        "\n INSERT INTO ChangeJournal (prunedSequence) VALUES (0);";
+
+const char *createUsersInsertTrigger =
+        "\n CREATE TRIGGER UsersInsertChange AFTER INSERT ON Users BEGIN"
+        "\n DELETE FROM Changes WHERE itemType = 1 AND itemKey = NEW.rowid;"
+        "\n INSERT INTO Changes (itemType, itemKey, deleted) VALUES (1, NEW.rowid, 0);"
+        "\n END;";
+const char *createUsersUpdateTrigger =
+        "\n CREATE TRIGGER UsersUpdateChange AFTER UPDATE ON Users BEGIN"
+        "\n DELETE FROM Changes WHERE itemType = 1 AND itemKey = NEW.rowid;"
+        "\n INSERT INTO Changes (itemType, itemKey, deleted) VALUES (1, NEW.rowid, 0);"
+        "\n END;";
+const char *createUsersDeleteTrigger =
+        "\n CREATE TRIGGER UsersDeleteChange AFTER DELETE ON Users BEGIN"
+        "\n DELETE FROM Changes WHERE itemType = 1 AND itemKey = OLD.rowid;"
+        "\n INSERT INTO Changes (itemType, deleted, accountId, userId)"
+        "\n VALUES (1, 1, OLD.accountId, OLD.userId);"
+        "\n END;";
+
+const char *createAlbumsInsertTrigger =
+        "\n CREATE TRIGGER AlbumsInsertChange AFTER INSERT ON Albums BEGIN"
+        "\n DELETE FROM Changes WHERE itemType = 2 AND itemKey = NEW.albumKey;"
+        "\n INSERT INTO Changes (itemType, itemKey, deleted) VALUES (2, NEW.albumKey, 0);"
+        "\n END;";
+const char *createAlbumsUpdateTrigger =
+        "\n CREATE TRIGGER AlbumsUpdateChange AFTER UPDATE ON Albums BEGIN"
+        "\n DELETE FROM Changes WHERE itemType = 2 AND itemKey = NEW.albumKey;"
+        "\n INSERT INTO Changes (itemType, itemKey, deleted) VALUES (2, NEW.albumKey, 0);"
+        "\n END;";
+const char *createAlbumsDeleteTrigger =
+        "\n CREATE TRIGGER AlbumsDeleteChange AFTER DELETE ON Albums BEGIN"
+        "\n DELETE FROM Changes WHERE itemType = 2 AND itemKey = OLD.albumKey;"
+        "\n INSERT INTO Changes (itemType, deleted, accountId, userId, albumId)"
+        "\n VALUES (2, 1, OLD.accountId, OLD.userId, OLD.albumId);"
+        "\n END;";
+
+// Photos deleted along with their album are not journalled, as the album row is
+// already gone; the album's deletion covers them.
+const char *createPhotosInsertTrigger =
+        "\n CREATE TRIGGER PhotosInsertChange AFTER INSERT ON Photos BEGIN"
+        "\n DELETE FROM Changes WHERE itemType = 3 AND itemKey = NEW.rowid;"
+        "\n INSERT INTO Changes (itemType, itemKey, deleted) VALUES (3, NEW.rowid, 0);"
+        "\n END;";
+const char *createPhotosUpdateTrigger =
+        "\n CREATE TRIGGER PhotosUpdateChange AFTER UPDATE ON Photos BEGIN"
+        "\n DELETE FROM Changes WHERE itemType = 3 AND itemKey = NEW.rowid;"
+        "\n INSERT INTO Changes (itemType, itemKey, deleted) VALUES (3, NEW.rowid, 0);"
+        "\n END;";
+const char *createPhotosDeleteTrigger =
+        "\n CREATE TRIGGER PhotosDeleteChange AFTER DELETE ON Photos BEGIN"
+        "\n DELETE FROM Changes WHERE itemType = 3 AND itemKey = OLD.rowid;"
+        "\n INSERT INTO Changes (itemType, deleted, accountId, userId, albumId, photoId)"
+        "\n SELECT 3, 1, accountId, userId, albumId, OLD.photoId FROM Albums WHERE albumKey = OLD.albumKey;"
+        "\n END;";
+
 bool upgradeVersion1to2Fn(QSqlDatabase &database)
 {
     QSqlQuery addFileSizeQuery(QStringLiteral("ALTER TABLE Photos ADD fileSize INTEGER;"), database);
@@ -122,19 +216,31 @@ bool upgradeVersion3to4Fn(QSqlDatabase &database)
     return true;
 }
 
+bool upgradeVersion4to5Fn(QSqlDatabase &database)
+{
+    // The column affinity is changed to INTEGER by the table rebuild in the upgrade statements,
+    // which converts the numeric text written here.
+    return DatabaseImpl::convertTimestampColumns(database, QStringLiteral("Photos"),
+                                                 QStringList() << QStringLiteral("createdTimestamp")
+                                                               << QStringLiteral("updatedTimestamp"));
+}
+
 }
 
-ImageDatabasePrivate::ImageDatabasePrivate(ImageDatabase *parent, bool emitCrossProcessChangeNotifications)
+ImageDatabasePrivate::ImageDatabasePrivate(ImageDatabase *parent, bool emitCrossProcessChangeNotifications, ImageDatabase::Access access)
     : DatabasePrivate(parent)
     , m_imageDbParent(parent)
     , m_emitCrossProcessChangeNotifications(emitCrossProcessChangeNotifications)
 {
-    m_changeNotifier.reset(new ImageChangeNotifier(parent));
+    m_readOnly = access == ImageDatabase::ReadOnly;
+    if (!m_readOnly) {
+        m_changeNotifier.reset(new ImageChangeNotifier(parent));
+    }
 }
 
 int ImageDatabasePrivate::currentSchemaVersion() const
 {
-    return 4;
+    return 9;
 }
 
 QVector<const char *> ImageDatabasePrivate::createStatements() const
@@ -149,8 +255,11 @@ QVector<const char *> ImageDatabasePrivate::createStatements() const
             "\n thumbnailFileName TEXT,"
             "\n PRIMARY KEY (accountId, userId));";
 
+    // Photos reference their album by the integer albumKey rather than by the
+    // (accountId, userId, albumId) triple, to keep the Photos rows and keys small.
     static const char *createAlbumsTable =
             "\n CREATE TABLE Albums ("
+            "\n albumKey INTEGER PRIMARY KEY,"
             "\n accountId INTEGER,"
             "\n userId TEXT,"
             "\n albumId TEXT,"
@@ -161,20 +270,18 @@ QVector<const char *> ImageDatabasePrivate::createStatements() const
             "\n albumName TEXT,"
             "\n thumbnailFileName TEXT,"
             "\n etag TEXT,"
-            "\n PRIMARY KEY (accountId, userId, albumId),"
+            "\n UNIQUE (accountId, userId, albumId),"
             "\n FOREIGN KEY (accountId, userId) REFERENCES Users (accountId, userId) ON DELETE CASCADE);";
 
     static const char *createPhotosTable =
             "\n CREATE TABLE Photos ("
-            "\n accountId INTEGER,"
-            "\n userId TEXT,"
-            "\n albumId TEXT,"
+            "\n albumKey INTEGER NOT NULL,"
             "\n photoId TEXT,"
             "\n fileName TEXT,"
             "\n albumPath TEXT,"
             "\n description TEXT,"
-            "\n createdTimestamp TEXT,"
-            "\n updatedTimestamp TEXT,"
+            "\n createdTimestamp INTEGER,"
+            "\n updatedTimestamp INTEGER,"
             "\n thumbnailUrl TEXT,"
             "\n thumbnailPath TEXT,"
             "\n imageUrl TEXT,"
@@ -184,10 +291,29 @@ QVector<const char *> ImageDatabasePrivate::createStatements() const
             "\n fileSize INTEGER,"
             "\n fileType TEXT,"
             "\n etag TEXT,"
-            "\n PRIMARY KEY (accountId, userId, albumId, photoId),"
-            "\n FOREIGN KEY (accountId, userId, albumId) REFERENCES Albums (accountId, userId, albumId) ON DELETE CASCADE);";
-
-    static QVector<const char *> retn { createUsersTable, createAlbumsTable, createPhotosTable };
+            "\n PRIMARY KEY (albumKey, photoId),"
+            "\n FOREIGN KEY (albumKey) REFERENCES Albums (albumKey) ON DELETE CASCADE);";
+
+    // Serves albums() filtered by parentAlbumId.
+    static const char *createAlbumsParentIndex =
+            "\n CREATE INDEX AlbumsParentIndex ON Albums (accountId, userId, parentAlbumId, albumId);";
+
+    // Serves the ordering of photos() without a temporary sort.
+    static const char *createPhotosCreatedIndex =
+            "\n CREATE INDEX PhotosCreatedIndex ON Photos (albumKey, createdTimestamp DESC);";
+
+    // Covers findThumbnailForAlbum(), so that it reads only the index.
+    static const char *createPhotosUpdatedIndex =
+            "\n CREATE INDEX PhotosUpdatedIndex ON Photos (albumKey, updatedTimestamp, thumbnailPath);";
+
+    static QVector<const char *> retn { createUsersTable, createAlbumsTable, createPhotosTable,
+                                        createAlbumsParentIndex, createPhotosCreatedIndex, createPhotosUpdatedIndex,
+                                        createChangesTable, createChangesDeletedIndex,
+                                        createChangeJournalTable, initChangeJournal,
+                                        createUsersInsertTrigger, createUsersUpdateTrigger, createUsersDeleteTrigger,
+                                        createAlbumsInsertTrigger, createAlbumsUpdateTrigger, createAlbumsDeleteTrigger,
+                                        createPhotosInsertTrigger, createPhotosUpdateTrigger, createPhotosDeleteTrigger,
+                                        DatabaseImpl::createFileTombstonesTable };
     return retn;
 }
 
@@ -213,16 +339,146 @@ QVector<UpgradeOperation> ImageDatabasePrivate::upgradeVersions() const
          0 // NULL-terminated
     };
 
+    static const char *upgradeVersion4to5[] = {
+         "\n CREATE TABLE Photos_new ("
+         "\n accountId INTEGER,"
+         "\n userId TEXT,"
+         "\n albumId TEXT,"
+         "\n photoId TEXT,"
+         "\n fileName TEXT,"
+         "\n albumPath TEXT,"
+         "\n description TEXT,"
+         "\n createdTimestamp INTEGER,"
+         "\n updatedTimestamp INTEGER,"
+         "\n thumbnailUrl TEXT,"
+         "\n thumbnailPath TEXT,"
+         "\n imageUrl TEXT,"
+         "\n imagePath TEXT,"
+         "\n imageWidth INTEGER,"
+         "\n imageHeight INTEGER,"
+         "\n fileSize INTEGER,"
+         "\n fileType TEXT,"
+         "\n etag TEXT,"
+         "\n PRIMARY KEY (accountId, userId, albumId, photoId),"
+         "\n FOREIGN KEY (accountId, userId, albumId) REFERENCES Albums (accountId, userId, albumId) ON DELETE CASCADE);",
+         "INSERT INTO Photos_new (accountId, userId, albumId, photoId, fileName, albumPath, description, createdTimestamp, updatedTimestamp,"
+         " thumbnailUrl, thumbnailPath, imageUrl, imagePath, imageWidth, imageHeight, fileSize, fileType, etag)"
+         " SELECT accountId, userId, albumId, photoId, fileName, albumPath, description, createdTimestamp, updatedTimestamp,"
+         " thumbnailUrl, thumbnailPath, imageUrl, imagePath, imageWidth, imageHeight, fileSize, fileType, etag FROM Photos",
+         "DROP TABLE Photos",
+         "ALTER TABLE Photos_new RENAME TO Photos",
+         "PRAGMA user_version=5",
+         0 // NULL-terminated
+    };
+
+    static const char *upgradeVersion5to6[] = {
+         "CREATE INDEX AlbumsParentIndex ON Albums (accountId, userId, parentAlbumId, albumId)",
+         "CREATE INDEX PhotosCreatedIndex ON Photos (accountId, userId, albumId, createdTimestamp DESC)",
+         "CREATE INDEX PhotosUpdatedIndex ON Photos (accountId, userId, albumId, updatedTimestamp, thumbnailPath)",
+         "PRAGMA user_version=6",
+         0 // NULL-terminated
+    };
+
+    static const char *upgradeVersion6to7[] = {
+         "\n CREATE TABLE Albums_new ("
+         "\n albumKey INTEGER PRIMARY KEY,"
+         "\n accountId INTEGER,"
+         "\n userId TEXT,"
+         "\n albumId TEXT,"
+         "\n photoCount INTEGER,"
+         "\n thumbnailUrl TEXT,"
+         "\n thumbnailPath TEXT,"
+         "\n parentAlbumId TEXT,"
+         "\n albumName TEXT,"
+         "\n thumbnailFileName TEXT,"
+         "\n etag TEXT,"
+         "\n UNIQUE (accountId, userId, albumId),"
+         "\n FOREIGN KEY (accountId, userId) REFERENCES Users (accountId, userId) ON DELETE CASCADE);",
+         "INSERT INTO Albums_new (accountId, userId, albumId, photoCount, thumbnailUrl, thumbnailPath, parentAlbumId, albumName, thumbnailFileName, etag)"
+         " SELECT accountId, userId, albumId, photoCount, thumbnailUrl, thumbnailPath, parentAlbumId, albumName, thumbnailFileName, etag FROM Albums",
+         "\n CREATE TABLE Photos_new ("
+         "\n albumKey INTEGER NOT NULL,"
+         "\n photoId TEXT,"
+         "\n fileName TEXT,"
+         "\n albumPath TEXT,"
+         "\n description TEXT,"
+         "\n createdTimestamp INTEGER,"
+         "\n updatedTimestamp INTEGER,"
+         "\n thumbnailUrl TEXT,"
+         "\n thumbnailPath TEXT,"
+         "\n imageUrl TEXT,"
+         "\n imagePath TEXT,"
+         "\n imageWidth INTEGER,"
+         "\n imageHeight INTEGER,"
+         "\n fileSize INTEGER,"
+         "\n fileType TEXT,"
+         "\n etag TEXT,"
+         "\n PRIMARY KEY (albumKey, photoId),"
+         "\n FOREIGN KEY (albumKey) REFERENCES Albums_new (albumKey) ON DELETE CASCADE);",
+         "INSERT INTO Photos_new (albumKey, photoId, fileName, albumPath, description, createdTimestamp, updatedTimestamp,"
+         " thumbnailUrl, thumbnailPath, imageUrl, imagePath, imageWidth, imageHeight, fileSize, fileType, etag)"
+         " SELECT Albums_new.albumKey, Photos.photoId, Photos.fileName, Photos.albumPath, Photos.description,"
+         " Photos.createdTimestamp, Photos.updatedTimestamp, Photos.thumbnailUrl, Photos.thumbnailPath, Photos.imageUrl, Photos.imagePath,"
+         " Photos.imageWidth, Photos.imageHeight, Photos.fileSize, Photos.fileType, Photos.etag"
+         " FROM Photos JOIN Albums_new ON Albums_new.accountId = Photos.accountId"
+         " AND Albums_new.userId = Photos.userId AND Albums_new.albumId = Photos.albumId",
+         "DROP TABLE Photos",
+         "DROP TABLE Albums",
+         // With foreign keys enabled, renaming also updates the reference from Photos_new.
+         "ALTER TABLE Albums_new RENAME TO Albums",
+         "ALTER TABLE Photos_new RENAME TO Photos",
+         "CREATE INDEX AlbumsParentIndex ON Albums (accountId, userId, parentAlbumId, albumId)",
+         "CREATE INDEX PhotosCreatedIndex ON Photos (albumKey, createdTimestamp DESC)",
+         "CREATE INDEX PhotosUpdatedIndex ON Photos (albumKey, updatedTimestamp, thumbnailPath)",
+         "PRAGMA user_version=7",
+         0 // NULL-terminated
+    };
+
+    static const char *upgradeVersion7to8[] = {
+         createChangesTable,
+         createChangesDeletedIndex,
+         createChangeJournalTable,
+         initChangeJournal,
+         createUsersInsertTrigger,
+         createUsersUpdateTrigger,
+         createUsersDeleteTrigger,
+         createAlbumsInsertTrigger,
+         createAlbumsUpdateTrigger,
+         createAlbumsDeleteTrigger,
+         createPhotosInsertTrigger,
+         createPhotosUpdateTrigger,
+         createPhotosDeleteTrigger,
+         "PRAGMA user_version=8",
+         0 // NULL-terminated
+    };
+
+    static const char *upgradeVersion8to9[] = {
+         DatabaseImpl::createFileTombstonesTable,
+         "PRAGMA user_version=9",
+         0 // NULL-terminated
+    };
+
     static QVector<UpgradeOperation> retn {
         { 0, upgradeVersion0to1 },
         { upgradeVersion1to2Fn, upgradeVersion1to2 },
         { upgradeVersion2to3Fn, upgradeVersion2to3 },
         { upgradeVersion3to4Fn, upgradeVersion3to4 },
+        { upgradeVersion4to5Fn, upgradeVersion4to5 },
+        { 0, upgradeVersion5to6 },
+        { 0, upgradeVersion6to7 },
+        { 0, upgradeVersion7to8 },
+        { 0, upgradeVersion8to9 },
     };
 
     return retn;
 }
 
+DatabaseOptions ImageDatabasePrivate::defaultOptions() const
+{
+    // The image cache can always be re-synced from the server.
+    return DatabaseOptions::throughput();
+}
+
 bool ImageDatabasePrivate::preTransactionCommit()
 {
     // Fixup album thumbnails if required.
@@ -230,78 +486,246 @@ bool ImageDatabasePrivate::preTransactionCommit()
     if (!m_deletedPhotos.isEmpty()
             || !m_storedPhotos.isEmpty()) {
         // potentially need to update album thumbnails.
+        // Collect the distinct affected albums, and check them all at once
+        // rather than issuing a few queries per album.
         QSet<QString> doomedAlbums;
         Q_FOREACH (const SyncCache::Album &doomed, m_deletedAlbums) {
             doomedAlbums.insert(constructAlbumIdentifier(doomed.accountId, doomed.userId, doomed.albumId));
         }
-        QHash<QString, SyncCache::Album> thumbnailAlbums;
-        Q_FOREACH (const SyncCache::Photo &photo, m_deletedPhotos) {
+        QSet<QString> affectedAlbumIdentifiers;
+        QVector<SyncCache::Album> affectedAlbums;
+        auto addAffectedAlbum = [&](const SyncCache::Photo &photo) {
             const QString albumIdentifier = constructAlbumIdentifier(photo.accountId, photo.userId, photo.albumId);
-            if (!thumbnailAlbums.contains(albumIdentifier) && !doomedAlbums.contains(albumIdentifier)) {
-                SyncCache::Album album = m_imageDbParent->album(photo.accountId, photo.userId, photo.albumId, &thumbnailError);
-                if (thumbnailError.errorCode == SyncCache::DatabaseError::NoError && !album.albumId.isEmpty()) {
-                    thumbnailAlbums.insert(albumIdentifier, album);
-                }
+            if (!doomedAlbums.contains(albumIdentifier) && !affectedAlbumIdentifiers.contains(albumIdentifier)) {
+                affectedAlbumIdentifiers.insert(albumIdentifier);
+                SyncCache::Album album;
+                album.accountId = photo.accountId;
+                album.userId = photo.userId;
+                album.albumId = photo.albumId;
+                affectedAlbums.append(album);
             }
+        };
+        Q_FOREACH (const SyncCache::Photo &photo, m_deletedPhotos) {
+            addAffectedAlbum(photo);
         }
-        thumbnailError.errorCode = SyncCache::DatabaseError::NoError;
         Q_FOREACH (const SyncCache::Photo &photo, m_storedPhotos) {
-            const QString albumIdentifier = constructAlbumIdentifier(photo.accountId, photo.userId, photo.albumId);
-            if (!thumbnailAlbums.contains(albumIdentifier)) {
-                SyncCache::Album album = m_imageDbParent->album(photo.accountId, photo.userId, photo.albumId, &thumbnailError);
-                if (thumbnailError.errorCode == SyncCache::DatabaseError::NoError && !album.albumId.isEmpty()) {
-                    thumbnailAlbums.insert(albumIdentifier, album);
-                }
-            }
+            addAffectedAlbum(photo);
         }
-        thumbnailError.errorCode = SyncCache::DatabaseError::NoError;
-        Q_FOREACH (const SyncCache::Album &album, thumbnailAlbums) {
-            // if the album uses a photo image as its thumbnail
-            // and if that photo image is set to be deleted,
-            // use another photo's image (or null if album is empty).
-            if (album.thumbnailUrl.isEmpty()
-                    && (album.thumbnailPath.isEmpty()
-                          || m_filesToDelete.contains(album.thumbnailPath.toString()))) {
-                QUrl updatedAlbumThumbnailPath;
-                const QVector<SyncCache::Photo> photos = m_imageDbParent->photos(
-                        album.accountId, album.userId, album.albumId, &thumbnailError);
-                Q_FOREACH (const SyncCache::Photo &photo, photos) {
-                    if (!photo.imagePath.isEmpty()) {
-                        updatedAlbumThumbnailPath = photo.imagePath;
-                        break;
-                    }
-                }
 
-                // update the album in the database if it previously didn't have a valid
-                // thumbnail but now does, or if its previous thumbnail path is no longer
-                // valid and must be changed.
-                if (!updatedAlbumThumbnailPath.isEmpty() || !album.thumbnailPath.isEmpty()) {
-                    SyncCache::Album updateAlbum = album;
-                    updateAlbum.thumbnailPath = updatedAlbumThumbnailPath;
-                    m_imageDbParent->storeAlbum(updateAlbum, &thumbnailError);
-                    // also update the cached copy in the m_storedAlbums vector
-                    // as the change signals depend on its contents.
-                    if (thumbnailError.errorCode == SyncCache::DatabaseError::NoError) {
-                        bool found = false;
-                        for (SyncCache::Album &storedAlbum : m_storedAlbums) {
-                            if (storedAlbum.accountId == updateAlbum.accountId
-                                    && storedAlbum.userId == updateAlbum.userId
-                                    && storedAlbum.albumId == updateAlbum.albumId) {
-                                storedAlbum.thumbnailPath = updateAlbum.thumbnailPath;
-                                found = true;
-                                break;
-                            }
-                        }
-                        if (!found) {
-                            m_storedAlbums.append(updateAlbum);
-                        }
-                    }
+        const QVector<SyncCache::Album> updatedAlbums = fixupAlbumThumbnails(affectedAlbums, &thumbnailError);
+
+        // also update the cached copies in the m_storedAlbums vector
+        // as the change signals depend on its contents.
+        if (!updatedAlbums.isEmpty()) {
+            QHash<QString, int> storedAlbumIndexes;
+            for (int i = 0; i < m_storedAlbums.size(); ++i) {
+                const SyncCache::Album &storedAlbum(m_storedAlbums.at(i));
+                storedAlbumIndexes.insert(constructAlbumIdentifier(storedAlbum.accountId, storedAlbum.userId, storedAlbum.albumId), i);
+            }
+            for (const SyncCache::Album &updatedAlbum : updatedAlbums) {
+                const int index = storedAlbumIndexes.value(
+                        constructAlbumIdentifier(updatedAlbum.accountId, updatedAlbum.userId, updatedAlbum.albumId), -1);
+                if (index >= 0) {
+                    m_storedAlbums[index].thumbnailPath = updatedAlbum.thumbnailPath;
+                } else {
+                    m_storedAlbums.append(updatedAlbum);
                 }
             }
         }
     }
 
-    return thumbnailError.errorCode == SyncCache::DatabaseError::NoError;
+    // Record the files to delete, keeping any still referenced by a stored item.
+    SyncCache::DatabaseError tombstoneError;
+    QVector<QString> liveFiles;
+    for (const SyncCache::User &user : m_storedUsers) {
+        liveFiles.append(user.thumbnailPath.toString());
+    }
+    for (const SyncCache::Album &album : m_storedAlbums) {
+        liveFiles.append(album.thumbnailPath.toString());
+    }
+    for (const SyncCache::Photo &photo : m_storedPhotos) {
+        liveFiles.append(photo.thumbnailPath.toString());
+        liveFiles.append(photo.imagePath.toString());
+    }
+    storeFileTombstones(m_filesToDelete, liveFiles, &tombstoneError);
+
+    // Bound the number of deleted items kept in the change journal.
+    SyncCache::DatabaseError pruneError;
+    if (!m_deletedUsers.isEmpty() || !m_deletedAlbums.isEmpty() || !m_deletedPhotos.isEmpty()) {
+        const QString pruneSequenceString = QStringLiteral(
+                "UPDATE ChangeJournal SET prunedSequence = COALESCE("
+                "(SELECT sequence FROM Changes WHERE deleted = 1 ORDER BY sequence DESC LIMIT 1 OFFSET ?),"
+                " prunedSequence)");
+        const QString pruneChangesString = QStringLiteral(
+                "DELETE FROM Changes WHERE deleted = 1 AND sequence <= (SELECT prunedSequence FROM ChangeJournal)");
+        auto binder = [](DatabaseQuery &query) {
+            DatabaseImpl::bindValues(query, MaxDeletedChanges);
+        };
+        DatabaseImpl::store<int>(this, pruneSequenceString, binder, [] {}, QStringLiteral("pruneSequence"), &pruneError);
+        if (pruneError.errorCode == SyncCache::DatabaseError::NoError) {
+            DatabaseImpl::store<int>(this, pruneChangesString, [](DatabaseQuery &) {}, [] {},
+                                     QStringLiteral("pruneChanges"), &pruneError);
+        }
+        if (pruneError.errorCode != SyncCache::DatabaseError::NoError) {
+            qWarning() << "Failed to prune change journal:" << pruneError.errorMessage;
+        }
+    }
+
+    // The sequence number of the last change in this transaction, for the change notification.
+    SyncCache::DatabaseError sequenceError;
+    auto sequenceHandler = [](DatabaseQuery &selectQuery) -> qint64 {
+        return selectQuery.value(0).toLongLong();
+    };
+    m_commitSequence = DatabaseImpl::fetch<qint64>(
+            this,
+            QStringLiteral("SELECT COALESCE(MAX(sequence), 0) FROM Changes"),
+            [](DatabaseQuery &) {},
+            sequenceHandler,
+            QStringLiteral("commitSequence"),
+            &sequenceError);
+
+    return thumbnailError.errorCode == SyncCache::DatabaseError::NoError
+            && tombstoneError.errorCode == SyncCache::DatabaseError::NoError
+            && pruneError.errorCode == SyncCache::DatabaseError::NoError;
+}
+
+// Recalculates the photo thumbnail of the given albums, returning the albums
+// whose thumbnail changed.  The albums are staged in a temporary table so that
+// the candidates are found with one query and updated with another, however
+// many albums and photos the transaction touched.
+QVector<Album> ImageDatabasePrivate::fixupAlbumThumbnails(const QVector<Album> &albums, DatabaseError *error)
+{
+    if (albums.isEmpty()) {
+        return QVector<Album>();
+    }
+
+    static const char *const fixupStatements[] = {
+        "CREATE TEMP TABLE IF NOT EXISTS ThumbnailFixupAlbums ("
+        " accountId INTEGER, userId TEXT, albumId TEXT,"
+        " PRIMARY KEY (accountId, userId, albumId))",
+        "CREATE TEMP TABLE IF NOT EXISTS ThumbnailFixupFiles (path TEXT PRIMARY KEY)",
+        "DELETE FROM temp.ThumbnailFixupAlbums",
+        "DELETE FROM temp.ThumbnailFixupFiles",
+    };
+    for (const char *statement : fixupStatements) {
+        DatabaseImpl::store<int>(this, QLatin1String(statement), [](DatabaseQuery &) {}, [] {},
+                                 QStringLiteral("thumbnailFixupSetup"), error);
+        if (error->errorCode != DatabaseError::NoError) {
+            return QVector<Album>();
+        }
+    }
+
+    auto albumBinder = [](DatabaseQuery &query, const Album &album) {
+        DatabaseImpl::bindValues(query, album.accountId, album.userId, album.albumId);
+    };
+    DatabaseImpl::storeMultiple<Album>(
+            this,
+            QStringLiteral("INSERT OR IGNORE INTO temp.ThumbnailFixupAlbums (accountId, userId, albumId) VALUES (?, ?, ?)"),
+            albums,
+            albumBinder,
+            [](const Album &) {},
+            QStringLiteral("thumbnailFixupAlbums"),
+            error);
+    if (error->errorCode != DatabaseError::NoError) {
+        return QVector<Album>();
+    }
+
+    auto fileBinder = [](DatabaseQuery &query, const QString &path) {
+        DatabaseImpl::bindValues(query, path);
+    };
+    DatabaseImpl::storeMultiple<QString>(
+            this,
+            QStringLiteral("INSERT OR IGNORE INTO temp.ThumbnailFixupFiles (path) VALUES (?)"),
+            m_filesToDelete,
+            fileBinder,
+            [](const QString &) {},
+            QStringLiteral("thumbnailFixupFiles"),
+            error);
+    if (error->errorCode != DatabaseError::NoError) {
+        return QVector<Album>();
+    }
+
+    // An album needs a new thumbnail if it uses a photo image as its thumbnail
+    // and has either none yet or one whose file is set to be deleted.
+    // The newest photo with an image becomes the thumbnail (or null if there is none).
+    // CROSS JOIN keeps the staged albums as the outer loop, so that each one is
+    // a single index lookup into Albums.
+    const QString candidatesQuery = QStringLiteral(
+            "SELECT Albums.accountId, Albums.userId, Albums.albumId, Albums.photoCount,"
+            " Albums.thumbnailUrl, Albums.thumbnailPath, Albums.parentAlbumId, Albums.albumName,"
+            " Albums.thumbnailFileName, Albums.etag,"
+            " (SELECT imagePath FROM Photos WHERE Photos.albumKey = Albums.albumKey AND COALESCE(imagePath, '') != ''"
+            "  ORDER BY createdTimestamp DESC LIMIT 1)"
+            " FROM temp.ThumbnailFixupAlbums AS Fixup CROSS JOIN Albums"
+            " ON Albums.accountId = Fixup.accountId AND Albums.userId = Fixup.userId AND Albums.albumId = Fixup.albumId"
+            " WHERE COALESCE(Albums.thumbnailUrl, '') = ''"
+            " AND (COALESCE(Albums.thumbnailPath, '') = '' OR Albums.thumbnailPath IN (SELECT path FROM temp.ThumbnailFixupFiles))");
+
+    auto resultHandler = [](DatabaseQuery &selectQuery) -> Album {
+        int whichValue = 0;
+        Album currAlbum;
+        currAlbum.accountId = selectQuery.value(whichValue++).toInt();
+        currAlbum.userId = selectQuery.value(whichValue++).toString();
+        currAlbum.albumId = selectQuery.value(whichValue++).toString();
+        currAlbum.photoCount = selectQuery.value(whichValue++).toInt();
+        currAlbum.thumbnailUrl = QUrl(selectQuery.value(whichValue++).toString());
+        currAlbum.thumbnailPath = QUrl(selectQuery.value(whichValue++).toString());
+        currAlbum.parentAlbumId = selectQuery.value(whichValue++).toString();
+        currAlbum.albumName = selectQuery.value(whichValue++).toString();
+        currAlbum.thumbnailFileName = selectQuery.value(whichValue++).toString();
+        currAlbum.etag = selectQuery.value(whichValue++).toString();
+        const QUrl updatedAlbumThumbnailPath = QUrl(selectQuery.value(whichValue++).toString());
+        // only report the album if it previously didn't have a valid thumbnail
+        // but now does, or if its previous thumbnail path is no longer valid.
+        if (updatedAlbumThumbnailPath.isEmpty() && currAlbum.thumbnailPath.isEmpty()) {
+            return Album();
+        }
+        currAlbum.thumbnailPath = updatedAlbumThumbnailPath;
+        return currAlbum;
+    };
+
+    QVector<Album> candidates = DatabaseImpl::fetchMultiple<Album>(
+            this,
+            candidatesQuery,
+            [](DatabaseQuery &) {},
+            resultHandler,
+            QStringLiteral("thumbnailFixupCandidates"),
+            error);
+    if (error->errorCode != DatabaseError::NoError) {
+        return QVector<Album>();
+    }
+
+    QVector<Album> updatedAlbums;
+    for (const Album &candidate : candidates) {
+        if (!candidate.albumId.isEmpty()) {
+            updatedAlbums.append(candidate);
+        }
+    }
+    if (updatedAlbums.isEmpty()) {
+        return updatedAlbums;
+    }
+
+    // Apply the same selection as a single update, skipping albums which had
+    // no thumbnail and still have none so as not to journal a spurious change.
+    const QString updateQuery = QStringLiteral(
+            "UPDATE Albums SET thumbnailPath = (SELECT imagePath FROM Photos"
+            "  WHERE Photos.albumKey = Albums.albumKey AND COALESCE(imagePath, '') != ''"
+            "  ORDER BY createdTimestamp DESC LIMIT 1)"
+            " WHERE albumKey IN (SELECT Candidates.albumKey"
+            "  FROM temp.ThumbnailFixupAlbums AS Fixup CROSS JOIN Albums AS Candidates"
+            "  ON Candidates.accountId = Fixup.accountId AND Candidates.userId = Fixup.userId AND Candidates.albumId = Fixup.albumId"
+            "  WHERE COALESCE(Candidates.thumbnailUrl, '') = ''"
+            "  AND (COALESCE(Candidates.thumbnailPath, '') = '' OR Candidates.thumbnailPath IN (SELECT path FROM temp.ThumbnailFixupFiles)))"
+            " AND (COALESCE(thumbnailPath, '') != ''"
+            "  OR EXISTS (SELECT 1 FROM Photos WHERE Photos.albumKey = Albums.albumKey AND COALESCE(imagePath, '') != ''))");
+
+    DatabaseImpl::store<int>(this, updateQuery, [](DatabaseQuery &) {}, [] {},
+                             QStringLiteral("thumbnailFixupUpdate"), error);
+    if (error->errorCode != DatabaseError::NoError) {
+        return QVector<Album>();
+    }
+
+    return updatedAlbums;
 }
 
 void ImageDatabasePrivate::transactionCommittedPreUnlock()
@@ -313,6 +737,7 @@ void ImageDatabasePrivate::transactionCommittedPreUnlock()
     m_tempStoredUsers = m_storedUsers;
     m_tempStoredAlbums = m_storedAlbums;
     m_tempStoredPhotos = m_storedPhotos;
+    m_tempCommitSequence = m_commitSequence;
 
     m_filesToDelete.clear();
     m_deletedUsers.clear();
@@ -325,11 +750,7 @@ void ImageDatabasePrivate::transactionCommittedPreUnlock()
 
 void ImageDatabasePrivate::transactionCommittedPostUnlock()
 {
-    for (const QString &doomed : m_tempFilesToDelete) {
-        if (QFile::exists(doomed)) {
-            QFile::remove(doomed);
-        }
-    }
+    reapFiles(m_tempFilesToDelete);
 
     bool dataChanged = false;
     if (!m_tempDeletedUsers.isEmpty()) {
@@ -359,7 +780,25 @@ void ImageDatabasePrivate::transactionCommittedPostUnlock()
     }
 
     if (dataChanged && m_changeNotifier && m_emitCrossProcessChangeNotifications) {
-        m_changeNotifier->dataChanged(); // emit cross-process change signal.
+        QList<quint64> scopes;
+        auto addScope = [&scopes](int accountId, const QString &userId, const QString &albumId) {
+            const quint64 scope = ImageDatabase::changeScope(accountId, userId, albumId);
+            if (!scopes.contains(scope)) {
+                scopes.append(scope);
+            }
+        };
+        for (const SyncCache::User &user : m_tempDeletedUsers + m_tempStoredUsers) {
+            addScope(user.accountId, user.userId, QString());
+        }
+        for (const SyncCache::Album &album : m_tempDeletedAlbums + m_tempStoredAlbums) {
+            addScope(album.accountId, album.userId, QString());
+            addScope(album.accountId, album.userId, album.albumId);
+        }
+        for (const SyncCache::Photo &photo : m_tempDeletedPhotos + m_tempStoredPhotos) {
+            addScope(photo.accountId, photo.userId, QString());
+            addScope(photo.accountId, photo.userId, photo.albumId);
+        }
+        m_changeNotifier->dataChanged(m_tempCommitSequence, scopes); // emit cross-process change signal.
     }
 }
 
@@ -374,32 +813,25 @@ void ImageDatabasePrivate::transactionRolledBackPreUnlocked()
     m_storedPhotos.clear();
 }
 
-//-----------------------------------------------------------------------------
-
-ImageDatabase::ImageDatabase(QObject *parent, bool emitCrossProcessChangeNotifications)
-    : Database(new ImageDatabasePrivate(this, emitCrossProcessChangeNotifications), parent)
+User ImageDatabasePrivate::fetchUser(int accountId, DatabaseError *error, DatabaseImpl::ReadConnection connection) const
 {
-    qRegisterMetaType<SyncCache::User>();
-    qRegisterMetaType<SyncCache::Album>();
-    qRegisterMetaType<SyncCache::Photo>();
-    qRegisterMetaType<QVector<SyncCache::User> >();
-    qRegisterMetaType<QVector<SyncCache::Album> >();
-    qRegisterMetaType<QVector<SyncCache::Photo> >();
-}
-
-QVector<SyncCache::User> ImageDatabase::users(DatabaseError *error) const
-{
-    SYNCCACHE_DB_D(const ImageDatabase);
+    if (accountId <= 0) {
+        Database::setDatabaseError(error, DatabaseError::InvalidArgumentError,
+                                   QStringLiteral("Cannot fetch user, invalid accountId: %1").arg(accountId));
+        return User();
+    }
 
-    const QString queryString = QStringLiteral("SELECT accountId, userId, displayName, thumbnailUrl, thumbnailPath, thumbnailFileName FROM USERS"
-                                               " ORDER BY accountId ASC, userId ASC");
+    const QList<QPair<QString, QVariant> > bindValues {
+        qMakePair<QString, QVariant>(QStringLiteral(":accountId"), accountId)
+    };
 
-    const QList<QPair<QString, QVariant> > bindValues;
+    const QString queryString = QStringLiteral("SELECT userId, displayName, thumbnailUrl, thumbnailPath, thumbnailFileName FROM USERS"
+                                               " WHERE accountId = :accountId");
 
-    auto resultHandler = [](DatabaseQuery &selectQuery) -> SyncCache::User {
+    auto resultHandler = [accountId](DatabaseQuery &selectQuery) -> SyncCache::User {
         int whichValue = 0;
         User currUser;
-        currUser.accountId = selectQuery.value(whichValue++).toInt();
+        currUser.accountId = accountId;
         currUser.userId = selectQuery.value(whichValue++).toString();
         currUser.displayName = selectQuery.value(whichValue++).toString();
         currUser.thumbnailUrl = QUrl(selectQuery.value(whichValue++).toString());
@@ -408,52 +840,47 @@ QVector<SyncCache::User> ImageDatabase::users(DatabaseError *error) const
         return currUser;
     };
 
-    return DatabaseImpl::fetchMultiple<SyncCache::User>(
-            d,
+    return DatabaseImpl::fetch<SyncCache::User>(
+            this,
             queryString,
             bindValues,
             resultHandler,
-            QStringLiteral("users"),
-            error);
+            QStringLiteral("user"),
+            error,
+            connection);
 }
 
-QVector<SyncCache::Album> ImageDatabase::albums(int accountId, const QString &userId, DatabaseError *error, const QString &parentAlbumId) const
+Album ImageDatabasePrivate::fetchAlbum(int accountId, const QString &userId, const QString &albumId, DatabaseError *error, DatabaseImpl::ReadConnection connection) const
 {
-    SYNCCACHE_DB_D(const ImageDatabase);
-
     if (accountId <= 0) {
-        setDatabaseError(error, DatabaseError::InvalidArgumentError,
-                         QStringLiteral("Cannot fetch albums, invalid accountId: %1").arg(accountId));
-        return QVector<SyncCache::Album>();
+        Database::setDatabaseError(error, DatabaseError::InvalidArgumentError,
+                                   QStringLiteral("Cannot fetch album, invalid accountId: %1").arg(accountId));
+        return Album();
     }
     if (userId.isEmpty()) {
-        setDatabaseError(error, DatabaseError::InvalidArgumentError,
-                         QStringLiteral("Cannot fetch albums, userId is empty"));
-        return QVector<SyncCache::Album>();
+        Database::setDatabaseError(error, DatabaseError::InvalidArgumentError,
+                                   QStringLiteral("Cannot fetch album, userId is empty"));
+        return Album();
+    }
+    if (albumId.isEmpty()) {
+        Database::setDatabaseError(error, DatabaseError::InvalidArgumentError,
+                                   QStringLiteral("Cannot fetch album, albumId is empty"));
+        return Album();
     }
 
-    const QString parentAlbumIdClause = parentAlbumId.isEmpty()
-            ? QString()
-            : QStringLiteral(" AND parentAlbumId = :parentAlbumId");
-    const QString queryString = QStringLiteral("SELECT albumId, photoCount, thumbnailUrl, thumbnailPath, parentAlbumId, albumName, thumbnailFileName, etag FROM ALBUMS"
-                                               " WHERE accountId = :accountId AND userId = :userId"
-                                               "%1"
-                                               " ORDER BY accountId ASC, userId ASC, albumId ASC").arg(parentAlbumIdClause);
+    const QString queryString = QStringLiteral("SELECT photoCount, thumbnailUrl, thumbnailPath, parentAlbumId, albumName, thumbnailFileName, etag FROM ALBUMS"
+                                               " WHERE accountId = ? AND userId = ? AND albumId = ?");
 
-    QList<QPair<QString, QVariant> > bindValues {
-        qMakePair<QString, QVariant>(QStringLiteral(":accountId"), accountId),
-        qMakePair<QString, QVariant>(QStringLiteral(":userId"), userId)
+    auto binder = [accountId, &userId, &albumId](DatabaseQuery &query) {
+        DatabaseImpl::bindValues(query, accountId, userId, albumId);
     };
-    if (!parentAlbumIdClause.isEmpty()) {
-        bindValues.append(qMakePair<QString, QVariant>(QStringLiteral(":parentAlbumId"), parentAlbumId));
-    }
 
-    auto resultHandler = [accountId, userId](DatabaseQuery &selectQuery) -> SyncCache::Album {
+    auto resultHandler = [accountId, userId, albumId](DatabaseQuery &selectQuery) -> SyncCache::Album {
         int whichValue = 0;
         Album currAlbum;
         currAlbum.accountId = accountId;
         currAlbum.userId = userId;
-        currAlbum.albumId = selectQuery.value(whichValue++).toString();
+        currAlbum.albumId = albumId;
         currAlbum.photoCount = selectQuery.value(whichValue++).toInt();
         currAlbum.thumbnailUrl = QUrl(selectQuery.value(whichValue++).toString());
         currAlbum.thumbnailPath = QUrl(selectQuery.value(whichValue++).toString());
@@ -464,49 +891,57 @@ QVector<SyncCache::Album> ImageDatabase::albums(int accountId, const QString &us
         return currAlbum;
     };
 
-    return DatabaseImpl::fetchMultiple<SyncCache::Album>(
-            d,
+    return DatabaseImpl::fetch<SyncCache::Album>(
+            this,
             queryString,
-            bindValues,
+            binder,
             resultHandler,
-            QStringLiteral("albums"),
-            error);
+            QStringLiteral("album"),
+            error,
+            connection);
 }
 
-QVector<SyncCache::Photo> ImageDatabase::photos(int accountId, const QString &userId, const QString &albumId, DatabaseError *error) const
+Photo ImageDatabasePrivate::fetchPhoto(int accountId, const QString &userId, const QString &albumId, const QString &photoId, DatabaseError *error, DatabaseImpl::ReadConnection connection) const
 {
-    SYNCCACHE_DB_D(const ImageDatabase);
-
-    QString queryString = QStringLiteral("SELECT albumId, photoId, createdTimestamp, updatedTimestamp, fileName, albumPath, description,"
-                                         " thumbnailUrl, thumbnailPath, imageUrl, imagePath, imageWidth, imageHeight, fileSize, fileType, etag FROM Photos");
-    QStringList conditions;
-    QList<QPair<QString, QVariant> > bindValues;
-    if (accountId > 0) {
-        conditions << QStringLiteral("accountId = :accountId");
-        bindValues << qMakePair<QString, QVariant>(QStringLiteral(":accountId"), accountId);
+    if (accountId <= 0) {
+        Database::setDatabaseError(error, DatabaseError::InvalidArgumentError,
+                                   QStringLiteral("Cannot fetch photo, invalid accountId: %1").arg(accountId));
+        return Photo();
     }
-    if (!userId.isEmpty()) {
-        conditions << QStringLiteral("userId = :userId");
-        bindValues << qMakePair<QString, QVariant>(QStringLiteral(":userId"), userId);
+    if (userId.isEmpty()) {
+        Database::setDatabaseError(error, DatabaseError::InvalidArgumentError,
+                                   QStringLiteral("Cannot fetch photo, userId is empty"));
+        return Photo();
     }
-    if (!albumId.isEmpty()) {
-        conditions << QStringLiteral("albumId = :albumId");
-        bindValues << qMakePair<QString, QVariant>(QStringLiteral(":albumId"), albumId);
+    if (albumId.isEmpty()) {
+        Database::setDatabaseError(error, DatabaseError::InvalidArgumentError,
+                                   QStringLiteral("Cannot fetch photo, albumId is empty"));
+        return Photo();
     }
-    if (!conditions.isEmpty()) {
-        queryString += QStringLiteral(" WHERE ") + conditions.join(QStringLiteral(" AND "));
+    if (photoId.isEmpty()) {
+        Database::setDatabaseError(error, DatabaseError::InvalidArgumentError,
+                                   QStringLiteral("Cannot fetch photo, photoId is empty"));
+        return Photo();
     }
-    queryString += QStringLiteral(" ORDER BY accountId ASC, userId ASC, albumId ASC, createdTimestamp DESC");
 
-    auto resultHandler = [accountId, userId, albumId](DatabaseQuery &selectQuery) -> SyncCache::Photo {
+    const QString queryString = QStringLiteral("SELECT createdTimestamp, updatedTimestamp, fileName, albumPath, description,"
+                                               " thumbnailUrl, thumbnailPath, imageUrl, imagePath, imageWidth, imageHeight, fileSize, fileType, etag FROM Photos"
+                                               " WHERE albumKey = (SELECT albumKey FROM Albums WHERE accountId = ? AND userId = ? AND albumId = ?)"
+                                               " AND photoId = ?");
+
+    auto binder = [accountId, &userId, &albumId, &photoId](DatabaseQuery &query) {
+        DatabaseImpl::bindValues(query, accountId, userId, albumId, photoId);
+    };
+
+    auto resultHandler = [accountId, userId, albumId, photoId](DatabaseQuery &selectQuery) -> SyncCache::Photo {
         int whichValue = 0;
         Photo currPhoto;
         currPhoto.accountId = accountId;
         currPhoto.userId = userId;
-        currPhoto.albumId = selectQuery.value(whichValue++).toString();
-        currPhoto.photoId = selectQuery.value(whichValue++).toString();
-        currPhoto.createdTimestamp = QDateTime::fromString(selectQuery.value(whichValue++).toString(), Qt::ISODate);
-        currPhoto.updatedTimestamp = QDateTime::fromString(selectQuery.value(whichValue++).toString(), Qt::ISODate);
+        currPhoto.albumId = albumId;
+        currPhoto.photoId = photoId;
+        currPhoto.createdTimestamp = DatabaseImpl::timestampFromVariant(selectQuery.value(whichValue++));
+        currPhoto.updatedTimestamp = DatabaseImpl::timestampFromVariant(selectQuery.value(whichValue++));
         currPhoto.fileName = selectQuery.value(whichValue++).toString();
         currPhoto.albumPath = selectQuery.value(whichValue++).toString();
         currPhoto.description = selectQuery.value(whichValue++).toString();
@@ -522,36 +957,65 @@ QVector<SyncCache::Photo> ImageDatabase::photos(int accountId, const QString &us
         return currPhoto;
     };
 
-    return DatabaseImpl::fetchMultiple<SyncCache::Photo>(
-            d,
+    return DatabaseImpl::fetch<SyncCache::Photo>(
+            this,
             queryString,
-            bindValues,
+            binder,
             resultHandler,
-            QStringLiteral("photos"),
-            error);
+            QStringLiteral("photo"),
+            error,
+            connection);
 }
 
-User ImageDatabase::user(int accountId, DatabaseError *error) const
+//-----------------------------------------------------------------------------
+
+ImageDatabase::ImageDatabase(QObject *parent, bool emitCrossProcessChangeNotifications, Access access)
+    : Database(new ImageDatabasePrivate(this, emitCrossProcessChangeNotifications, access), parent)
 {
-    SYNCCACHE_DB_D(const ImageDatabase);
+    qRegisterMetaType<SyncCache::User>();
+    qRegisterMetaType<SyncCache::Album>();
+    qRegisterMetaType<SyncCache::Photo>();
+    qRegisterMetaType<QVector<SyncCache::User> >();
+    qRegisterMetaType<QVector<SyncCache::Album> >();
+    qRegisterMetaType<QVector<SyncCache::Photo> >();
+    qRegisterMetaType<QList<quint64> >();
+}
 
-    if (accountId <= 0) {
-        setDatabaseError(error, DatabaseError::InvalidArgumentError,
-                         QStringLiteral("Cannot fetch user, invalid accountId: %1").arg(accountId));
-        return User();
+void ImageDatabase::setChangeNotificationInterval(int milliseconds)
+{
+    SYNCCACHE_DB_D(ImageDatabase);
+    if (d->m_changeNotifier) {
+        d->m_changeNotifier->setInterval(milliseconds);
     }
+}
 
-    const QList<QPair<QString, QVariant> > bindValues {
-        qMakePair<QString, QVariant>(QStringLiteral(":accountId"), accountId)
-    };
+ChangeNotificationStatistics ImageDatabase::changeNotificationStatistics() const
+{
+    SYNCCACHE_DB_D(const ImageDatabase);
+    return d->m_changeNotifier ? d->m_changeNotifier->statistics() : ChangeNotificationStatistics();
+}
 
-    const QString queryString = QStringLiteral("SELECT userId, displayName, thumbnailUrl, thumbnailPath, thumbnailFileName FROM USERS"
-                                               " WHERE accountId = :accountId");
+quint64 ImageDatabase::changeScope(int accountId, const QString &userId, const QString &albumId)
+{
+    // A digest rather than the identifiers themselves, which are not to be broadcast.
+    const QByteArray digest = QCryptographicHash::hash(
+            constructAlbumIdentifier(accountId, userId, albumId).toUtf8(), QCryptographicHash::Sha1);
+    return qFromBigEndian<quint64>(reinterpret_cast<const uchar *>(digest.constData()));
+}
 
-    auto resultHandler = [accountId](DatabaseQuery &selectQuery) -> SyncCache::User {
+QVector<SyncCache::User> ImageDatabase::users(DatabaseError *error) const
+{
+    SYNCCACHE_DB_D(const ImageDatabase);
+
+    const QString queryString = QStringLiteral("SELECT accountId, userId, displayName, thumbnailUrl, thumbnailPath, thumbnailFileName FROM USERS"
+                                               " ORDER BY accountId ASC, userId ASC");
+
+    const QList<QPair<QString, QVariant> > bindValues;
+
+    auto resultHandler = [](DatabaseQuery &selectQuery) -> SyncCache::User {
         int whichValue = 0;
         User currUser;
-        currUser.accountId = accountId;
+        currUser.accountId = selectQuery.value(whichValue++).toInt();
         currUser.userId = selectQuery.value(whichValue++).toString();
         currUser.displayName = selectQuery.value(whichValue++).toString();
         currUser.thumbnailUrl = QUrl(selectQuery.value(whichValue++).toString());
@@ -560,50 +1024,53 @@ User ImageDatabase::user(int accountId, DatabaseError *error) const
         return currUser;
     };
 
-    return DatabaseImpl::fetch<SyncCache::User>(
+    return DatabaseImpl::fetchMultiple<SyncCache::User>(
             d,
             queryString,
             bindValues,
             resultHandler,
-            QStringLiteral("user"),
-            error);
+            QStringLiteral("users"),
+            error,
+            DatabaseImpl::SnapshotConnection);
 }
 
-Album ImageDatabase::album(int accountId, const QString &userId, const QString &albumId, DatabaseError *error) const
+QVector<SyncCache::Album> ImageDatabase::albums(int accountId, const QString &userId, DatabaseError *error, const QString &parentAlbumId) const
 {
     SYNCCACHE_DB_D(const ImageDatabase);
 
     if (accountId <= 0) {
         setDatabaseError(error, DatabaseError::InvalidArgumentError,
-                         QStringLiteral("Cannot fetch album, invalid accountId: %1").arg(accountId));
-        return Album();
+                         QStringLiteral("Cannot fetch albums, invalid accountId: %1").arg(accountId));
+        return QVector<SyncCache::Album>();
     }
     if (userId.isEmpty()) {
         setDatabaseError(error, DatabaseError::InvalidArgumentError,
-                         QStringLiteral("Cannot fetch album, userId is empty"));
-        return Album();
-    }
-    if (albumId.isEmpty()) {
-        setDatabaseError(error, DatabaseError::InvalidArgumentError,
-                         QStringLiteral("Cannot fetch album, albumId is empty"));
-        return Album();
+                         QStringLiteral("Cannot fetch albums, userId is empty"));
+        return QVector<SyncCache::Album>();
     }
 
-    const QString queryString = QStringLiteral("SELECT photoCount, thumbnailUrl, thumbnailPath, parentAlbumId, albumName, thumbnailFileName, etag FROM ALBUMS"
-                                               " WHERE accountId = :accountId AND userId = :userId AND albumId = :albumId");
+    const QString parentAlbumIdClause = parentAlbumId.isEmpty()
+            ? QString()
+            : QStringLiteral(" AND parentAlbumId = ?");
+    const QString queryString = QStringLiteral("SELECT albumId, photoCount, thumbnailUrl, thumbnailPath, parentAlbumId, albumName, thumbnailFileName, etag FROM ALBUMS"
+                                               " WHERE accountId = ? AND userId = ?"
+                                               "%1"
+                                               " ORDER BY accountId ASC, userId ASC, albumId ASC").arg(parentAlbumIdClause);
 
-    const QList<QPair<QString, QVariant> > bindValues {
-        qMakePair<QString, QVariant>(QStringLiteral(":accountId"), accountId),
-        qMakePair<QString, QVariant>(QStringLiteral(":userId"), userId),
-        qMakePair<QString, QVariant>(QStringLiteral(":albumId"), albumId)
+    auto binder = [accountId, &userId, &parentAlbumId](DatabaseQuery &query) {
+        if (parentAlbumId.isEmpty()) {
+            DatabaseImpl::bindValues(query, accountId, userId);
+        } else {
+            DatabaseImpl::bindValues(query, accountId, userId, parentAlbumId);
+        }
     };
 
-    auto resultHandler = [accountId, userId, albumId](DatabaseQuery &selectQuery) -> SyncCache::Album {
+    auto resultHandler = [accountId, userId](DatabaseQuery &selectQuery) -> SyncCache::Album {
         int whichValue = 0;
         Album currAlbum;
         currAlbum.accountId = accountId;
         currAlbum.userId = userId;
-        currAlbum.albumId = albumId;
+        currAlbum.albumId = selectQuery.value(whichValue++).toString();
         currAlbum.photoCount = selectQuery.value(whichValue++).toInt();
         currAlbum.thumbnailUrl = QUrl(selectQuery.value(whichValue++).toString());
         currAlbum.thumbnailPath = QUrl(selectQuery.value(whichValue++).toString());
@@ -614,60 +1081,62 @@ Album ImageDatabase::album(int accountId, const QString &userId, const QString &
         return currAlbum;
     };
 
-    return DatabaseImpl::fetch<SyncCache::Album>(
+    return DatabaseImpl::fetchMultiple<SyncCache::Album>(
             d,
             queryString,
-            bindValues,
+            binder,
             resultHandler,
-            QStringLiteral("album"),
-            error);
+            QStringLiteral("albums"),
+            error,
+            DatabaseImpl::SnapshotConnection);
 }
 
-Photo ImageDatabase::photo(int accountId, const QString &userId, const QString &albumId, const QString &photoId, DatabaseError *error) const
+QVector<SyncCache::Photo> ImageDatabase::photos(int accountId, const QString &userId, const QString &albumId, DatabaseError *error) const
 {
     SYNCCACHE_DB_D(const ImageDatabase);
 
-    if (accountId <= 0) {
-        setDatabaseError(error, DatabaseError::InvalidArgumentError,
-                         QStringLiteral("Cannot fetch photo, invalid accountId: %1").arg(accountId));
-        return Photo();
+    QString queryString = QStringLiteral("SELECT Albums.albumId, Photos.photoId, Photos.createdTimestamp, Photos.updatedTimestamp,"
+                                         " Photos.fileName, Photos.albumPath, Photos.description, Photos.thumbnailUrl, Photos.thumbnailPath,"
+                                         " Photos.imageUrl, Photos.imagePath, Photos.imageWidth, Photos.imageHeight, Photos.fileSize,"
+                                         " Photos.fileType, Photos.etag FROM Photos JOIN Albums ON Albums.albumKey = Photos.albumKey");
+    QStringList conditions;
+    if (accountId > 0) {
+        conditions << QStringLiteral("Albums.accountId = ?");
     }
-    if (userId.isEmpty()) {
-        setDatabaseError(error, DatabaseError::InvalidArgumentError,
-                         QStringLiteral("Cannot fetch photo, userId is empty"));
-        return Photo();
+    if (!userId.isEmpty()) {
+        conditions << QStringLiteral("Albums.userId = ?");
     }
-    if (albumId.isEmpty()) {
-        setDatabaseError(error, DatabaseError::InvalidArgumentError,
-                         QStringLiteral("Cannot fetch photo, albumId is empty"));
-        return Photo();
+    if (!albumId.isEmpty()) {
+        conditions << QStringLiteral("Albums.albumId = ?");
     }
-    if (photoId.isEmpty()) {
-        setDatabaseError(error, DatabaseError::InvalidArgumentError,
-                         QStringLiteral("Cannot fetch photo, photoId is empty"));
-        return Photo();
+    if (!conditions.isEmpty()) {
+        queryString += QStringLiteral(" WHERE ") + conditions.join(QStringLiteral(" AND "));
     }
+    queryString += QStringLiteral(" ORDER BY Albums.accountId ASC, Albums.userId ASC, Albums.albumId ASC, Photos.createdTimestamp DESC");
 
-    const QString queryString = QStringLiteral("SELECT createdTimestamp, updatedTimestamp, fileName, albumPath, description,"
-                                               " thumbnailUrl, thumbnailPath, imageUrl, imagePath, imageWidth, imageHeight, fileSize, fileType, etag FROM Photos"
-                                               " WHERE accountId = :accountId AND userId = :userId AND albumId = :albumId AND photoId = :photoId");
-
-    const QList<QPair<QString, QVariant> > bindValues {
-        qMakePair<QString, QVariant>(QStringLiteral(":accountId"), accountId),
-        qMakePair<QString, QVariant>(QStringLiteral(":userId"), userId),
-        qMakePair<QString, QVariant>(QStringLiteral(":albumId"), albumId),
-        qMakePair<QString, QVariant>(QStringLiteral(":photoId"), photoId)
+    // Bind in the same order as the conditions were added above.
+    auto binder = [accountId, &userId, &albumId](DatabaseQuery &query) {
+        int index = 0;
+        if (accountId > 0) {
+            DatabaseImpl::bindValue(query, index++, accountId);
+        }
+        if (!userId.isEmpty()) {
+            DatabaseImpl::bindValue(query, index++, userId);
+        }
+        if (!albumId.isEmpty()) {
+            DatabaseImpl::bindValue(query, index++, albumId);
+        }
     };
 
-    auto resultHandler = [accountId, userId, albumId, photoId](DatabaseQuery &selectQuery) -> SyncCache::Photo {
+    auto resultHandler = [accountId, userId, albumId](DatabaseQuery &selectQuery) -> SyncCache::Photo {
         int whichValue = 0;
         Photo currPhoto;
         currPhoto.accountId = accountId;
         currPhoto.userId = userId;
-        currPhoto.albumId = albumId;
-        currPhoto.photoId = photoId;
-        currPhoto.createdTimestamp = QDateTime::fromString(selectQuery.value(whichValue++).toString(), Qt::ISODate);
-        currPhoto.updatedTimestamp = QDateTime::fromString(selectQuery.value(whichValue++).toString(), Qt::ISODate);
+        currPhoto.albumId = selectQuery.value(whichValue++).toString();
+        currPhoto.photoId = selectQuery.value(whichValue++).toString();
+        currPhoto.createdTimestamp = DatabaseImpl::timestampFromVariant(selectQuery.value(whichValue++));
+        currPhoto.updatedTimestamp = DatabaseImpl::timestampFromVariant(selectQuery.value(whichValue++));
         currPhoto.fileName = selectQuery.value(whichValue++).toString();
         currPhoto.albumPath = selectQuery.value(whichValue++).toString();
         currPhoto.description = selectQuery.value(whichValue++).toString();
@@ -683,30 +1152,49 @@ Photo ImageDatabase::photo(int accountId, const QString &userId, const QString &
         return currPhoto;
     };
 
-    return DatabaseImpl::fetch<SyncCache::Photo>(
+    return DatabaseImpl::fetchMultiple<SyncCache::Photo>(
             d,
             queryString,
-            bindValues,
+            binder,
             resultHandler,
-            QStringLiteral("photo"),
-            error);
+            QStringLiteral("photos"),
+            error,
+            DatabaseImpl::SnapshotConnection);
+}
+
+User ImageDatabase::user(int accountId, DatabaseError *error) const
+{
+    SYNCCACHE_DB_D(const ImageDatabase);
+    return d->fetchUser(accountId, error, DatabaseImpl::SnapshotConnection);
+}
+
+Album ImageDatabase::album(int accountId, const QString &userId, const QString &albumId, DatabaseError *error) const
+{
+    SYNCCACHE_DB_D(const ImageDatabase);
+    return d->fetchAlbum(accountId, userId, albumId, error, DatabaseImpl::SnapshotConnection);
+}
+
+Photo ImageDatabase::photo(int accountId, const QString &userId, const QString &albumId, const QString &photoId, DatabaseError *error) const
+{
+    SYNCCACHE_DB_D(const ImageDatabase);
+    return d->fetchPhoto(accountId, userId, albumId, photoId, error, DatabaseImpl::SnapshotConnection);
 }
 
 SyncCache::PhotoCounter ImageDatabase::photoCount(int accountId, const QString &userId, DatabaseError *error) const
 {
     SYNCCACHE_DB_D(const ImageDatabase);
 
-    QString queryString = QStringLiteral("SELECT COUNT(*) FROM Photos");
+    QString queryString = QStringLiteral("SELECT COUNT(*) FROM Photos JOIN Albums ON Albums.albumKey = Photos.albumKey");
 
     QStringList conditions;
     QList<QPair<QString, QVariant> > bindValues;
 
     if (accountId > 0) {
-        conditions << QStringLiteral("accountId = :accountId");
+        conditions << QStringLiteral("Albums.accountId = :accountId");
         bindValues << qMakePair<QString, QVariant>(QStringLiteral(":accountId"), accountId);
     }
     if (!userId.isEmpty()) {
-        conditions << QStringLiteral("userId = :userId");
+        conditions << QStringLiteral("Albums.userId = :userId");
         bindValues << qMakePair<QString, QVariant>(QStringLiteral(":userId"), userId);
     }
     if (!conditions.isEmpty()) {
@@ -725,7 +1213,94 @@ SyncCache::PhotoCounter ImageDatabase::photoCount(int accountId, const QString &
             bindValues,
             resultHandler,
             QStringLiteral("photoCount"),
-            error);
+            error,
+            DatabaseImpl::SnapshotConnection);
+}
+
+SyncCache::ImageChanges ImageDatabase::changesSince(qint64 sequence, DatabaseError *error) const
+{
+    SYNCCACHE_DB_D(const ImageDatabase);
+
+    ImageChanges changes;
+    changes.sequence = sequence;
+
+    // The identifiers of stored items are looked up by key, and those of deleted items kept in the journal.
+    const QString queryString = QStringLiteral("SELECT Changes.sequence, Changes.itemType,"
+                                               " COALESCE(Users.accountId, Albums.accountId, PhotoAlbums.accountId, Changes.accountId),"
+                                               " COALESCE(Users.userId, Albums.userId, PhotoAlbums.userId, Changes.userId),"
+                                               " COALESCE(Albums.albumId, PhotoAlbums.albumId, Changes.albumId),"
+                                               " COALESCE(Photos.photoId, Changes.photoId),"
+                                               " Changes.deleted"
+                                               " FROM Changes"
+                                               " LEFT JOIN Users ON Changes.itemType = 1 AND Users.rowid = Changes.itemKey"
+                                               " LEFT JOIN Albums ON Changes.itemType = 2 AND Albums.albumKey = Changes.itemKey"
+                                               " LEFT JOIN Photos ON Changes.itemType = 3 AND Photos.rowid = Changes.itemKey"
+                                               " LEFT JOIN Albums AS PhotoAlbums ON PhotoAlbums.albumKey = Photos.albumKey"
+                                               " WHERE Changes.sequence > ?"
+                                               " ORDER BY Changes.sequence ASC");
+
+    auto binder = [sequence](DatabaseQuery &query) {
+        DatabaseImpl::bindValues(query, sequence);
+    };
+
+    auto resultHandler = [&changes](DatabaseQuery &selectQuery) -> int {
+        changes.sequence = selectQuery.value(0).toLongLong();
+        const int itemType = selectQuery.value(1).toInt();
+        const int accountId = selectQuery.value(2).toInt();
+        const QString userId = selectQuery.value(3).toString();
+        const bool deleted = selectQuery.value(6).toBool();
+        if (itemType == UserChange) {
+            User user;
+            user.accountId = accountId;
+            user.userId = userId;
+            (deleted ? changes.deletedUsers : changes.storedUsers).append(user);
+        } else if (itemType == AlbumChange) {
+            Album album;
+            album.accountId = accountId;
+            album.userId = userId;
+            album.albumId = selectQuery.value(4).toString();
+            (deleted ? changes.deletedAlbums : changes.storedAlbums).append(album);
+        } else if (itemType == PhotoChange) {
+            Photo photo;
+            photo.accountId = accountId;
+            photo.userId = userId;
+            photo.albumId = selectQuery.value(4).toString();
+            photo.photoId = selectQuery.value(5).toString();
+            (deleted ? changes.deletedPhotos : changes.storedPhotos).append(photo);
+        }
+        return itemType;
+    };
+
+    DatabaseImpl::fetchMultiple<int>(
+            d,
+            queryString,
+            binder,
+            resultHandler,
+            QStringLiteral("changesSince"),
+            error,
+            DatabaseImpl::SnapshotConnection);
+    if (error->errorCode != DatabaseError::NoError) {
+        return ImageChanges();
+    }
+
+    // Read after the changes, so that a concurrent prune can only cause an unnecessary reload.
+    auto prunedHandler = [](DatabaseQuery &selectQuery) -> qint64 {
+        return selectQuery.value(0).toLongLong();
+    };
+    const qint64 prunedSequence = DatabaseImpl::fetch<qint64>(
+            d,
+            QStringLiteral("SELECT prunedSequence FROM ChangeJournal"),
+            [](DatabaseQuery &) {},
+            prunedHandler,
+            QStringLiteral("prunedSequence"),
+            error,
+            DatabaseImpl::SnapshotConnection);
+    if (error->errorCode != DatabaseError::NoError) {
+        return ImageChanges();
+    }
+    changes.reloadRequired = sequence < prunedSequence;
+
+    return changes;
 }
 
 QString ImageDatabase::findThumbnailForAlbum(int accountId, const QString &userId, const QString &albumId, DatabaseError *error) const
@@ -744,7 +1319,8 @@ QString ImageDatabase::findThumbnailForAlbum(int accountId, const QString &userI
     }
 
     const QString queryString = QStringLiteral("SELECT thumbnailPath FROM PHOTOS"
-        " WHERE accountId = :accountId AND userId = :userId AND albumId = :albumId AND thumbnailPath !='' ORDER BY updatedTimestamp DESC LIMIT 1");
+        " WHERE albumKey = (SELECT albumKey FROM Albums WHERE accountId = :accountId AND userId = :userId AND albumId = :albumId)"
+        " AND thumbnailPath !='' ORDER BY updatedTimestamp DESC LIMIT 1");
 
     const QList<QPair<QString, QVariant> > bindValues {
         qMakePair<QString, QVariant>(QStringLiteral(":accountId"), accountId),
@@ -762,7 +1338,8 @@ QString ImageDatabase::findThumbnailForAlbum(int accountId, const QString &userI
             bindValues,
             resultHandler,
             QStringLiteral("findThumbnailForAlbum"),
-            error);
+            error,
+            DatabaseImpl::SnapshotConnection);
 }
 
 void ImageDatabase::storeUser(const User &user, DatabaseError *error)
@@ -781,7 +1358,7 @@ void ImageDatabase::storeUser(const User &user, DatabaseError *error)
     }
 
     DatabaseError err;
-    const User existingUser = this->user(user.accountId, &err);
+    const User existingUser = d->fetchUser(user.accountId, &err, DatabaseImpl::WriterConnection);
     if (err.errorCode != DatabaseError::NoError) {
         setDatabaseError(error, err.errorCode,
                          QStringLiteral("Error while querying existing user %1 for store: %2")
@@ -840,7 +1417,7 @@ void ImageDatabase::storeAlbum(const Album &album, DatabaseError *error)
     }
 
     DatabaseError err;
-    const Album existingAlbum = this->album(album.accountId, album.userId, album.albumId, &err);
+    const Album existingAlbum = d->fetchAlbum(album.accountId, album.userId, album.albumId, &err, DatabaseImpl::WriterConnection);
     if (err.errorCode != DatabaseError::NoError) {
         setDatabaseError(error, err.errorCode,
                          QStringLiteral("Error while querying existing album %1 for store: %2")
@@ -909,7 +1486,7 @@ void ImageDatabase::storePhoto(const Photo &photo, DatabaseError *error)
     }
 
     DatabaseError err;
-    const Photo existingPhoto = this->photo(photo.accountId, photo.userId, photo.albumId, photo.photoId, &err);
+    const Photo existingPhoto = d->fetchPhoto(photo.accountId, photo.userId, photo.albumId, photo.photoId, &err, DatabaseImpl::WriterConnection);
     if (err.errorCode != DatabaseError::NoError) {
         setDatabaseError(error, err.errorCode,
                          QStringLiteral("Error while querying existing photo %1 for store: %2")
@@ -917,17 +1494,19 @@ void ImageDatabase::storePhoto(const Photo &photo, DatabaseError *error)
         return;
     }
 
-    const QString insertString = QStringLiteral("INSERT INTO Photos (accountId, userId, albumId, photoId, createdTimestamp, updatedTimestamp, "
+    const QString insertString = QStringLiteral("INSERT INTO Photos (albumKey, photoId, createdTimestamp, updatedTimestamp, "
                                                                     "fileName, albumPath, description, thumbnailUrl, thumbnailPath, "
                                                                     "imageUrl, imagePath, imageWidth, imageHeight, fileSize, fileType, etag)"
-                                                " VALUES(:accountId, :userId, :albumId, :photoId, :createdTimestamp, :updatedTimestamp, "
+                                                " VALUES((SELECT albumKey FROM Albums WHERE accountId = :accountId AND userId = :userId AND albumId = :albumId),"
+                                                        " :photoId, :createdTimestamp, :updatedTimestamp, "
                                                         ":fileName, :albumPath, :description, :thumbnailUrl, :thumbnailPath, :imageUrl, :imagePath, :imageWidth, :imageHeight, :fileSize, :fileType, :etag)");
     const QString updateString = QStringLiteral("UPDATE Photos SET createdTimestamp = :createdTimestamp, updatedTimestamp = :updatedTimestamp, "
                                                                   "fileName = :fileName, albumPath = :albumPath, description = :description, "
                                                                   "thumbnailUrl = :thumbnailUrl, thumbnailPath = :thumbnailPath, "
                                                                   "imageUrl = :imageUrl, imagePath = :imagePath, imageWidth = :imageWidth, imageHeight = :imageHeight,"
                                                                   "fileSize = :fileSize, fileType = :fileType, etag = :etag"
-                                                " WHERE accountId = :accountId AND userId = :userId AND albumId = :albumId AND photoId = :photoId");
+                                                " WHERE albumKey = (SELECT albumKey FROM Albums WHERE accountId = :accountId AND userId = :userId AND albumId = :albumId)"
+                                                " AND photoId = :photoId");
 
     const bool insert = existingPhoto.photoId.isEmpty();
     const QString queryString = insert ? insertString : updateString;
@@ -937,8 +1516,8 @@ void ImageDatabase::storePhoto(const Photo &photo, DatabaseError *error)
         qMakePair<QString, QVariant>(QStringLiteral(":userId"), photo.userId),
         qMakePair<QString, QVariant>(QStringLiteral(":albumId"), photo.albumId),
         qMakePair<QString, QVariant>(QStringLiteral(":photoId"), photo.photoId),
-        qMakePair<QString, QVariant>(QStringLiteral(":createdTimestamp"), photo.createdTimestamp.toString(Qt::ISODate)),
-        qMakePair<QString, QVariant>(QStringLiteral(":updatedTimestamp"), photo.updatedTimestamp.toString(Qt::ISODate)),
+        qMakePair<QString, QVariant>(QStringLiteral(":createdTimestamp"), DatabaseImpl::timestampToVariant(photo.createdTimestamp)),
+        qMakePair<QString, QVariant>(QStringLiteral(":updatedTimestamp"), DatabaseImpl::timestampToVariant(photo.updatedTimestamp)),
         qMakePair<QString, QVariant>(QStringLiteral(":fileName"), photo.fileName),
         qMakePair<QString, QVariant>(QStringLiteral(":albumPath"), photo.albumPath),
         qMakePair<QString, QVariant>(QStringLiteral(":description"), photo.description),
@@ -976,6 +1555,179 @@ void ImageDatabase::storePhoto(const Photo &photo, DatabaseError *error)
             error);
 }
 
+void ImageDatabase::storeAlbums(const QVector<Album> &albums, DatabaseError *error)
+{
+    SYNCCACHE_DB_D(ImageDatabase);
+
+    for (const Album &album : albums) {
+        if (album.accountId <= 0) {
+            setDatabaseError(error, DatabaseError::InvalidArgumentError,
+                             QStringLiteral("Cannot store albums, invalid accountId: %1").arg(album.accountId));
+            return;
+        }
+        if (album.userId.isEmpty()) {
+            setDatabaseError(error, DatabaseError::InvalidArgumentError,
+                             QStringLiteral("Cannot store albums, userId is empty"));
+            return;
+        }
+        if (album.albumId.isEmpty()) {
+            setDatabaseError(error, DatabaseError::InvalidArgumentError,
+                             QStringLiteral("Cannot store albums, albumId is empty"));
+            return;
+        }
+    }
+
+    // Insert or update in a single statement, so that no existence query is required per album.
+    const QString queryString = QStringLiteral("INSERT INTO Albums (accountId, userId, albumId, photoCount, thumbnailUrl, thumbnailPath, parentAlbumId, albumName, thumbnailFileName, etag)"
+                                               " VALUES(?, ?, ?, ?, ?, ?, ?, ?, ?, ?)"
+                                               " ON CONFLICT (accountId, userId, albumId) DO UPDATE SET"
+                                               " photoCount = excluded.photoCount, thumbnailUrl = excluded.thumbnailUrl, thumbnailPath = excluded.thumbnailPath,"
+                                               " parentAlbumId = excluded.parentAlbumId, albumName = excluded.albumName,"
+                                               " thumbnailFileName = excluded.thumbnailFileName, etag = excluded.etag");
+
+    auto binder = [](DatabaseQuery &query, const Album &album) {
+        DatabaseImpl::bindValues(query,
+                                 album.accountId, album.userId, album.albumId, album.photoCount,
+                                 album.thumbnailUrl, album.thumbnailPath, album.parentAlbumId,
+                                 album.albumName, album.thumbnailFileName, album.etag);
+    };
+
+    auto storeResultHandler = [d](const Album &album) -> void {
+        d->m_storedAlbums.append(album);
+    };
+
+    DatabaseImpl::storeMultiple<SyncCache::Album>(
+            d,
+            queryString,
+            albums,
+            binder,
+            storeResultHandler,
+            QStringLiteral("albums"),
+            error);
+}
+
+void ImageDatabase::storePhotos(const QVector<Photo> &photos, DatabaseError *error)
+{
+    SYNCCACHE_DB_D(ImageDatabase);
+
+    QHash<QString, Photo> albumKeys;
+    for (const Photo &photo : photos) {
+        if (photo.accountId <= 0) {
+            setDatabaseError(error, DatabaseError::InvalidArgumentError,
+                             QStringLiteral("Cannot store photos, invalid accountId: %1").arg(photo.accountId));
+            return;
+        }
+        if (photo.userId.isEmpty()) {
+            setDatabaseError(error, DatabaseError::InvalidArgumentError,
+                             QStringLiteral("Cannot store photos, userId is empty"));
+            return;
+        }
+        if (photo.albumId.isEmpty()) {
+            setDatabaseError(error, DatabaseError::InvalidArgumentError,
+                             QStringLiteral("Cannot store photos, albumId is empty"));
+            return;
+        }
+        if (photo.photoId.isEmpty()) {
+            setDatabaseError(error, DatabaseError::InvalidArgumentError,
+                             QStringLiteral("Cannot store photos, photoId is empty"));
+            return;
+        }
+        albumKeys.insert(constructAlbumIdentifier(photo.accountId, photo.userId, photo.albumId), photo);
+    }
+
+    // Load the file paths of the photos which already exist with one query per album,
+    // so that replaced downloads can be deleted once the transaction is committed.
+    const QString existingQueryString = QStringLiteral("SELECT photoId, thumbnailPath, imagePath FROM Photos"
+                                                       " WHERE albumKey = (SELECT albumKey FROM Albums WHERE accountId = ? AND userId = ? AND albumId = ?)");
+    auto existingResultHandler = [](DatabaseQuery &selectQuery) -> SyncCache::Photo {
+        int whichValue = 0;
+        Photo currPhoto;
+        currPhoto.photoId = selectQuery.value(whichValue++).toString();
+        currPhoto.thumbnailPath = QUrl(selectQuery.value(whichValue++).toString());
+        currPhoto.imagePath = QUrl(selectQuery.value(whichValue++).toString());
+        return currPhoto;
+    };
+
+    QHash<QString, Photo> existingPhotos;
+    for (QHash<QString, Photo>::const_iterator it = albumKeys.constBegin(); it != albumKeys.constEnd(); ++it) {
+        const Photo &albumKey(it.value());
+        auto existingBinder = [&albumKey](DatabaseQuery &query) {
+            DatabaseImpl::bindValues(query, albumKey.accountId, albumKey.userId, albumKey.albumId);
+        };
+
+        DatabaseError err;
+        const QVector<SyncCache::Photo> albumPhotos = DatabaseImpl::fetchMultiple<SyncCache::Photo>(
+                d,
+                existingQueryString,
+                existingBinder,
+                existingResultHandler,
+                QStringLiteral("existingPhotos"),
+                &err);
+        if (err.errorCode != DatabaseError::NoError) {
+            setDatabaseError(error, err.errorCode,
+                             QStringLiteral("Error while querying existing photos in album %1 for store: %2")
+                                       .arg(it.value().albumId, err.errorMessage));
+            return;
+        }
+        for (const Photo &existingPhoto : albumPhotos) {
+            if (!existingPhoto.thumbnailPath.isEmpty() || !existingPhoto.imagePath.isEmpty()) {
+                existingPhotos.insert(it.key() + QLatin1Char('|') + existingPhoto.photoId, existingPhoto);
+            }
+        }
+    }
+
+    // Insert or update in a single statement, so that no existence query is required per photo.
+    // The album key lookup leaves albumKey NULL if the album does not exist, which
+    // fails the NOT NULL constraint as the composite foreign key used to.
+    const QString queryString = QStringLiteral("INSERT INTO Photos (albumKey, photoId, createdTimestamp, updatedTimestamp, "
+                                                                   "fileName, albumPath, description, thumbnailUrl, thumbnailPath, "
+                                                                   "imageUrl, imagePath, imageWidth, imageHeight, fileSize, fileType, etag)"
+                                               " VALUES((SELECT albumKey FROM Albums WHERE accountId = ? AND userId = ? AND albumId = ?),"
+                                               " ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)"
+                                               " ON CONFLICT (albumKey, photoId) DO UPDATE SET"
+                                               " createdTimestamp = excluded.createdTimestamp, updatedTimestamp = excluded.updatedTimestamp,"
+                                               " fileName = excluded.fileName, albumPath = excluded.albumPath, description = excluded.description,"
+                                               " thumbnailUrl = excluded.thumbnailUrl, thumbnailPath = excluded.thumbnailPath,"
+                                               " imageUrl = excluded.imageUrl, imagePath = excluded.imagePath,"
+                                               " imageWidth = excluded.imageWidth, imageHeight = excluded.imageHeight,"
+                                               " fileSize = excluded.fileSize, fileType = excluded.fileType, etag = excluded.etag");
+
+    auto binder = [](DatabaseQuery &query, const Photo &photo) {
+        DatabaseImpl::bindValues(query,
+                                 photo.accountId, photo.userId, photo.albumId, photo.photoId,
+                                 photo.createdTimestamp, photo.updatedTimestamp,
+                                 photo.fileName, photo.albumPath, photo.description,
+                                 photo.thumbnailUrl, photo.thumbnailPath, photo.imageUrl, photo.imagePath,
+                                 photo.imageWidth, photo.imageHeight, photo.fileSize, photo.fileType, photo.etag);
+    };
+
+    auto storeResultHandler = [d, existingPhotos](const Photo &photo) -> void {
+        d->m_storedPhotos.append(photo);
+        const QString photoKey = constructAlbumIdentifier(photo.accountId, photo.userId, photo.albumId)
+                + QLatin1Char('|') + photo.photoId;
+        QHash<QString, Photo>::const_iterator it = existingPhotos.constFind(photoKey);
+        if (it != existingPhotos.constEnd()) {
+            if (!it->imagePath.isEmpty()
+                    && it->imagePath != photo.imagePath) {
+                d->m_filesToDelete.append(it->imagePath.toString());
+            }
+            if (!it->thumbnailPath.isEmpty()
+                    && it->thumbnailPath != photo.thumbnailPath) {
+                d->m_filesToDelete.append(it->thumbnailPath.toString());
+            }
+        }
+    };
+
+    DatabaseImpl::storeMultiple<SyncCache::Photo>(
+            d,
+            queryString,
+            photos,
+            binder,
+            storeResultHandler,
+            QStringLiteral("photos"),
+            error);
+}
+
 void ImageDatabase::deleteUser(const User &user, DatabaseError *error)
 {
     SYNCCACHE_DB_D(ImageDatabase);
@@ -992,7 +1744,7 @@ void ImageDatabase::deleteUser(const User &user, DatabaseError *error)
     }
 
     DatabaseError err;
-    const User existingUser = this->user(user.accountId, &err);
+    const User existingUser = d->fetchUser(user.accountId, &err, DatabaseImpl::WriterConnection);
     if (err.errorCode != DatabaseError::NoError) {
         setDatabaseError(error, err.errorCode,
                          QStringLiteral("Error while querying existing user %1 for delete: %2")
@@ -1073,7 +1825,7 @@ void ImageDatabase::deleteAlbum(const Album &album, DatabaseError *error)
     }
 
     DatabaseError err;
-    const Album existingAlbum = this->album(album.accountId, album.userId, album.albumId, &err);
+    const Album existingAlbum = d->fetchAlbum(album.accountId, album.userId, album.albumId, &err, DatabaseImpl::WriterConnection);
     if (err.errorCode != DatabaseError::NoError) {
         setDatabaseError(error, err.errorCode,
                          QStringLiteral("Error while querying existing album %1 for delete: %2")
@@ -1162,7 +1914,7 @@ void ImageDatabase::deletePhoto(const Photo &photo, DatabaseError *error)
     }
 
     DatabaseError err;
-    const Photo existingPhoto = this->photo(photo.accountId, photo.userId, photo.albumId, photo.photoId, &err);
+    const Photo existingPhoto = d->fetchPhoto(photo.accountId, photo.userId, photo.albumId, photo.photoId, &err, DatabaseImpl::WriterConnection);
     if (err.errorCode != DatabaseError::NoError) {
         setDatabaseError(error, err.errorCode,
                          QStringLiteral("Error while querying existing photo %1 for delete: %2")
@@ -1178,7 +1930,8 @@ void ImageDatabase::deletePhoto(const Photo &photo, DatabaseError *error)
     auto deleteRelatedValues = [] (DatabaseError *) -> void { };
 
     const QString queryString = QStringLiteral("DELETE FROM Photos"
-                                               " WHERE accountId = :accountId AND userId = :userId AND albumId = :albumId AND photoId = :photoId");
+                                               " WHERE albumKey = (SELECT albumKey FROM Albums WHERE accountId = :accountId AND userId = :userId AND albumId = :albumId)"
+                                               " AND photoId = :photoId");
 
     const QList<QPair<QString, QVariant> > bindValues {
         qMakePair<QString, QVariant>(QStringLiteral(":accountId"), photo.accountId),
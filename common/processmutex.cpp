@@ -38,6 +38,7 @@
 #include "processmutex_p.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 #include <sys/sem.h>
@@ -45,7 +46,10 @@
 #include <sys/types.h>
 #include <sys/ipc.h>
 
+#include <QElapsedTimer>
+#include <QFile>
 #include <QMutexLocker>
+#include <QThread>
 #include <QtDebug>
 
 namespace {
@@ -127,8 +131,8 @@ bool semaphoreIncrement(int id, size_t index, bool wait, size_t ms, int value)
     }
 
     struct timespec timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_nsec = ms * 1000;
+    timeout.tv_sec = ms / 1000;
+    timeout.tv_nsec = (ms % 1000) * 1000000;
 
     do {
         int rv = ::semtimedop(id, &op, 1, (wait && ms > 0 ? &timeout : 0));
@@ -139,6 +143,82 @@ bool semaphoreIncrement(int id, size_t index, bool wait, size_t ms, int value)
     return false;
 }
 
+// Returns the lock file descriptor, or -1 with *failed unset if OFD locks are
+// unsupported, in which case the semaphore arbitrates write access instead.
+// Any other error sets *failed: falling back to the semaphore then would let
+// this process write alongside others which hold the OFD lock.
+int lockFileOpen(const QString &path, bool *failed)
+{
+    *failed = false;
+#ifdef F_OFD_SETLK
+    const QByteArray lockPath = QFile::encodeName(path + QStringLiteral(".lock"));
+    int fd = -1;
+    do {
+        fd = ::open(lockPath.constData(), O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    } while (fd == -1 && errno == EINTR);
+    if (fd == -1) {
+        semaphoreError("Unable to open lock file", lockPath.constData(), errno);
+        *failed = true;
+        return -1;
+    }
+
+    // Probe for OFD lock support, which requires Linux 3.15
+    struct flock probe = {};
+    probe.l_type = F_WRLCK;
+    probe.l_whence = SEEK_SET;
+    if (::fcntl(fd, F_OFD_GETLK, &probe) == -1) {
+        if (errno != EINVAL) {
+            semaphoreError("Unable to query lock file", lockPath.constData(), errno);
+            *failed = true;
+        }
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    Q_UNUSED(path)
+    return -1;
+#endif
+}
+
+bool lockFileSet(int fd, short type, int timeoutMs)
+{
+#ifdef F_OFD_SETLK
+    struct flock lock = {};
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+
+    // F_OFD_SETLKW cannot time out, so poll with a backoff instead when the wait is bounded
+    const int command = (type == F_WRLCK && timeoutMs >= 0) ? F_OFD_SETLK : F_OFD_SETLKW;
+    QElapsedTimer timer;
+    timer.start();
+    unsigned long backoffMs = 1;
+    forever {
+        if (::fcntl(fd, command, &lock) == 0) {
+            return true;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if ((errno != EAGAIN && errno != EACCES) || command == F_OFD_SETLKW) {
+            semaphoreError("Unable to set lock", "lock file", errno);
+            return false;
+        }
+        const qint64 remainingMs = timeoutMs - timer.elapsed();
+        if (remainingMs <= 0) {
+            return false;
+        }
+        QThread::msleep(qMin<unsigned long>(backoffMs, remainingMs));
+        backoffMs = qMin<unsigned long>(backoffMs * 2, 50);
+    }
+#else
+    Q_UNUSED(fd)
+    Q_UNUSED(type)
+    Q_UNUSED(timeoutMs)
+    return false;
+#endif
+}
+
 }
 
 using namespace SyncCache;
@@ -203,6 +283,9 @@ void Semaphore::error(const char *msg, int error)
 
 ProcessMutex::ProcessMutex(const QString &path)
     : m_semaphore(path.toLatin1(), 3, initialSemaphoreValues)
+    , m_lockFileFailed(false)
+    , m_lockFile(lockFileOpen(path, &m_lockFileFailed))
+    , m_locked(false)
     , m_initialProcess(false)
 {
     if (!m_semaphore.isValid()) {
@@ -221,22 +304,58 @@ ProcessMutex::ProcessMutex(const QString &path)
     }
 }
 
-bool ProcessMutex::lock()
+ProcessMutex::~ProcessMutex()
 {
-    m_mutex.lock();
-    return m_semaphore.decrement(writeAccessIndex);
+    if (m_lockFile != -1) {
+        ::close(m_lockFile);
+    }
+}
+
+bool ProcessMutex::lock(int timeoutMs)
+{
+    if (m_lockFileFailed) {
+        qWarning() << QStringLiteral("Unable to lock, the lock file could not be opened");
+        return false;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    if (!m_mutex.tryLock(timeoutMs)) {
+        qWarning() << QStringLiteral("Timed out waiting for in-process write lock");
+        return false;
+    }
+
+    const int remainingMs = timeoutMs < 0 ? -1 : qMax<int>(timeoutMs - timer.elapsed(), 0);
+    const bool locked = m_lockFile != -1
+            ? lockFileSet(m_lockFile, F_WRLCK, remainingMs)
+            : m_semaphore.decrement(writeAccessIndex, true, remainingMs < 0 ? 0 : qMax(remainingMs, 1));
+    if (!locked) {
+        qWarning() << QStringLiteral("Unable to acquire write lock within %1 ms").arg(timeoutMs);
+        m_mutex.unlock();
+        return false;
+    }
+    m_locked = true;
+    return true;
 }
 
 bool ProcessMutex::unlock()
 {
-    bool retn = m_semaphore.increment(writeAccessIndex);
+    m_locked = false;
+    bool retn = m_lockFile != -1
+            ? lockFileSet(m_lockFile, F_UNLCK, -1)
+            : m_semaphore.increment(writeAccessIndex);
     m_mutex.unlock();
     return retn;
 }
 
 bool ProcessMutex::isLocked() const
 {
-    return (m_semaphore.value(writeAccessIndex) == 0);
+    return m_locked;
+}
+
+bool ProcessMutex::isValid() const
+{
+    return !m_lockFileFailed;
 }
 
 bool ProcessMutex::isInitialProcess() const
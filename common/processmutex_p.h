@@ -63,17 +63,29 @@ private:
     int m_id;
 };
 
+// Writer lock shared by all connections to a database, in this and other processes.
+// Write access is arbitrated by an OFD lock on "<path>.lock", which the kernel releases
+// if the holder dies, falling back to the semaphore where OFD locks are unsupported.
 class ProcessMutex
 {
     Semaphore m_semaphore;
     QMutex m_mutex;
+    bool m_lockFileFailed;
+    int m_lockFile;
+    bool m_locked;
     bool m_initialProcess;
 
 public:
     ProcessMutex(const QString &path);
-    bool lock();
+    ~ProcessMutex();
+
+    // Waits at most timeoutMs for the lock, or indefinitely if negative.
+    bool lock(int timeoutMs = -1);
     bool unlock();
     bool isLocked() const;
+    // False if the lock file could not be opened although OFD locks are supported.
+    // Such a mutex cannot be locked.
+    bool isValid() const;
     bool isInitialProcess() const;
 };
 
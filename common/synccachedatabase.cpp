@@ -39,10 +39,13 @@
 #include "synccachedatabase_p.h"
 
 #include <QtCore/QFile>
+#include <QtCore/QFileInfo>
 #include <QtCore/QDir>
 #include <QtCore/QUuid>
 #include <QtCore/QVariant>
 #include <QtCore/QMutexLocker>
+#include <QtCore/QSet>
+#include <QtCore/QVersionNumber>
 
 #include <QtSql/QSqlQuery>
 #include <QtSql/QSqlDatabase>
@@ -50,6 +53,8 @@
 
 #include <QtDebug>
 
+#include <algorithm>
+
 using namespace SyncCache;
 
 static const char *quickCheck =
@@ -72,11 +77,33 @@ static const char *setupJournal =
         "\n PRAGMA journal_mode = WAL;";
 
 static const char *setupSynchronous =
-        "\n PRAGMA synchronous = FULL;";
+        "\n PRAGMA synchronous = %1;";
+
+static const char *setupCacheSize =
+        "\n PRAGMA cache_size = %1;";
+
+static const char *setupMmapSize =
+        "\n PRAGMA mmap_size = %1;";
+
+static const char *setupWalAutoCheckpoint =
+        "\n PRAGMA wal_autocheckpoint = %1;";
+
+static const char *setupJournalSizeLimit =
+        "\n PRAGMA journal_size_limit = %1;";
+
+static const char *setupBusyTimeout =
+        "\n PRAGMA busy_timeout = %1;";
+
+static const char *walCheckpoint =
+        "\n PRAGMA wal_checkpoint(%1);";
 
 static const char *setupForeignKeys =
         "\n PRAGMA foreign_keys = ON;";
 
+const char *const DatabaseImpl::createFileTombstonesTable =
+        "\n CREATE TABLE FileTombstones ("
+        "\n path TEXT PRIMARY KEY);";
+
 static bool execute(QSqlDatabase &database, const QString &statement)
 {
     QSqlQuery query(database);
@@ -193,6 +220,11 @@ static bool checkDatabase(QSqlDatabase &database)
     return false;
 }
 
+static QString cleanShutdownMarker(const QString &fileName)
+{
+    return fileName + QStringLiteral(".clean");
+}
+
 static bool upgradeDatabase(QSqlDatabase &database, const int currentSchemaVersion, const QVector<UpgradeOperation> &upgradeVersions)
 {
     if (!beginTransaction(database))
@@ -203,12 +235,17 @@ static bool upgradeDatabase(QSqlDatabase &database, const int currentSchemaVersi
     return finalizeTransaction(database, success);
 }
 
-static bool configureDatabase(QSqlDatabase &database)
+static bool configureDatabase(QSqlDatabase &database, const DatabaseOptions &options)
 {
     if (!execute(database, QLatin1String(setupEncoding))
             || !execute(database, QLatin1String(setupTempStore))
             || !execute(database, QLatin1String(setupJournal))
-            || !execute(database, QLatin1String(setupSynchronous))
+            || !execute(database, QString::fromLatin1(setupSynchronous).arg(static_cast<int>(options.synchronous)))
+            || !execute(database, QString::fromLatin1(setupCacheSize).arg(options.cacheSize))
+            || !execute(database, QString::fromLatin1(setupMmapSize).arg(options.mmapSize))
+            || !execute(database, QString::fromLatin1(setupWalAutoCheckpoint).arg(options.walAutoCheckpoint))
+            || !execute(database, QString::fromLatin1(setupJournalSizeLimit).arg(options.journalSizeLimit))
+            || !execute(database, QString::fromLatin1(setupBusyTimeout).arg(options.busyTimeout))
             || !execute(database, QLatin1String(setupForeignKeys))) {
         return false;
     }
@@ -235,9 +272,9 @@ static bool executeCreationStatements(QSqlDatabase &database, const int currentS
     return true;
 }
 
-static bool prepareDatabase(QSqlDatabase &database, const int currentSchemaVersion, const QVector<const char *> &createStatements)
+static bool prepareDatabase(QSqlDatabase &database, const DatabaseOptions &options, const int currentSchemaVersion, const QVector<const char *> &createStatements)
 {
-    if (!configureDatabase(database))
+    if (!configureDatabase(database, options))
         return false;
 
     if (!beginTransaction(database))
@@ -250,10 +287,333 @@ static bool prepareDatabase(QSqlDatabase &database, const int currentSchemaVersi
 
 //-----------------------------------------------------------------------------
 
+DatabaseOptions DatabaseOptions::durable()
+{
+    return DatabaseOptions();
+}
+
+DatabaseOptions DatabaseOptions::throughput()
+{
+    DatabaseOptions options;
+    options.synchronous = SynchronousNormal;
+    options.cacheSize = -8192;                      // 8 MiB
+    options.mmapSize = 64 * 1024 * 1024;
+    options.walAutoCheckpoint = 4000;               // about 16 MiB of 4 KiB pages
+    options.journalSizeLimit = 8 * 1024 * 1024;
+    options.integrityCheck = IntegrityCheckDeferred;
+    return options;
+}
+
+//-----------------------------------------------------------------------------
+
+void IntegrityCheckThread::run()
+{
+    // Pause between tables, to leave the storage to the foreground work.
+    static const unsigned long TableIntervalMs = 200;
+
+    const QString connectionName = QUuid::createUuid().toString().mid(1, 36);
+    {
+        QSqlDatabase database = QSqlDatabase::addDatabase(QString::fromLatin1("QSQLITE"), connectionName);
+        database.setConnectOptions(QStringLiteral("QSQLITE_OPEN_READONLY"));
+        database.setDatabaseName(m_fileName);
+        if (!database.open()) {
+            qWarning() << "Unable to open database for integrity check:" << m_fileName << database.lastError().text();
+        } else {
+            // SQLite ignores the table argument of quick_check before 3.33, and checks
+            // the whole database instead, so only check table by table from 3.33 on.
+            bool perTableCheck = false;
+            QSqlQuery versionQuery(database);
+            if (versionQuery.exec(QStringLiteral("SELECT sqlite_version()")) && versionQuery.next()) {
+                const QVersionNumber version = QVersionNumber::fromString(versionQuery.value(0).toString());
+                perTableCheck = version >= QVersionNumber(3, 33);
+            }
+            versionQuery.finish();
+
+            QStringList tables;
+            if (perTableCheck) {
+                QSqlQuery tablesQuery(database);
+                if (tablesQuery.exec(QStringLiteral("SELECT name FROM sqlite_master WHERE type = 'table'"))) {
+                    while (tablesQuery.next()) {
+                        tables.append(tablesQuery.value(0).toString());
+                    }
+                }
+                tablesQuery.finish();
+            }
+
+            // An empty table name checks the whole database at once.
+            if (tables.isEmpty()) {
+                tables.append(QString());
+            }
+
+            bool interrupted = false;
+            for (const QString &table : tables) {
+                if (isInterruptionRequested()) {
+                    interrupted = true;
+                    break;
+                }
+
+                QSqlQuery query(database);
+                const QString statement = table.isEmpty()
+                        ? QString::fromLatin1(quickCheck)
+                        : QStringLiteral("PRAGMA quick_check(%1)").arg(table);
+                if (!query.exec(statement)) {
+                    m_errorMessage = query.lastError().text();
+                    break;
+                }
+                QStringList problems;
+                while (query.next()) {
+                    const QString result(query.value(0).toString());
+                    if (result != QLatin1String(quickCheckOk)) {
+                        problems.append(result);
+                    }
+                }
+                if (!problems.isEmpty()) {
+                    m_errorMessage = problems.join(QLatin1Char('\n'));
+                    break;
+                }
+
+                msleep(TableIntervalMs);
+            }
+            m_completed = !interrupted;
+        }
+        database.close();
+    }
+    QSqlDatabase::removeDatabase(connectionName);
+}
+
+//-----------------------------------------------------------------------------
+
+void FileReaperThread::reap(const QVector<QString> &paths)
+{
+    QMutexLocker lock(&m_mutex);
+    m_pending += paths;
+    if (!m_running) {
+        // The thread may still be returning from a previous run.
+        wait();
+        m_running = true;
+        start(QThread::LowestPriority);
+    }
+}
+
+void FileReaperThread::cancel(const QVector<QString> &paths)
+{
+    QSet<QString> cancelled;
+    for (const QString &path : paths) {
+        cancelled.insert(path);
+    }
+    QMutexLocker lock(&m_mutex);
+    m_pending.erase(std::remove_if(m_pending.begin(), m_pending.end(),
+                                   [&cancelled](const QString &path) { return cancelled.contains(path); }),
+                    m_pending.end());
+}
+
+void FileReaperThread::run()
+{
+    // Pause between batches, to leave the storage and the writer lock to the foreground work.
+    static const int BatchSize = 50;
+    static const unsigned long BatchIntervalMs = 20;
+
+    const QString connectionName = QUuid::createUuid().toString().mid(1, 36);
+    {
+        QSqlDatabase database = QSqlDatabase::addDatabase(QString::fromLatin1("QSQLITE"), connectionName);
+        database.setDatabaseName(m_fileName);
+        if (!database.open() || !configureDatabase(database, m_options)) {
+            qWarning() << "Unable to open database to reap files:" << m_fileName << database.lastError().text();
+            database.close();
+        }
+
+        forever {
+            QVector<QString> batch;
+            {
+                QMutexLocker lock(&m_mutex);
+                if (m_pending.isEmpty() || isInterruptionRequested() || !database.isOpen()) {
+                    // Files not reaped keep their tombstones, and are reaped on the next open.
+                    m_pending.clear();
+                    m_running = false;
+                    break;
+                }
+                batch = m_pending.mid(0, BatchSize);
+                m_pending.remove(0, batch.size());
+            }
+
+            if (!reapBatch(database, batch)) {
+                qWarning() << "Failed to reap" << batch.size() << "files:" << database.lastError().text();
+            }
+
+            msleep(BatchIntervalMs);
+        }
+        database.close();
+    }
+    QSqlDatabase::removeDatabase(connectionName);
+}
+
+bool FileReaperThread::reapBatch(QSqlDatabase &database, const QVector<QString> &paths)
+{
+    // Hold the writer lock, so that no transaction can commit one of the files as
+    // live between the check of its tombstone and its unlinking.
+    if (!m_processMutex->lock(m_options.writeLockTimeout)) {
+        return false;
+    }
+
+    bool success = ::beginTransaction(database);
+    if (success) {
+        QSqlQuery query(database);
+        success = query.prepare(QStringLiteral("DELETE FROM FileTombstones WHERE path = ?"));
+        for (int i = 0; success && i < paths.size(); ++i) {
+            query.bindValue(0, paths.at(i));
+            success = query.exec();
+            // Without a tombstone, the file is live again or was reaped by another process.
+            if (success && query.numRowsAffected() > 0) {
+                // Already missing if reaped before a crash, so failure is expected.
+                QFile::remove(paths.at(i));
+            }
+        }
+        query.finish();
+        success = finalizeTransaction(database, success);
+    }
+
+    m_processMutex->unlock();
+    return success;
+}
+
+//-----------------------------------------------------------------------------
+
 DatabasePrivate::~DatabasePrivate()
 {
 }
 
+void DatabasePrivate::recordQuery(const QString &queryName, const QString &executedQuery, qint64 elapsedNs, int rows) const
+{
+    // Enough recent samples for a stable 95th percentile, without unbounded growth.
+    static const int RecentTimeCount = 200;
+
+    const qint64 elapsedUs = elapsedNs / 1000;
+    if (m_slowQueryThreshold >= 0 && elapsedUs >= m_slowQueryThreshold * 1000LL) {
+        qWarning() << "Slow" << queryName << "query took" << elapsedUs / 1000 << "ms, returning" << rows << "rows:"
+                   << executedQuery;
+    }
+
+    if (!m_queryStatisticsEnabled) {
+        return;
+    }
+
+    QMutexLocker lock(&m_queryTimingsMutex);
+    QueryTimings &timings = m_queryTimings[queryName];
+    ++timings.calls;
+    timings.rows += rows;
+    timings.totalTime += elapsedUs;
+    timings.maxTime = qMax(timings.maxTime, elapsedUs);
+    if (timings.recentTimes.size() < RecentTimeCount) {
+        timings.recentTimes.append(elapsedUs);
+    } else {
+        timings.recentTimes[timings.nextRecentTime] = elapsedUs;
+        timings.nextRecentTime = (timings.nextRecentTime + 1) % RecentTimeCount;
+    }
+}
+
+bool DatabasePrivate::storeFileTombstones(const QVector<QString> &doomedFiles, const QVector<QString> &liveFiles, DatabaseError *error)
+{
+    auto pathBinder = [](DatabaseQuery &query, const QString &path) {
+        DatabaseImpl::bindValues(query, path);
+    };
+    auto ignoreResult = [](const QString &) {};
+
+    // A file written again, e.g. by downloading a deleted image afresh, must not
+    // be reaped.  Most transactions only store, so only look the files up if
+    // there are any tombstones.
+    QSet<QString> liveFileSet;
+    QVector<QString> livePaths;
+    for (const QString &path : liveFiles) {
+        if (!path.isEmpty() && !liveFileSet.contains(path)) {
+            liveFileSet.insert(path);
+            livePaths.append(path);
+        }
+    }
+    if (!livePaths.isEmpty()) {
+        const bool hasTombstones = DatabaseImpl::fetch<bool>(
+                this,
+                QStringLiteral("SELECT EXISTS (SELECT 1 FROM FileTombstones)"),
+                [](DatabaseQuery &) {},
+                [](DatabaseQuery &selectQuery) -> bool { return selectQuery.value(0).toBool(); },
+                QStringLiteral("hasFileTombstones"),
+                error);
+        if (error->errorCode != DatabaseError::NoError) {
+            return false;
+        }
+        if (hasTombstones) {
+            DatabaseImpl::storeMultiple<QString>(
+                    this,
+                    QStringLiteral("DELETE FROM FileTombstones WHERE path = ?"),
+                    livePaths,
+                    pathBinder,
+                    ignoreResult,
+                    QStringLiteral("liveFileTombstones"),
+                    error);
+            if (error->errorCode != DatabaseError::NoError) {
+                return false;
+            }
+            if (m_fileReaperThread) {
+                m_fileReaperThread->cancel(livePaths);
+            }
+        }
+    }
+
+    QVector<QString> tombstones;
+    for (const QString &path : doomedFiles) {
+        if (!path.isEmpty() && !liveFileSet.contains(path)) {
+            tombstones.append(path);
+        }
+    }
+    DatabaseImpl::storeMultiple<QString>(
+            this,
+            QStringLiteral("INSERT OR IGNORE INTO FileTombstones (path) VALUES (?)"),
+            tombstones,
+            pathBinder,
+            ignoreResult,
+            QStringLiteral("fileTombstones"),
+            error);
+    return error->errorCode == DatabaseError::NoError;
+}
+
+void DatabasePrivate::reapFiles(const QVector<QString> &doomedFiles)
+{
+    QVector<QString> paths;
+    for (const QString &path : doomedFiles) {
+        if (!path.isEmpty()) {
+            paths.append(path);
+        }
+    }
+    if (!paths.isEmpty()) {
+        fileReaper()->reap(paths);
+    }
+}
+
+FileReaperThread *DatabasePrivate::fileReaper()
+{
+    if (!m_fileReaperThread) {
+        m_fileReaperThread.reset(new FileReaperThread(m_database.databaseName(), m_parent->processMutex(), m_options));
+    }
+    return m_fileReaperThread.data();
+}
+
+void DatabasePrivate::reapFileTombstones()
+{
+    DatabaseError error;
+    const QVector<QString> paths = DatabaseImpl::fetchMultiple<QString>(
+            this,
+            QStringLiteral("SELECT path FROM FileTombstones"),
+            [](DatabaseQuery &) {},
+            [](DatabaseQuery &selectQuery) -> QString { return selectQuery.value(0).toString(); },
+            QStringLiteral("fileTombstones"),
+            &error);
+    if (error.errorCode != DatabaseError::NoError) {
+        qWarning() << "Failed to read file tombstones:" << error.errorMessage;
+    } else if (!paths.isEmpty()) {
+        qDebug() << "Reaping" << paths.size() << "files left over from a previous session";
+        fileReaper()->reap(paths);
+    }
+}
+
 Database::Database(DatabasePrivate *dptr, QObject *parent)
     : QObject(parent), d_ptr(dptr)
 {
@@ -261,6 +621,32 @@ Database::Database(DatabasePrivate *dptr, QObject *parent)
 
 Database::~Database()
 {
+    Q_D(Database);
+
+    // The finished() handler does not run once destruction has begun, so read the
+    // result of the background check here.  Unless it ran to completion and passed,
+    // leave the marker absent, so that the next owner checks synchronously.
+    if (d->m_integrityCheckThread) {
+        d->m_integrityCheckThread->requestInterruption();
+        d->m_integrityCheckThread->wait();
+        if (!d->m_integrityCheckThread->completed() || d->m_integrityCheckThread->failed()) {
+            d->m_cleanShutdownMarker.clear();
+        }
+    }
+
+    // Files not yet reaped keep their tombstones, and are reaped on the next open.
+    if (d->m_fileReaperThread) {
+        d->m_fileReaperThread->requestInterruption();
+        d->m_fileReaperThread->wait();
+    }
+
+    // Record the clean shutdown, so that the next owner can defer its integrity check.
+    if (!d->m_cleanShutdownMarker.isEmpty()) {
+        QFile marker(d->m_cleanShutdownMarker);
+        if (!marker.open(QIODevice::WriteOnly)) {
+            qWarning() << "Unable to write clean shutdown marker:" << d->m_cleanShutdownMarker;
+        }
+    }
 }
 
 void Database::setDatabaseError(DatabaseError *error, DatabaseError::ErrorCode code, const QString &message) {
@@ -285,6 +671,19 @@ void Database::openDatabase(const QString &fileName, DatabaseError *error)
 {
     Q_D(Database);
 
+    openDatabase(fileName, d->defaultOptions(), error);
+}
+
+DatabaseOptions Database::databaseOptions() const
+{
+    Q_D(const Database);
+    return d->m_options;
+}
+
+void Database::openDatabase(const QString &fileName, const DatabaseOptions &options, DatabaseError *error)
+{
+    Q_D(Database);
+
     if (d->m_database.isOpen()) {
         setDatabaseError(error, DatabaseError::AlreadyOpenError,
                          QString::fromLatin1("Unable to open database when already open: %1").arg(fileName));
@@ -316,14 +715,15 @@ void Database::openDatabase(const QString &fileName, DatabaseError *error)
         return;
     }
 
-    if (!databasePreexisting && !prepareDatabase(d->m_database, d->currentSchemaVersion(), d->createStatements())) {
+    d->m_options = options;
+    if (!databasePreexisting && !prepareDatabase(d->m_database, options, d->currentSchemaVersion(), d->createStatements())) {
         setDatabaseError(error, DatabaseError::CreateError,
                          QString::fromLatin1("Failed to prepare database: %1")
                                         .arg(d->m_database.lastError().text()));
         d->m_database.close();
         QFile::remove(fileName);
         return;
-    } else if (databasePreexisting && !configureDatabase(d->m_database)) {
+    } else if (databasePreexisting && !configureDatabase(d->m_database, options)) {
         setDatabaseError(error, DatabaseError::ConfigurationError,
                          QString::fromLatin1("Failed to configure Nextcloud database: %1")
                                         .arg(d->m_database.lastError().text()));
@@ -333,13 +733,21 @@ void Database::openDatabase(const QString &fileName, DatabaseError *error)
 
     // Get the process mutex for this database
     ProcessMutex *mutex(processMutex());
+    if (!mutex->isValid()) {
+        setDatabaseError(error, DatabaseError::ProcessMutexError,
+                         QString::fromLatin1("Failed to open lock file for database: %1")
+                                        .arg(fileName));
+        d->m_database.close();
+        d->m_processMutex.reset();
+        return;
+    }
 
     // Only the first connection in the first process to concurrently open the DB is the owner
     const bool databaseOwner(mutex->isInitialProcess());
 
     if (databasePreexisting && databaseOwner) {
         // Try to upgrade, if necessary
-        if (!mutex->lock()) {
+        if (!mutex->lock(options.writeLockTimeout)) {
             setDatabaseError(error, DatabaseError::ProcessMutexError,
                              QString::fromLatin1("Failed to lock mutex for database: %1")
                                             .arg(fileName));
@@ -347,8 +755,17 @@ void Database::openDatabase(const QString &fileName, DatabaseError *error)
             return;
         }
 
-        // Perform an integrity check
-        if (!checkDatabase(d->m_database)) {
+        // Perform an integrity check.  In deferred mode, it is skipped if the previous
+        // owner shut down cleanly and performed in the background instead.  The marker
+        // is removed here, so that it is only present again after this process shuts
+        // down cleanly.
+        const QString marker = cleanShutdownMarker(fileName);
+        const bool deferIntegrityCheck = options.integrityCheck == DatabaseOptions::IntegrityCheckDeferred
+                && QFile::exists(marker);
+        if (deferIntegrityCheck && !QFile::remove(marker)) {
+            qWarning() << "Unable to remove clean shutdown marker:" << marker;
+        }
+        if (!deferIntegrityCheck && !checkDatabase(d->m_database)) {
             setDatabaseError(error, DatabaseError::IntegrityCheckError,
                              QString::fromLatin1("Database integrity check failed: %1")
                                             .arg(d->m_database.lastError().text()));
@@ -367,6 +784,21 @@ void Database::openDatabase(const QString &fileName, DatabaseError *error)
         }
 
         mutex->unlock();
+
+        if (deferIntegrityCheck) {
+            d->m_integrityCheckThread.reset(new IntegrityCheckThread(fileName));
+            IntegrityCheckThread *thread = d->m_integrityCheckThread.data();
+            connect(thread, &QThread::finished, this, [this, thread] {
+                Q_D(Database);
+                if (thread->failed()) {
+                    qWarning() << "Background integrity check failed:" << thread->errorMessage();
+                    // Check synchronously again on the next open.
+                    d->m_cleanShutdownMarker.clear();
+                    emit integrityCheckFailed(thread->errorMessage());
+                }
+            });
+            thread->start(QThread::IdlePriority);
+        }
     } else if (databasePreexisting && !databaseOwner) {
         // check that the version is correct.  If not, it is probably because another process
         // with an open database connection is preventing upgrade of the database schema.
@@ -390,6 +822,19 @@ void Database::openDatabase(const QString &fileName, DatabaseError *error)
             return;
         }
     }
+
+    if (databaseOwner && options.integrityCheck == DatabaseOptions::IntegrityCheckDeferred) {
+        d->m_cleanShutdownMarker = cleanShutdownMarker(fileName);
+        if (!databasePreexisting) {
+            QFile::remove(d->m_cleanShutdownMarker);
+        }
+    }
+
+    // Collect any files whose deletion was committed but not completed.  Only the
+    // owner does so, rather than every process and connection which opens it.
+    if (databasePreexisting && databaseOwner && !d->m_readOnly) {
+        d->reapFileTombstones();
+    }
 }
 
 bool Database::inTransaction() const
@@ -408,13 +853,19 @@ bool Database::beginTransaction(DatabaseError *error)
         return false;
     }
 
+    if (d->m_readOnly) {
+        setDatabaseError(error, DatabaseError::TransactionError,
+                         QStringLiteral("Transaction error: cannot begin transaction, database is read-only"));
+        return false;
+    }
+
     ProcessMutex *mutex(processMutex());
 
     // We use a cross-process mutex to ensure only one process can write
     // to the DB at once.  Without external locking, SQLite will back off
     // on write contention, and the backed-off process may never get access
     // if other processes are performing regular writes.
-    if (mutex->lock()) {
+    if (mutex->lock(d->m_options.writeLockTimeout)) {
         if (::beginTransaction(d->m_database)) {
             d->m_inTransaction = true;
             return true;
@@ -445,7 +896,6 @@ bool Database::commitTransaction(DatabaseError *error)
                 d->transactionCommittedPreUnlock();
                 mutex->unlock(); // process mutex.
                 d->transactionCommittedPostUnlock();
-
                 return true;
             }
 
@@ -484,3 +934,270 @@ bool Database::rollbackTransaction(DatabaseError *error)
 
     return rv;
 }
+
+bool Database::inReadTransaction() const
+{
+    Q_D(const Database);
+    return d->m_readSnapshots > 0;
+}
+
+bool Database::beginReadTransaction(DatabaseError *error)
+{
+    Q_D(Database);
+
+    if (!d->m_database.isOpen()) {
+        setDatabaseError(error, DatabaseError::NotOpenError,
+                         QStringLiteral("Database is not open, cannot begin read transaction"));
+        return false;
+    }
+
+    if (d->m_readSnapshots > 0) {
+        ++d->m_readSnapshots;
+        return true;
+    }
+
+    if (!d->m_readDatabase.isOpen()) {
+        d->m_readDatabase = QSqlDatabase::addDatabase(QString::fromLatin1("QSQLITE"),
+                                                      d->m_database.connectionName() + QStringLiteral("-read"));
+        d->m_readDatabase.setConnectOptions(QStringLiteral("QSQLITE_OPEN_READONLY"));
+        d->m_readDatabase.setDatabaseName(d->m_database.databaseName());
+        if (!d->m_readDatabase.open()
+                || !execute(d->m_readDatabase, QString::fromLatin1(setupCacheSize).arg(d->m_options.cacheSize))
+                || !execute(d->m_readDatabase, QString::fromLatin1(setupMmapSize).arg(d->m_options.mmapSize))
+                || !execute(d->m_readDatabase, QString::fromLatin1(setupBusyTimeout).arg(d->m_options.busyTimeout))) {
+            setDatabaseError(error, DatabaseError::OpenError,
+                             QStringLiteral("Unable to open read connection: %1")
+                                       .arg(d->m_readDatabase.lastError().text()));
+            d->m_readDatabase.close();
+            return false;
+        }
+    }
+
+    // A deferred transaction takes no lock until the first read, and in WAL mode
+    // that is a read lock which neither waits for nor blocks writers.
+    if (!execute(d->m_readDatabase, QStringLiteral("BEGIN DEFERRED TRANSACTION"))) {
+        setDatabaseError(error, DatabaseError::TransactionError,
+                         QStringLiteral("Transaction error: unable to begin read transaction: %1")
+                                   .arg(d->m_readDatabase.lastError().text()));
+        return false;
+    }
+
+    d->m_readSnapshots = 1;
+    return true;
+}
+
+bool Database::endReadTransaction(DatabaseError *error)
+{
+    Q_D(Database);
+
+    if (d->m_readSnapshots <= 0) {
+        setDatabaseError(error, DatabaseError::TransactionError,
+                         QStringLiteral("Transaction error: no read transaction to end"));
+        return false;
+    }
+
+    if (--d->m_readSnapshots > 0) {
+        return true;
+    }
+
+    // Prepared statements keep their read lock until reset.
+    for (QSqlQuery &query : d->m_readPreparedQueries) {
+        query.finish();
+    }
+
+    if (!execute(d->m_readDatabase, QStringLiteral("COMMIT TRANSACTION"))) {
+        setDatabaseError(error, DatabaseError::TransactionError,
+                         QStringLiteral("Transaction error: unable to end read transaction: %1")
+                                   .arg(d->m_readDatabase.lastError().text()));
+        return false;
+    }
+
+    return true;
+}
+
+ReadSnapshot::ReadSnapshot(Database *database, DatabaseError *error)
+    : m_database(database)
+    , m_valid(database->beginReadTransaction(error))
+{
+}
+
+ReadSnapshot::~ReadSnapshot()
+{
+    if (m_valid) {
+        DatabaseError error;
+        if (!m_database->endReadTransaction(&error)) {
+            qWarning() << error.errorMessage;
+        }
+    }
+}
+
+bool ReadSnapshot::isValid() const
+{
+    return m_valid;
+}
+
+//-----------------------------------------------------------------------------
+
+bool DatabaseImpl::convertTimestampColumns(QSqlDatabase &database, const QString &table, const QStringList &columns)
+{
+    // Values without a UTC offset were written in local time, so they are
+    // parsed with QDateTime rather than with the SQLite date functions.
+    QSqlQuery selectQuery(database);
+    selectQuery.setForwardOnly(true);
+    if (!selectQuery.exec(QStringLiteral("SELECT rowid, %1 FROM %2").arg(columns.join(QStringLiteral(", ")), table))) {
+        qWarning() << "Failed to query" << table << "timestamps for conversion:" << selectQuery.lastError().text();
+        return false;
+    }
+
+    // Collect the converted values first, rather than updating the rows
+    // while they are being iterated.
+    QVector<QVariantList> rows;
+    while (selectQuery.next()) {
+        QVariantList row;
+        row.reserve(columns.count() + 1);
+        for (int i = 1; i <= columns.count(); ++i) {
+            row.append(DatabaseImpl::timestampToVariant(
+                    QDateTime::fromString(selectQuery.value(i).toString(), Qt::ISODate)));
+        }
+        row.append(selectQuery.value(0));
+        rows.append(row);
+    }
+    selectQuery.finish();
+
+    QStringList assignments;
+    for (const QString &column : columns) {
+        assignments.append(column + QStringLiteral(" = ?"));
+    }
+
+    QSqlQuery updateQuery(database);
+    if (!updateQuery.prepare(QStringLiteral("UPDATE %1 SET %2 WHERE rowid = ?").arg(table, assignments.join(QStringLiteral(", "))))) {
+        qWarning() << "Failed to prepare" << table << "timestamp conversion:" << updateQuery.lastError().text();
+        return false;
+    }
+
+    for (const QVariantList &row : rows) {
+        for (int i = 0; i < row.count(); ++i) {
+            updateQuery.bindValue(i, row.at(i));
+        }
+        if (!updateQuery.exec()) {
+            qWarning() << "Failed to convert" << table << "timestamps:" << updateQuery.lastError().text();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool Database::checkpoint(CheckpointMode mode, DatabaseError *error)
+{
+    Q_D(Database);
+
+    if (!d->m_database.isOpen()) {
+        setDatabaseError(error, DatabaseError::NotOpenError,
+                         QStringLiteral("Database is not open, cannot checkpoint"));
+        return false;
+    }
+    if (inTransaction()) {
+        setDatabaseError(error, DatabaseError::TransactionError,
+                         QStringLiteral("Cannot checkpoint within a transaction"));
+        return false;
+    }
+
+    // A truncating checkpoint blocks writers, so take the process mutex like a write transaction.
+    ProcessMutex *mutex(processMutex());
+    const bool lockRequired = mode != PassiveCheckpoint;
+    if (lockRequired && !mutex->lock(d->m_options.writeLockTimeout)) {
+        setDatabaseError(error, DatabaseError::TransactionLockError,
+                         QStringLiteral("Lock error: unable to lock for checkpoint"));
+        return false;
+    }
+
+    QSqlQuery query(d->m_database);
+    const bool success = query.exec(QString::fromLatin1(walCheckpoint)
+                                    .arg(mode == PassiveCheckpoint ? QStringLiteral("PASSIVE")
+                                                                   : QStringLiteral("TRUNCATE")))
+            && query.next();
+    if (success) {
+        d->m_walStatus.busy = query.value(0).toInt() != 0;
+        d->m_walStatus.logFrames = query.value(1).toInt();
+        d->m_walStatus.checkpointedFrames = query.value(2).toInt();
+    } else {
+        setDatabaseError(error, DatabaseError::QueryError,
+                         QStringLiteral("Failed to checkpoint: %1").arg(query.lastError().text()));
+    }
+    query.finish();
+
+    if (lockRequired) {
+        mutex->unlock();
+    }
+
+    if (success) {
+        qDebug() << "Checkpointed" << d->m_database.databaseName()
+                 << "frames:" << d->m_walStatus.checkpointedFrames << "/" << d->m_walStatus.logFrames
+                 << "busy:" << d->m_walStatus.busy;
+    }
+    return success;
+}
+
+WalStatus Database::walStatus() const
+{
+    Q_D(const Database);
+
+    WalStatus status = d->m_walStatus;
+    if (d->m_database.isOpen()) {
+        status.walFileSize = QFileInfo(d->m_database.databaseName() + QStringLiteral("-wal")).size();
+    }
+    return status;
+}
+
+void Database::setQueryStatisticsEnabled(bool enabled)
+{
+    Q_D(Database);
+    d->m_queryStatisticsEnabled = enabled;
+}
+
+void Database::setSlowQueryThreshold(int milliseconds)
+{
+    Q_D(Database);
+    d->m_slowQueryThreshold = milliseconds;
+}
+
+QVector<QueryStatistics> Database::queryStatistics() const
+{
+    Q_D(const Database);
+
+    QMutexLocker lock(&d->m_queryTimingsMutex);
+    QVector<QueryStatistics> statistics;
+    statistics.reserve(d->m_queryTimings.size());
+    for (QHash<QString, DatabasePrivate::QueryTimings>::const_iterator it = d->m_queryTimings.constBegin();
+            it != d->m_queryTimings.constEnd(); ++it) {
+        QueryStatistics queryStatistics;
+        queryStatistics.queryName = it.key();
+        queryStatistics.calls = it->calls;
+        queryStatistics.rows = it->rows;
+        queryStatistics.totalTime = it->totalTime;
+        queryStatistics.maxTime = it->maxTime;
+
+        QVector<qint64> recentTimes = it->recentTimes;
+        if (!recentTimes.isEmpty()) {
+            QVector<qint64>::iterator percentile = recentTimes.begin() + (recentTimes.size() - 1) * 95 / 100;
+            std::nth_element(recentTimes.begin(), percentile, recentTimes.end());
+            queryStatistics.p95Time = *percentile;
+        }
+        statistics.append(queryStatistics);
+    }
+
+    // Most expensive first
+    std::sort(statistics.begin(), statistics.end(), [](const QueryStatistics &lhs, const QueryStatistics &rhs) {
+        return lhs.totalTime > rhs.totalTime;
+    });
+    return statistics;
+}
+
+void Database::resetQueryStatistics()
+{
+    Q_D(Database);
+
+    QMutexLocker lock(&d->m_queryTimingsMutex);
+    d->m_queryTimings.clear();
+}
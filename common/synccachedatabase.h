@@ -40,6 +40,7 @@
 
 #include <QtCore/QObject>
 #include <QtCore/QString>
+#include <QtCore/QVector>
 
 namespace SyncCache {
 
@@ -67,6 +68,55 @@ struct DatabaseError {
     QString errorMessage;
 };
 
+// SQLite tuning applied to each connection when the database is opened.
+// The defaults are the durable profile, which keeps the SQLite and QSQLITE
+// driver defaults.
+struct DatabaseOptions {
+    enum SynchronousMode {
+        SynchronousOff = 0,
+        SynchronousNormal = 1,
+        SynchronousFull = 2
+    };
+    enum IntegrityCheckMode {
+        IntegrityCheckOnOpen,   // PRAGMA quick_check whenever the first process opens the database
+        IntegrityCheckDeferred  // skipped after a clean shutdown and run in the background instead
+    };
+    SynchronousMode synchronous = SynchronousFull;
+    int cacheSize = -2000;          // PRAGMA cache_size: pages, or KiB if negative
+    qint64 mmapSize = 0;            // PRAGMA mmap_size: bytes, 0 disables memory mapping
+    int walAutoCheckpoint = 1000;   // PRAGMA wal_autocheckpoint: pages, 0 disables
+    qint64 journalSizeLimit = -1;   // PRAGMA journal_size_limit: bytes, -1 for no limit
+    int busyTimeout = 5000;         // PRAGMA busy_timeout: milliseconds
+    int writeLockTimeout = 30000;   // milliseconds to wait for the cross-process writer lock, -1 waits forever
+    IntegrityCheckMode integrityCheck = IntegrityCheckOnOpen;
+
+    // For databases holding data which cannot be recovered from elsewhere.
+    static DatabaseOptions durable();
+    // For caches which can always be re-synced from the server: a commit is
+    // not synced to disk until the next checkpoint, so the most recent
+    // transactions may be lost on power failure, but never corrupted.
+    static DatabaseOptions throughput();
+};
+
+// The state of the write-ahead log, as of the last explicit checkpoint.
+struct WalStatus {
+    qint64 walFileSize = 0;         // bytes, measured when the status is queried
+    int logFrames = -1;             // frames in the WAL, or -1 if not checkpointed yet
+    int checkpointedFrames = -1;    // frames copied back into the database
+    bool busy = false;              // the checkpoint could not complete
+};
+
+// Execution statistics for one named query, collected while enabled.
+// Times are in microseconds, and include stepping through the results.
+struct QueryStatistics {
+    QString queryName;
+    int calls = 0;
+    qint64 rows = 0;                // rows returned, or values stored or rows deleted
+    qint64 totalTime = 0;
+    qint64 maxTime = 0;
+    qint64 p95Time = 0;             // over the most recent calls
+};
+
 class ProcessMutex;
 class DatabasePrivate;
 class Database : public QObject
@@ -77,14 +127,38 @@ public:
     virtual ~Database();
     ProcessMutex *processMutex() const;
     void openDatabase(const QString &fileName, SyncCache::DatabaseError *error);
+    void openDatabase(const QString &fileName, const SyncCache::DatabaseOptions &options, SyncCache::DatabaseError *error);
+    SyncCache::DatabaseOptions databaseOptions() const;
 
     bool inTransaction() const;
     bool beginTransaction(SyncCache::DatabaseError *error);
     bool commitTransaction(SyncCache::DatabaseError *error);
     bool rollbackTransaction(SyncCache::DatabaseError *error);
 
+    bool inReadTransaction() const;
+    bool beginReadTransaction(SyncCache::DatabaseError *error);
+    bool endReadTransaction(SyncCache::DatabaseError *error);
+
+    enum CheckpointMode {
+        PassiveCheckpoint,      // copy what can be copied without waiting for readers or writers
+        TruncateCheckpoint      // wait for readers, copy everything and truncate the WAL file
+    };
+    bool checkpoint(CheckpointMode mode, SyncCache::DatabaseError *error);
+    SyncCache::WalStatus walStatus() const;
+
+    // Query instrumentation is off by default.  Queries slower than the threshold
+    // are logged with their SQL, whether or not statistics are collected.
+    void setQueryStatisticsEnabled(bool enabled);
+    void setSlowQueryThreshold(int milliseconds);   // -1 disables
+    QVector<SyncCache::QueryStatistics> queryStatistics() const;
+    void resetQueryStatistics();
+
     static void setDatabaseError(DatabaseError *error, DatabaseError::ErrorCode code, const QString &message);
 
+Q_SIGNALS:
+    // Emitted if the deferred background integrity check finds a problem.
+    void integrityCheckFailed(const QString &errorMessage);
+
 protected:
     explicit Database(DatabasePrivate *dptr, QObject *parent = nullptr);
     Q_DECLARE_PRIVATE(Database)
@@ -92,6 +166,26 @@ protected:
     QScopedPointer<DatabasePrivate> d_ptr;
 };
 
+// Holds a read transaction for its lifetime.  Until it is destroyed, the public read
+// functions of the database read the state last committed before the first of them,
+// using a separate read-only connection which never takes the writer lock, so that
+// they do not wait behind a write transaction in this or another process.  Writes,
+// and the reads made while writing, are unaffected, but are not visible to the snapshot.
+// Must be used in the thread which opened the database.
+class ReadSnapshot
+{
+public:
+    ReadSnapshot(Database *database, SyncCache::DatabaseError *error);
+    ~ReadSnapshot();
+
+    bool isValid() const;
+
+private:
+    Q_DISABLE_COPY(ReadSnapshot)
+    Database *m_database;
+    bool m_valid;
+};
+
 } // namespace SyncCache
 
 #endif // NEXTCLOUD_SYNCCACHE_DATABASE_H
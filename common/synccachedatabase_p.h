@@ -42,18 +42,22 @@
 #include "processmutex_p.h"
 
 #include <QtCore/QScopedPointer>
+#include <QtCore/QByteArray>
+#include <QtCore/QDateTime>
+#include <QtCore/QElapsedTimer>
 #include <QtCore/QHash>
+#include <QtCore/QUrl>
 #include <QtCore/QVariant>
 #include <QtCore/QVector>
 #include <QtCore/QString>
+#include <QtCore/QStringList>
 #include <QtCore/QMutex>
+#include <QtCore/QThread>
 
 #include <QtSql/QSqlDatabase>
 #include <QtSql/QSqlQuery>
 #include <QtSql/QSqlError>
 
-#include <functional>
-
 #define SYNCCACHE_DB_D(Class) Class##Private * const d = static_cast<Class##Private *>(d_func())
 
 namespace SyncCache {
@@ -66,9 +70,11 @@ public:
     QSqlError lastError() const { return m_error.isValid() ? m_error : m_query.lastError(); }
 
     void bindValue(const QString &id, const QVariant &value) { m_query.bindValue(id, value); }
+    void bindValue(int index, const QVariant &value) { m_query.bindValue(index, value); }
 
     bool exec() { return m_query.exec(); }
     bool next() { return m_query.next(); }
+    int numRowsAffected() const { return m_query.numRowsAffected(); }
     bool isValid() { return m_query.isValid(); }
     void finish() { return m_query.finish(); }
     QString executedQuery() const { return m_query.executedQuery(); }
@@ -89,6 +95,57 @@ private:
     QSqlError m_error;
 };
 
+// Runs PRAGMA quick_check one table at a time (or all at once before SQLite 3.33)
+// on its own read-only connection, so that it does not block the connection in
+// use or, in WAL mode, writers.
+class IntegrityCheckThread : public QThread
+{
+public:
+    explicit IntegrityCheckThread(const QString &fileName) : m_fileName(fileName) {}
+
+    // Whether every table was checked, rather than the check being interrupted or
+    // the database failing to open.  Only read once the thread has finished.
+    bool completed() const { return m_completed; }
+    bool failed() const { return !m_errorMessage.isEmpty(); }
+    QString errorMessage() const { return m_errorMessage; }
+
+protected:
+    void run() override;
+
+private:
+    QString m_fileName;
+    QString m_errorMessage;
+    bool m_completed = false;
+};
+
+// Unlinks the files of deleted rows at low priority, in small batches, so that
+// the committing thread does not wait on the file system.  Each batch is reaped
+// on its own connection while holding the writer lock: a file is only unlinked
+// if its tombstone is still present, and the tombstone is deleted in the same
+// transaction, so that a file committed as live again in the meantime is kept.
+class FileReaperThread : public QThread
+{
+public:
+    FileReaperThread(const QString &fileName, ProcessMutex *processMutex, const DatabaseOptions &options)
+        : m_fileName(fileName), m_processMutex(processMutex), m_options(options) {}
+
+    void reap(const QVector<QString> &paths);
+    void cancel(const QVector<QString> &paths);
+
+protected:
+    void run() override;
+
+private:
+    bool reapBatch(QSqlDatabase &database, const QVector<QString> &paths);
+
+    QString m_fileName;
+    ProcessMutex *m_processMutex;
+    DatabaseOptions m_options;
+    QMutex m_mutex;
+    QVector<QString> m_pending;
+    bool m_running = false;
+};
+
 typedef bool (*UpgradeFunction)(QSqlDatabase &database);
 struct UpgradeOperation {
     UpgradeFunction fn;
@@ -105,6 +162,7 @@ public:
     virtual int currentSchemaVersion() const = 0;
     virtual QVector<const char *> createStatements() const = 0;
     virtual QVector<UpgradeOperation> upgradeVersions() const = 0;
+    virtual DatabaseOptions defaultOptions() const { return DatabaseOptions::durable(); }
 
     virtual bool preTransactionCommit() = 0;
     virtual void transactionCommittedPreUnlock() = 0;
@@ -115,42 +173,196 @@ public:
         return prepare(QLatin1String(statement));
     }
     DatabaseQuery prepare(const QString &statement) const {
-        QMutexLocker lock(&m_preparedQueriesMutex);
-
-        QHash<QString, QSqlQuery>::const_iterator it = m_preparedQueries.constFind(statement);
-        if (it == m_preparedQueries.constEnd()) {
-            QSqlQuery query(m_database);
-            query.setForwardOnly(true);
-            if (!query.prepare(statement)) {
-                return DatabaseQuery(query.lastError());
-            }
-            it = m_preparedQueries.insert(statement, query);
-        }
-        return DatabaseQuery(*it);
+        return prepare(statement, m_database, &m_preparedQueries);
     }
+    // As prepare(), but on the reader connection while a read snapshot is active.
+    // Reads made during a write transaction stay on the writer connection, so that
+    // they see its uncommitted rows and temporary tables.
+    DatabaseQuery prepareSnapshotRead(const QString &statement) const {
+        return m_readSnapshots > 0 && !m_inTransaction
+                ? prepare(statement, m_readDatabase, &m_readPreparedQueries)
+                : prepare(statement, m_database, &m_preparedQueries);
+    }
+
+    // Files of deleted rows are recorded as tombstones in the committing transaction,
+    // and only unlinked by the reaper after the commit.  A tombstone is deleted in
+    // the transaction which unlinks its file, so any left by a crash are reaped when
+    // the database owner next opens it.  Call storeFileTombstones() from
+    // preTransactionCommit() with the files which are still in use, and reapFiles()
+    // once committed.
+    bool storeFileTombstones(const QVector<QString> &doomedFiles, const QVector<QString> &liveFiles, DatabaseError *error);
+    void reapFiles(const QVector<QString> &doomedFiles);
+
+    bool queryTimingEnabled() const { return m_queryStatisticsEnabled || m_slowQueryThreshold >= 0; }
+    void recordQuery(const QString &queryName, const QString &executedQuery, qint64 elapsedNs, int rows) const;
 
     QSqlDatabase m_database;
+    DatabaseOptions m_options;
     Database *m_parent;
+    bool m_readOnly = false;    // rejects write transactions, and never reaps files
 
 private:
     friend class SyncCache::Database;
     mutable QScopedPointer<ProcessMutex> m_processMutex;
     bool m_inTransaction = false;
 
+    QScopedPointer<IntegrityCheckThread> m_integrityCheckThread;
+    QString m_cleanShutdownMarker;
+
+    WalStatus m_walStatus;
+
+    QScopedPointer<FileReaperThread> m_fileReaperThread;
+    FileReaperThread *fileReaper();
+    void reapFileTombstones();
+
+    QSqlDatabase m_readDatabase;
+    int m_readSnapshots = 0;
+
     mutable QMutex m_preparedQueriesMutex;
     mutable QHash<QString, QSqlQuery> m_preparedQueries;
+    mutable QHash<QString, QSqlQuery> m_readPreparedQueries;
+
+    struct QueryTimings {
+        int calls = 0;
+        qint64 rows = 0;
+        qint64 totalTime = 0;
+        qint64 maxTime = 0;
+        QVector<qint64> recentTimes;    // ring buffer for the percentile
+        int nextRecentTime = 0;
+    };
+    bool m_queryStatisticsEnabled = false;
+    int m_slowQueryThreshold = -1;
+    mutable QMutex m_queryTimingsMutex;
+    mutable QHash<QString, QueryTimings> m_queryTimings;
+
+    DatabaseQuery prepare(const QString &statement, const QSqlDatabase &database, QHash<QString, QSqlQuery> *preparedQueries) const {
+        QMutexLocker lock(&m_preparedQueriesMutex);
+
+        QHash<QString, QSqlQuery>::const_iterator it = preparedQueries->constFind(statement);
+        if (it == preparedQueries->constEnd()) {
+            QSqlQuery query(database);
+            query.setForwardOnly(true);
+            if (!query.prepare(statement)) {
+                return DatabaseQuery(query.lastError());
+            }
+            it = preparedQueries->insert(statement, query);
+        }
+        return DatabaseQuery(*it);
+    }
 };
 
 namespace DatabaseImpl {
 
-template <typename T>
+// Times a query from construction to destruction, if instrumentation is enabled.
+// Declare it after the query, so that the query is still alive when it records.
+class QueryTimer
+{
+public:
+    QueryTimer(const DatabasePrivate *d, const QString &queryName, const DatabaseQuery &query)
+        : m_d(d), m_queryName(queryName), m_query(query)
+    {
+        if (m_d->queryTimingEnabled()) {
+            m_timer.start();
+        }
+    }
+    ~QueryTimer() { finish(); }
+
+    void addRows(int rows) { m_rows += rows; }
+    // Stops timing early, so that a following commit is not included.
+    void finish()
+    {
+        if (m_timer.isValid()) {
+            m_d->recordQuery(m_queryName, m_query.executedQuery(), m_timer.nsecsElapsed(), m_rows);
+            m_timer.invalidate();
+        }
+    }
+
+private:
+    Q_DISABLE_COPY(QueryTimer)
+    const DatabasePrivate *m_d;
+    const QString &m_queryName;
+    const DatabaseQuery &m_query;
+    QElapsedTimer m_timer;
+    int m_rows = 0;
+};
+
+// Timestamps are stored as INTEGER milliseconds since epoch, or NULL if invalid.
+inline QVariant timestampToVariant(const QDateTime &timestamp)
+{
+    return timestamp.isValid() ? QVariant(timestamp.toMSecsSinceEpoch()) : QVariant(QVariant::LongLong);
+}
+
+inline QDateTime timestampFromVariant(const QVariant &value)
+{
+    return value.isNull() ? QDateTime() : QDateTime::fromMSecsSinceEpoch(value.toLongLong());
+}
+
+// Rewrites the given ISO 8601 text columns of the table as milliseconds since
+// epoch, for use by schema upgrade functions.
+bool convertTimestampColumns(QSqlDatabase &database, const QString &table, const QStringList &columns);
+
+// The table of files awaiting the reaper, which each schema must include.
+extern const char *const createFileTombstonesTable;
+
+// Positional binding, in placeholder order.  Unlike binding by name, this needs
+// no placeholder name strings to be built per call and no name lookup in the
+// prepared query.  Each overload converts to the storage type used by the
+// schema: URLs are stored as text.
+inline void bindValue(DatabaseQuery &query, int index, const QString &value) { query.bindValue(index, value); }
+inline void bindValue(DatabaseQuery &query, int index, int value) { query.bindValue(index, value); }
+inline void bindValue(DatabaseQuery &query, int index, qint64 value) { query.bindValue(index, value); }
+inline void bindValue(DatabaseQuery &query, int index, const QByteArray &value) { query.bindValue(index, value); }
+inline void bindValue(DatabaseQuery &query, int index, const QUrl &value) { query.bindValue(index, value.toString()); }
+inline void bindValue(DatabaseQuery &query, int index, const QDateTime &value) { query.bindValue(index, timestampToVariant(value)); }
+
+inline void bindValuesFrom(DatabaseQuery &, int) {}
+
+template<typename T, typename... Args>
+void bindValuesFrom(DatabaseQuery &query, int index, const T &value, const Args &... args)
+{
+    bindValue(query, index, value);
+    bindValuesFrom(query, index + 1, args...);
+}
+
+template<typename... Args>
+void bindValues(DatabaseQuery &query, const Args &... args)
+{
+    bindValuesFrom(query, 0, args...);
+}
+
+// The binders and result handlers below are template parameters rather than
+// std::function, so that the lambdas passed in are called directly, without a
+// type-erased wrapper being built for every call.
+typedef QList<QPair<QString, QVariant> > NamedBindValues;
+
+inline void bindNamedValues(DatabaseQuery &query, const NamedBindValues &bindValues)
+{
+    for (const QPair<QString, QVariant> &bindValue : bindValues) {
+        query.bindValue(bindValue.first, bindValue.second);
+    }
+}
+
+// The connection which a fetch reads through.  Only the public read functions,
+// which may be called under a ReadSnapshot, should ask for the snapshot.
+enum ReadConnection {
+    WriterConnection,
+    SnapshotConnection  // the reader connection while a ReadSnapshot is held
+};
+
+inline DatabaseQuery prepareFetch(const DatabasePrivate *d, const QString &queryString, ReadConnection connection)
+{
+    return connection == SnapshotConnection ? d->prepareSnapshotRead(queryString) : d->prepare(queryString);
+}
+
+template <typename T, typename Binder, typename ResultHandler>
 QVector<T> fetchMultiple(
         const DatabasePrivate *d,
         const QString &queryString,
-        const QList<QPair<QString, QVariant> > &bindValues,
-        std::function<T(DatabaseQuery&)> resultHandler,
+        const Binder &binder,
+        const ResultHandler &resultHandler,
         const QString &queryName,
-        DatabaseError *error)
+        DatabaseError *error,
+        ReadConnection connection = WriterConnection)
 {
     QVector<T> retn;
     if (!d->m_database.isOpen()) {
@@ -160,7 +372,7 @@ QVector<T> fetchMultiple(
         return retn;
     }
 
-    DatabaseQuery selectQuery(d->prepare(queryString));
+    DatabaseQuery selectQuery(prepareFetch(d, queryString, connection));
     if (selectQuery.lastError().isValid()) {
         Database::setDatabaseError(error, DatabaseError::PrepareQueryError,
                                    QStringLiteral("Failed to prepare %1 query: %2\n%3")
@@ -170,10 +382,9 @@ QVector<T> fetchMultiple(
         return retn;
     }
 
-    for (const QPair<QString, QVariant> &bindValue : bindValues) {
-        selectQuery.bindValue(bindValue.first, bindValue.second);
-    }
+    binder(selectQuery);
 
+    QueryTimer timer(d, queryName, selectQuery);
     if (!selectQuery.exec()) {
         Database::setDatabaseError(error, DatabaseError::QueryError,
                                    QStringLiteral("Failed to execute %1 query: %2\n%3")
@@ -187,17 +398,33 @@ QVector<T> fetchMultiple(
     while (selectQuery.next()) {
         retn.append(resultHandler(selectQuery));
     }
+    timer.addRows(retn.size());
 
     return retn;
 }
 
-template<typename T>
+template <typename T, typename ResultHandler>
+QVector<T> fetchMultiple(
+        const DatabasePrivate *d,
+        const QString &queryString,
+        const NamedBindValues &bindValues,
+        const ResultHandler &resultHandler,
+        const QString &queryName,
+        DatabaseError *error,
+        ReadConnection connection = WriterConnection)
+{
+    auto binder = [&bindValues](DatabaseQuery &query) { bindNamedValues(query, bindValues); };
+    return fetchMultiple<T>(d, queryString, binder, resultHandler, queryName, error, connection);
+}
+
+template<typename T, typename Binder, typename ResultHandler>
 T fetch(const DatabasePrivate *d,
         const QString &queryString,
-        const QList<QPair<QString, QVariant> > &bindValues,
-        std::function<T(DatabaseQuery&)> resultHandler,
+        const Binder &binder,
+        const ResultHandler &resultHandler,
         const QString &queryName,
-        DatabaseError *error)
+        DatabaseError *error,
+        ReadConnection connection = WriterConnection)
 {
     T retn;
     if (!d->m_database.isOpen()) {
@@ -207,7 +434,7 @@ T fetch(const DatabasePrivate *d,
         return retn;
     }
 
-    DatabaseQuery selectQuery(d->prepare(queryString));
+    DatabaseQuery selectQuery(prepareFetch(d, queryString, connection));
     if (selectQuery.lastError().isValid()) {
         Database::setDatabaseError(error, DatabaseError::PrepareQueryError,
                                    QStringLiteral("Failed to prepare %1 query: %2\n%3")
@@ -217,10 +444,9 @@ T fetch(const DatabasePrivate *d,
         return retn;
     }
 
-    for (const QPair<QString, QVariant> &bindValue : bindValues) {
-        selectQuery.bindValue(bindValue.first, bindValue.second);
-    }
+    binder(selectQuery);
 
+    QueryTimer timer(d, queryName, selectQuery);
     if (!selectQuery.exec()) {
         Database::setDatabaseError(error, DatabaseError::QueryError,
                                    QStringLiteral("Failed to execute %1 query: %2\n%3")
@@ -231,18 +457,32 @@ T fetch(const DatabasePrivate *d,
     }
 
     if (selectQuery.next()) {
+        timer.addRows(1);
         return resultHandler(selectQuery);
     }
 
     return retn;
 }
 
-template<typename T>
+template<typename T, typename ResultHandler>
+T fetch(const DatabasePrivate *d,
+        const QString &queryString,
+        const NamedBindValues &bindValues,
+        const ResultHandler &resultHandler,
+        const QString &queryName,
+        DatabaseError *error,
+        ReadConnection connection = WriterConnection)
+{
+    auto binder = [&bindValues](DatabaseQuery &query) { bindNamedValues(query, bindValues); };
+    return fetch<T>(d, queryString, binder, resultHandler, queryName, error, connection);
+}
+
+template<typename T, typename Binder, typename ResultHandler>
 void store(
         DatabasePrivate *d,
         const QString &queryString,
-        const QList<QPair<QString, QVariant> > &bindValues,
-        std::function<void()> storeResultHandler,
+        const Binder &binder,
+        const ResultHandler &storeResultHandler,
         const QString &queryName,
         DatabaseError *error)
 {
@@ -263,15 +503,14 @@ void store(
         return;
     }
 
-    for (const QPair<QString, QVariant> &bindValue : bindValues) {
-        storeQuery.bindValue(bindValue.first, bindValue.second);
-    }
+    binder(storeQuery);
 
     const bool wasInTransaction = d->m_parent->inTransaction();
     if (!wasInTransaction && !d->m_parent->beginTransaction(error)) {
         return;
     }
 
+    QueryTimer timer(d, queryName, storeQuery);
     if (!storeQuery.exec()) {
         Database::setDatabaseError(error, DatabaseError::QueryError,
                                    QStringLiteral("Failed to execute store %1 query: %2\n%3")
@@ -283,6 +522,8 @@ void store(
             d->m_parent->rollbackTransaction(&rollbackError);
         }
     } else {
+        timer.addRows(1);
+        timer.finish();
         storeResultHandler();
         if (!wasInTransaction && !d->m_parent->commitTransaction(error)) {
             DatabaseError rollbackError;
@@ -293,13 +534,92 @@ void store(
     return;
 }
 
-template<typename T>
+template<typename T, typename ResultHandler>
+void store(
+        DatabasePrivate *d,
+        const QString &queryString,
+        const NamedBindValues &bindValues,
+        const ResultHandler &storeResultHandler,
+        const QString &queryName,
+        DatabaseError *error)
+{
+    auto binder = [&bindValues](DatabaseQuery &query) { bindNamedValues(query, bindValues); };
+    store<T>(d, queryString, binder, storeResultHandler, queryName, error);
+}
+
+template<typename T, typename Binder, typename ResultHandler>
+void storeMultiple(
+        DatabasePrivate *d,
+        const QString &queryString,
+        const QVector<T> &values,
+        const Binder &binder,
+        const ResultHandler &storeResultHandler,
+        const QString &queryName,
+        DatabaseError *error)
+{
+    if (!d->m_database.isOpen()) {
+        Database::setDatabaseError(error, DatabaseError::NotOpenError,
+                                   QStringLiteral("Database is not open, cannot store %1")
+                                             .arg(queryName));
+        return;
+    }
+
+    if (values.isEmpty()) {
+        return;
+    }
+
+    DatabaseQuery storeQuery(d->prepare(queryString));
+    if (storeQuery.lastError().isValid()) {
+        Database::setDatabaseError(error, DatabaseError::PrepareQueryError,
+                                   QStringLiteral("Failed to prepare store %1 query: %2\n%3")
+                                             .arg(queryName)
+                                             .arg(storeQuery.lastError().text())
+                                             .arg(queryString));
+        return;
+    }
+
+    const bool wasInTransaction = d->m_parent->inTransaction();
+    if (!wasInTransaction && !d->m_parent->beginTransaction(error)) {
+        return;
+    }
+
+    // The same prepared statement is re-bound and re-executed for every value,
+    // all within a single transaction.
+    QueryTimer timer(d, queryName, storeQuery);
+    for (const T &value : values) {
+        binder(storeQuery, value);
+
+        if (!storeQuery.exec()) {
+            Database::setDatabaseError(error, DatabaseError::QueryError,
+                                       QStringLiteral("Failed to execute store %1 query: %2\n%3")
+                                                 .arg(queryName)
+                                                 .arg(storeQuery.lastError().text())
+                                                 .arg(storeQuery.executedQuery()));
+            if (!wasInTransaction) {
+                DatabaseError rollbackError;
+                d->m_parent->rollbackTransaction(&rollbackError);
+            }
+            return;
+        }
+
+        timer.addRows(1);
+        storeResultHandler(value);
+    }
+    timer.finish();
+
+    if (!wasInTransaction && !d->m_parent->commitTransaction(error)) {
+        DatabaseError rollbackError;
+        d->m_parent->rollbackTransaction(&rollbackError);
+    }
+}
+
+template<typename T, typename DeleteRelated, typename Binder, typename ResultHandler>
 void deleteValue(
         DatabasePrivate *d,
-        std::function<void(DatabaseError*)> deleteRelatedValues,
+        const DeleteRelated &deleteRelatedValues,
         const QString &queryString,
-        const QList<QPair<QString, QVariant> > &bindValues,
-        std::function<void()> deleteResultHandler,
+        const Binder &binder,
+        const ResultHandler &deleteResultHandler,
         const QString &queryName,
         DatabaseError *error)
 {
@@ -338,10 +658,9 @@ void deleteValue(
         return;
     }
 
-    for (const QPair<QString, QVariant> &bindValue : bindValues) {
-        deleteQuery.bindValue(bindValue.first, bindValue.second);
-    }
+    binder(deleteQuery);
 
+    QueryTimer timer(d, queryName, deleteQuery);
     if (!deleteQuery.exec()) {
         Database::setDatabaseError(error, DatabaseError::QueryError,
                                    QStringLiteral("Failed to execute delete %1 query: %2\n%3")
@@ -353,6 +672,8 @@ void deleteValue(
             d->m_parent->rollbackTransaction(&rollbackError);
         }
     } else {
+        timer.addRows(deleteQuery.numRowsAffected());
+        timer.finish();
         deleteResultHandler();
         if (!wasInTransaction && !d->m_parent->commitTransaction(error)) {
             DatabaseError rollbackError;
@@ -361,6 +682,20 @@ void deleteValue(
     }
 }
 
+template<typename T, typename DeleteRelated, typename ResultHandler>
+void deleteValue(
+        DatabasePrivate *d,
+        const DeleteRelated &deleteRelatedValues,
+        const QString &queryString,
+        const NamedBindValues &bindValues,
+        const ResultHandler &deleteResultHandler,
+        const QString &queryName,
+        DatabaseError *error)
+{
+    auto binder = [&bindValues](DatabaseQuery &query) { bindNamedValues(query, bindValues); };
+    deleteValue<T>(d, deleteRelatedValues, queryString, binder, deleteResultHandler, queryName, error);
+}
+
 } // namespace DatabaseImpl
 
 } // namespace SyncCache
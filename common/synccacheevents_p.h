@@ -119,6 +119,7 @@ public:
     int currentSchemaVersion() const override;
     QVector<const char *> createStatements() const override;
     QVector<UpgradeOperation> upgradeVersions() const override;
+    DatabaseOptions defaultOptions() const override;
 
     bool preTransactionCommit() override;
     void transactionCommittedPreUnlock() override;
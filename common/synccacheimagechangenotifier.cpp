@@ -47,6 +47,9 @@
 
 #include <QDebug>
 
+// Commits made during a sync are far more frequent than gallery models can usefully reload.
+static const int DefaultChangeNotificationInterval = 1000;
+
 #define NOTIFIER_PATH "/org/sailfishos/nextcloud/gallery"
 #define NOTIFIER_INTERFACE "org.sailfishos.nextcloud.gallery"
 
@@ -69,18 +72,113 @@ QDBusMessage createSignal(const char *name)
 
 } // namespace
 
+SyncCache::ChangeThrottle::ChangeThrottle(const Receiver &receiver)
+    : m_receiver(receiver)
+    , m_interval(DefaultChangeNotificationInterval)
+{
+    m_timer.setSingleShot(true);
+    QObject::connect(&m_timer, &QTimer::timeout, [this] { flush(); });
+}
+
+void SyncCache::ChangeThrottle::setInterval(int milliseconds)
+{
+    m_interval = milliseconds;
+}
+
+void SyncCache::ChangeThrottle::add(qint64 sequence, const QList<quint64> &scopes)
+{
+    if (m_pending) {
+        ++m_merged;
+    }
+    m_pending = true;
+    m_pendingSequence = qMax(m_pendingSequence, sequence);
+    for (quint64 scope : scopes) {
+        if (!m_pendingScopes.contains(scope)) {
+            m_pendingScopes.append(scope);
+        }
+    }
+
+    if (m_timer.isActive()) {
+        return;
+    }
+    const qint64 sinceLastPassed = m_lastPassed.isValid() ? m_lastPassed.elapsed() : m_interval;
+    if (sinceLastPassed >= m_interval) {
+        flush();
+    } else {
+        m_timer.start(static_cast<int>(m_interval - sinceLastPassed));
+    }
+}
+
+void SyncCache::ChangeThrottle::flush()
+{
+    m_timer.stop();
+    if (!m_pending) {
+        return;
+    }
+
+    const qint64 sequence = m_pendingSequence;
+    const QList<quint64> scopes = m_pendingScopes;
+    m_pending = false;
+    m_pendingSequence = 0;
+    m_pendingScopes.clear();
+    m_lastPassed.start();
+    ++m_passed;
+    m_receiver(sequence, scopes);
+}
+
 SyncCache::ImageChangeNotifier::ImageChangeNotifier(ImageDatabase *db)
     : QObject(nullptr)
+    , m_sendThrottle([this](qint64 sequence, const QList<quint64> &scopes) { send(sequence, scopes); })
+    , m_receiveThrottle([this](qint64 sequence, const QList<quint64> &scopes) {
+        if (m_db) {
+            m_db->dataChanged();
+            m_db->dataChangedInScopes(sequence, scopes);
+        }
+    })
 {
+    qDBusRegisterMetaType<QList<qulonglong> >();
+
+    // Both signals are sent for every change, so only the one with the payload
+    // is received.  The bare signal remains for older listeners.
     QTimer::singleShot(1, Qt::CoarseTimer, this, [this, db] {
         m_db = db;
-        this->connectNotification("dataChanged", "", this, SLOT(_q_dataChanged()));
+        this->connectNotification("dataChangedInScopes", "xat", this, SLOT(_q_dataChangedInScopes(qlonglong,QList<qulonglong>)));
     });
 }
 
-void SyncCache::ImageChangeNotifier::dataChanged()
+SyncCache::ImageChangeNotifier::~ImageChangeNotifier()
+{
+    // Do not lose the last changes of a sync.
+    m_sendThrottle.flush();
+}
+
+void SyncCache::ImageChangeNotifier::dataChanged(qint64 sequence, const QList<quint64> &scopes)
+{
+    m_sendThrottle.add(sequence, scopes);
+}
+
+void SyncCache::ImageChangeNotifier::setInterval(int milliseconds)
 {
-    QDBusMessage message = createSignal("dataChanged");
+    m_sendThrottle.setInterval(milliseconds);
+    m_receiveThrottle.setInterval(milliseconds);
+}
+
+SyncCache::ChangeNotificationStatistics SyncCache::ImageChangeNotifier::statistics() const
+{
+    ChangeNotificationStatistics statistics;
+    statistics.sent = m_sendThrottle.passed();
+    statistics.sendsMerged = m_sendThrottle.merged();
+    statistics.delivered = m_receiveThrottle.passed();
+    statistics.receiptsMerged = m_receiveThrottle.merged();
+    return statistics;
+}
+
+void SyncCache::ImageChangeNotifier::send(qint64 sequence, const QList<quint64> &scopes)
+{
+    QDBusConnection::sessionBus().send(createSignal("dataChanged"));
+
+    QDBusMessage message = createSignal("dataChangedInScopes");
+    message << static_cast<qlonglong>(sequence) << QVariant::fromValue(scopes);
     QDBusConnection::sessionBus().send(message);
 }
 
@@ -107,9 +205,7 @@ bool SyncCache::ImageChangeNotifier::connectNotification(const char *name, const
     return true;
 }
 
-void SyncCache::ImageChangeNotifier::_q_dataChanged()
+void SyncCache::ImageChangeNotifier::_q_dataChangedInScopes(qlonglong sequence, const QList<qulonglong> &scopes)
 {
-    if (m_db) {
-        m_db->dataChanged();
-    }
+    m_receiveThrottle.add(sequence, scopes);
 }
@@ -39,18 +39,51 @@
 
 #include <QtCore/QObject>
 #include <QtCore/QPointer>
+#include <QtCore/QList>
+#include <QtCore/QTimer>
+#include <QtCore/QElapsedTimer>
+
+#include <functional>
 
 // This class exists to allow cross-process signalling of database changes.
 // It will not be needed once we migrate to service (daemon-based) APIs.
 
 namespace SyncCache {
 
+// Passes on the first change immediately, and merges any further changes within
+// the interval into a single change passed on when it has elapsed.
+class ChangeThrottle
+{
+public:
+    typedef std::function<void(qint64, const QList<quint64> &)> Receiver;
+    explicit ChangeThrottle(const Receiver &receiver);
+
+    void setInterval(int milliseconds);
+    void add(qint64 sequence, const QList<quint64> &scopes);
+    void flush();
+
+    int passed() const { return m_passed; }
+    int merged() const { return m_merged; }
+
+private:
+    Receiver m_receiver;
+    QTimer m_timer;
+    QElapsedTimer m_lastPassed;
+    int m_interval;
+    bool m_pending = false;
+    qint64 m_pendingSequence = 0;
+    QList<quint64> m_pendingScopes;
+    int m_passed = 0;
+    int m_merged = 0;
+};
+
 class ImageChangeNotifier : public QObject
 {
     Q_OBJECT
 
 public:
     ImageChangeNotifier(ImageDatabase *db);
+    ~ImageChangeNotifier();
 
     bool connectNotification(const char *name, const char *signature, QObject *receiver, const char *slot);
 
@@ -58,14 +91,24 @@ public:
     // e.g. usersDeleted()/usersStored()
     //      albumsDeleted()/albumsStored()
     //      photosDeleted()/photosStored()
-    // so instead, provide an opaque dataChanged() signal.
-    void dataChanged();
+    // so instead, provide an opaque dataChanged() signal.  It is followed by
+    // dataChangedInScopes(), which carries the change sequence number and the
+    // affected scopes as opaque digests, see ImageDatabase::changeScope().
+    void dataChanged(qint64 sequence, const QList<quint64> &scopes);
+
+    // Coalesces sent and received notifications, see ChangeThrottle.
+    void setInterval(int milliseconds);
+    SyncCache::ChangeNotificationStatistics statistics() const;
 
 public Q_SLOTS:
-    void _q_dataChanged();
+    void _q_dataChangedInScopes(qlonglong sequence, const QList<qulonglong> &scopes);
 
 private:
+    void send(qint64 sequence, const QList<quint64> &scopes);
+
     QPointer<ImageDatabase> m_db;
+    ChangeThrottle m_sendThrottle;
+    ChangeThrottle m_receiveThrottle;
 };
 
 } // namespace SyncCache
@@ -40,14 +40,60 @@
 #include "synccacheimagedownloads_p.h"
 
 #include <QtCore/QThread>
+#include <QtCore/QHash>
 #include <QtCore/QFile>
 #include <QtCore/QDir>
 #include <QtCore/QStandardPaths>
+#include <QtCore/QUrlQuery>
 #include <QtCore/QDebug>
 #include <QtGui/QImage>
 
 using namespace SyncCache;
 
+namespace {
+
+const int ReaderThreadCount = 2;
+
+// Returns the smallest thumbnail tier which covers the requested size.
+int thumbnailTier(int thumbnailSize)
+{
+    if (thumbnailSize <= ImageCache::SmallThumbnail) {
+        return ImageCache::SmallThumbnail;
+    } else if (thumbnailSize <= ImageCache::MediumThumbnail) {
+        return ImageCache::MediumThumbnail;
+    }
+    return ImageCache::LargeThumbnail;
+}
+
+QString thumbnailFileName(const Photo &photo, int tier)
+{
+    return QStringLiteral("%1px_%2").arg(tier).arg(photo.fileName);
+}
+
+// Builds the server-side preview url from the WebDAV url of the photo, e.g.
+// https://host/nextcloud/remote.php/dav/files/... => https://host/nextcloud/index.php/core/preview
+QUrl previewUrl(const Photo &photo, int tier)
+{
+    const QString imageUrlPath = photo.imageUrl.path();
+    const int davIndex = imageUrlPath.indexOf(QStringLiteral("/remote.php/"));
+    if (davIndex < 0) {
+        return QUrl();
+    }
+
+    QUrlQuery query;
+    query.addQueryItem(QStringLiteral("fileId"), photo.photoId);
+    query.addQueryItem(QStringLiteral("x"), QString::number(tier));
+    query.addQueryItem(QStringLiteral("y"), QString::number(tier));
+    query.addQueryItem(QStringLiteral("a"), QStringLiteral("1")); // keep the aspect ratio
+
+    QUrl url(photo.imageUrl);
+    url.setPath(imageUrlPath.left(davIndex) + QStringLiteral("/index.php/core/preview"));
+    url.setQuery(query);
+    return url;
+}
+
+}
+
 User& User::operator=(const User &other)
 {
     if (this == &other) {
@@ -114,9 +160,9 @@ Photo& Photo::operator=(const Photo &other)
 
 //-----------------------------------------------------------------------------
 
-ImageCacheThreadWorker::ImageCacheThreadWorker(QObject *parent)
+ImageCacheThreadWorker::ImageCacheThreadWorker(ImageDatabase::Access access, QObject *parent)
     : QObject(parent)
-    , m_db(nullptr, false) // don't emit changes to other processes
+    , m_db(nullptr, false, access) // don't emit changes to other processes
     , m_downloader(nullptr)
 {
 }
@@ -148,12 +194,17 @@ void ImageCacheThreadWorker::openDatabase(const QString &accountType)
                 this, &ImageCacheThreadWorker::photosDeleted);
         connect(&m_db, &ImageDatabase::dataChanged,
                 this, &ImageCacheThreadWorker::dataChanged);
+        connect(&m_db, &ImageDatabase::dataChangedInScopes,
+                this, &ImageCacheThreadWorker::dataChangedInScopes);
         emit openDatabaseFinished();
     }
 }
 
 void ImageCacheThreadWorker::requestUsers()
 {
+    // Read through a snapshot, so that the query does not wait behind a sync write.
+    DatabaseError snapshotError;
+    ReadSnapshot snapshot(&m_db, &snapshotError);
     DatabaseError error;
     QVector<SyncCache::User> users = m_db.users(&error);
     if (error.errorCode != DatabaseError::NoError) {
@@ -165,6 +216,8 @@ void ImageCacheThreadWorker::requestUsers()
 
 void ImageCacheThreadWorker::requestUser(int accountId, const QString &userId)
 {
+    DatabaseError snapshotError;
+    ReadSnapshot snapshot(&m_db, &snapshotError);
     DatabaseError error;
     SyncCache::User user = m_db.user(accountId, &error);
     if (error.errorCode != DatabaseError::NoError) {
@@ -176,6 +229,8 @@ void ImageCacheThreadWorker::requestUser(int accountId, const QString &userId)
 
 void ImageCacheThreadWorker::requestAlbums(int accountId, const QString &userId)
 {
+    DatabaseError snapshotError;
+    ReadSnapshot snapshot(&m_db, &snapshotError);
     DatabaseError error;
     QVector<SyncCache::Album> albums = m_db.albums(accountId, userId, &error);
     if (error.errorCode != DatabaseError::NoError) {
@@ -187,6 +242,8 @@ void ImageCacheThreadWorker::requestAlbums(int accountId, const QString &userId)
 
 void ImageCacheThreadWorker::requestPhotos(int accountId, const QString &userId, const QString &albumId)
 {
+    DatabaseError snapshotError;
+    ReadSnapshot snapshot(&m_db, &snapshotError);
     DatabaseError error;
     QVector<SyncCache::Photo> photos = m_db.photos(accountId, userId, albumId, &error);
     if (error.errorCode != DatabaseError::NoError) {
@@ -198,6 +255,8 @@ void ImageCacheThreadWorker::requestPhotos(int accountId, const QString &userId,
 
 void ImageCacheThreadWorker::requestPhotoCount(int accountId, const QString &userId)
 {
+    DatabaseError snapshotError;
+    ReadSnapshot snapshot(&m_db, &snapshotError);
     DatabaseError error;
     SyncCache::PhotoCounter photoCounter = m_db.photoCount(accountId, userId, &error);
     if (error.errorCode != DatabaseError::NoError) {
@@ -276,10 +335,8 @@ void ImageCacheThreadWorker::populateAlbumThumbnail(int idempToken, int accountI
     emit populateAlbumThumbnailFinished(idempToken, QString());
 }
 
-void ImageCacheThreadWorker::populatePhotoThumbnail(int idempToken, int accountId, const QString &userId, const QString &albumId, const QString &photoId, const QNetworkRequest &requestTemplate)
+void ImageCacheThreadWorker::populatePhotoThumbnail(int idempToken, int accountId, const QString &userId, const QString &albumId, const QString &photoId, const QNetworkRequest &requestTemplate, int thumbnailSize)
 {
-    Q_UNUSED(requestTemplate)
-
     DatabaseError error;
     Photo photo = m_db.photo(accountId, userId, albumId, photoId, &error);
     if (error.errorCode != DatabaseError::NoError) {
@@ -289,11 +346,17 @@ void ImageCacheThreadWorker::populatePhotoThumbnail(int idempToken, int accountI
         return;
     }
 
-    // the thumbnail already exists.
-    QString thumbnailPath = photo.thumbnailPath.toString();
+    // the thumbnail already exists in the requested or a larger size.
+    const int tier = thumbnailTier(thumbnailSize);
+    const QString thumbnailDirPath = SyncCache::albumImageDownloadDir(accountId, photo.albumPath, true);
+    const QString thumbnailPath = photo.thumbnailPath.toString();
     if (!thumbnailPath.isEmpty() && QFile::exists(thumbnailPath)) {
-        emit populatePhotoThumbnailFinished(idempToken, thumbnailPath);
-        return;
+        for (int t = tier; t <= ImageCache::LargeThumbnail; t *= 2) {
+            if (thumbnailPath == thumbnailDirPath + '/' + thumbnailFileName(photo, t)) {
+                emit populatePhotoThumbnailFinished(idempToken, thumbnailPath);
+                return;
+            }
+        }
     }
 
     // the full-size photo exists, so use that.
@@ -302,9 +365,37 @@ void ImageCacheThreadWorker::populatePhotoThumbnail(int idempToken, int accountI
         return;
     }
 
-    // Thumbnail downloading is not supported at the moment. This is not an error,
-    // so just return an empty string.
-    emit populatePhotoThumbnailFinished(idempToken, QString());
+    // download a preview of the photo in the requested size.
+    const QUrl thumbnailUrl = previewUrl(photo, tier);
+    if (thumbnailUrl.isEmpty()) {
+        // No preview is available for this photo. This is not an error,
+        // so just return an empty string.
+        emit populatePhotoThumbnailFinished(idempToken, QString());
+        return;
+    }
+
+    if (!m_downloader) {
+        m_downloader = new ImageDownloader(this);
+    }
+
+    ImageDownloadWatcher *watcher = m_downloader->downloadImage(
+                idempToken,
+                thumbnailUrl,
+                thumbnailFileName(photo, tier),
+                thumbnailDirPath,
+                requestTemplate);
+
+    connect(watcher, &ImageDownloadWatcher::downloadFailed, this, [this, watcher, idempToken] (const QString &errorMessage) {
+        emit populatePhotoThumbnailFailed(idempToken, errorMessage);
+        watcher->deleteLater();
+    });
+
+    connect(watcher, &ImageDownloadWatcher::downloadFinished, this, [this, watcher, photo, thumbnailUrl, idempToken] (const QUrl &filePath) {
+        Photo photoToStore = photo;
+        photoToStore.thumbnailUrl = thumbnailUrl;
+        photoThumbnailDownloadFinished(idempToken, photoToStore, filePath);
+        watcher->deleteLater();
+    });
 }
 
 void ImageCacheThreadWorker::photoThumbnailDownloadFinished(int idempToken, const SyncCache::Photo &photo, const QUrl &filePath)
@@ -413,34 +504,67 @@ ImageCachePrivate::ImageCachePrivate(ImageCache *parent)
     qRegisterMetaType<QVector<SyncCache::User> >();
     qRegisterMetaType<QVector<SyncCache::User> >();
     qRegisterMetaType<QVector<SyncCache::User> >();
+    qRegisterMetaType<QList<quint64> >();
 
     m_worker->moveToThread(&m_dbThread);
     connect(&m_dbThread, &QThread::finished, m_worker, &QObject::deleteLater);
 
+    connect(this, &ImageCachePrivate::openDatabase, this, [this](const QString &accountType) {
+        m_accountType = accountType;
+    });
     connect(this, &ImageCachePrivate::openDatabase, m_worker, &ImageCacheThreadWorker::openDatabase);
-    connect(this, &ImageCachePrivate::requestUser, m_worker, &ImageCacheThreadWorker::requestUser);
-    connect(this, &ImageCachePrivate::requestUsers, m_worker, &ImageCacheThreadWorker::requestUsers);
-    connect(this, &ImageCachePrivate::requestAlbums, m_worker, &ImageCacheThreadWorker::requestAlbums);
-    connect(this, &ImageCachePrivate::requestPhotos, m_worker, &ImageCacheThreadWorker::requestPhotos);
-    connect(this, &ImageCachePrivate::requestPhotoCount, m_worker, &ImageCacheThreadWorker::requestPhotoCount);
 
     connect(this, &ImageCachePrivate::populateUserThumbnail, m_worker, &ImageCacheThreadWorker::populateUserThumbnail);
     connect(this, &ImageCachePrivate::populateAlbumThumbnail, m_worker, &ImageCacheThreadWorker::populateAlbumThumbnail);
     connect(this, &ImageCachePrivate::populatePhotoThumbnail, m_worker, &ImageCacheThreadWorker::populatePhotoThumbnail);
     connect(this, &ImageCachePrivate::populatePhotoImage, m_worker, &ImageCacheThreadWorker::populatePhotoImage);
 
+    // The readers are opened once the writer has opened, and possibly upgraded,
+    // the database.  Requests made before then are held by read() until their
+    // reader has opened; if the writer fails, they are passed on to fail.
+    connect(m_worker, &ImageCacheThreadWorker::openDatabaseFinished, this, [this] {
+        emit openReaderDatabases(m_accountType);
+    });
+    connect(m_worker, &ImageCacheThreadWorker::openDatabaseFailed, this, [this] {
+        for (int i = 0; i < m_readers.size(); ++i) {
+            readerOpened(i);
+        }
+    });
     connect(m_worker, &ImageCacheThreadWorker::openDatabaseFailed, parent, &ImageCache::openDatabaseFailed);
     connect(m_worker, &ImageCacheThreadWorker::openDatabaseFinished, parent, &ImageCache::openDatabaseFinished);
-    connect(m_worker, &ImageCacheThreadWorker::requestUserFailed, parent, &ImageCache::requestUserFailed);
-    connect(m_worker, &ImageCacheThreadWorker::requestUserFinished, parent, &ImageCache::requestUserFinished);
-    connect(m_worker, &ImageCacheThreadWorker::requestUsersFailed, parent, &ImageCache::requestUsersFailed);
-    connect(m_worker, &ImageCacheThreadWorker::requestUsersFinished, parent, &ImageCache::requestUsersFinished);
-    connect(m_worker, &ImageCacheThreadWorker::requestAlbumsFailed, parent, &ImageCache::requestAlbumsFailed);
-    connect(m_worker, &ImageCacheThreadWorker::requestAlbumsFinished, parent, &ImageCache::requestAlbumsFinished);
-    connect(m_worker, &ImageCacheThreadWorker::requestPhotosFailed, parent, &ImageCache::requestPhotosFailed);
-    connect(m_worker, &ImageCacheThreadWorker::requestPhotosFinished, parent, &ImageCache::requestPhotosFinished);
-    connect(m_worker, &ImageCacheThreadWorker::requestPhotoCountFailed, parent, &ImageCache::requestPhotoCountFailed);
-    connect(m_worker, &ImageCacheThreadWorker::requestPhotoCountFinished, parent, &ImageCache::requestPhotoCountFinished);
+
+    for (int i = 0; i < ReaderThreadCount; ++i) {
+        QThread *readerThread = new QThread(this);
+        ImageCacheThreadWorker *reader = new ImageCacheThreadWorker(ImageDatabase::ReadOnly);
+        reader->moveToThread(readerThread);
+        connect(readerThread, &QThread::finished, reader, &QObject::deleteLater);
+
+        connect(this, &ImageCachePrivate::openReaderDatabases, reader, &ImageCacheThreadWorker::openDatabase);
+        connect(reader, &ImageCacheThreadWorker::openDatabaseFinished, this, [this, i] {
+            readerOpened(i);
+        });
+        connect(reader, &ImageCacheThreadWorker::openDatabaseFailed, this, [this, i](const QString &errorMessage) {
+            // The held requests fail, rather than waiting forever.
+            qWarning() << "Unable to open image cache reader database:" << errorMessage;
+            readerOpened(i);
+        });
+
+        connect(reader, &ImageCacheThreadWorker::requestUserFailed, parent, &ImageCache::requestUserFailed);
+        connect(reader, &ImageCacheThreadWorker::requestUserFinished, parent, &ImageCache::requestUserFinished);
+        connect(reader, &ImageCacheThreadWorker::requestUsersFailed, parent, &ImageCache::requestUsersFailed);
+        connect(reader, &ImageCacheThreadWorker::requestUsersFinished, parent, &ImageCache::requestUsersFinished);
+        connect(reader, &ImageCacheThreadWorker::requestAlbumsFailed, parent, &ImageCache::requestAlbumsFailed);
+        connect(reader, &ImageCacheThreadWorker::requestAlbumsFinished, parent, &ImageCache::requestAlbumsFinished);
+        connect(reader, &ImageCacheThreadWorker::requestPhotosFailed, parent, &ImageCache::requestPhotosFailed);
+        connect(reader, &ImageCacheThreadWorker::requestPhotosFinished, parent, &ImageCache::requestPhotosFinished);
+        connect(reader, &ImageCacheThreadWorker::requestPhotoCountFailed, parent, &ImageCache::requestPhotoCountFailed);
+        connect(reader, &ImageCacheThreadWorker::requestPhotoCountFinished, parent, &ImageCache::requestPhotoCountFinished);
+
+        m_readerThreads.append(readerThread);
+        m_readers.append(reader);
+        m_readerOpened.append(false);
+        m_pendingReads.append(QVector<std::function<void(ImageCacheThreadWorker *)> >());
+    }
 
     connect(m_worker, &ImageCacheThreadWorker::populateUserThumbnailFailed, parent, &ImageCache::populateUserThumbnailFailed);
     connect(m_worker, &ImageCacheThreadWorker::populateUserThumbnailFinished, parent, &ImageCache::populateUserThumbnailFinished);
@@ -458,17 +582,48 @@ ImageCachePrivate::ImageCachePrivate(ImageCache *parent)
     connect(m_worker, &ImageCacheThreadWorker::albumsDeleted, parent, &ImageCache::albumsDeleted);
     connect(m_worker, &ImageCacheThreadWorker::photosDeleted, parent, &ImageCache::photosDeleted);
     connect(m_worker, &ImageCacheThreadWorker::dataChanged, parent, &ImageCache::dataChanged);
+    connect(m_worker, &ImageCacheThreadWorker::dataChangedInScopes, parent, &ImageCache::dataChangedInScopes);
 
     m_dbThread.start();
     m_dbThread.setPriority(QThread::IdlePriority);
+    for (QThread *readerThread : m_readerThreads) {
+        readerThread->start();
+        readerThread->setPriority(QThread::IdlePriority);
+    }
 }
 
 ImageCachePrivate::~ImageCachePrivate()
 {
+    for (QThread *readerThread : m_readerThreads) {
+        readerThread->quit();
+    }
     m_dbThread.quit();
+    for (QThread *readerThread : m_readerThreads) {
+        readerThread->wait();
+    }
     m_dbThread.wait();
 }
 
+void ImageCachePrivate::read(uint key, const std::function<void(ImageCacheThreadWorker *)> &request)
+{
+    const int index = key % m_readers.size();
+    if (m_readerOpened.at(index)) {
+        request(m_readers.at(index));
+    } else {
+        m_pendingReads[index].append(request);
+    }
+}
+
+void ImageCachePrivate::readerOpened(int index)
+{
+    m_readerOpened[index] = true;
+    const QVector<std::function<void(ImageCacheThreadWorker *)> > pendingReads = m_pendingReads.at(index);
+    m_pendingReads[index].clear();
+    for (const std::function<void(ImageCacheThreadWorker *)> &request : pendingReads) {
+        request(m_readers.at(index));
+    }
+}
+
 //-----------------------------------------------------------------------------
 
 ImageCache::ImageCache(QObject *parent)
@@ -499,31 +654,45 @@ void ImageCache::openDatabase(const QString &databaseFile)
 void ImageCache::requestUser(int accountId, const QString &userId)
 {
     Q_D(ImageCache);
-    emit d->requestUser(accountId, userId);
+    d->read(qHash(accountId) ^ qHash(userId), [accountId, userId](ImageCacheThreadWorker *reader) {
+        QMetaObject::invokeMethod(reader, "requestUser", Qt::QueuedConnection,
+                                  Q_ARG(int, accountId), Q_ARG(QString, userId));
+    });
 }
 
 void ImageCache::requestUsers()
 {
     Q_D(ImageCache);
-    emit d->requestUsers();
+    d->read(0, [](ImageCacheThreadWorker *reader) {
+        QMetaObject::invokeMethod(reader, "requestUsers", Qt::QueuedConnection);
+    });
 }
 
 void ImageCache::requestAlbums(int accountId, const QString &userId)
 {
     Q_D(ImageCache);
-    emit d->requestAlbums(accountId, userId);
+    d->read(qHash(accountId) ^ qHash(userId), [accountId, userId](ImageCacheThreadWorker *reader) {
+        QMetaObject::invokeMethod(reader, "requestAlbums", Qt::QueuedConnection,
+                                  Q_ARG(int, accountId), Q_ARG(QString, userId));
+    });
 }
 
 void ImageCache::requestPhotos(int accountId, const QString &userId, const QString &albumId)
 {
     Q_D(ImageCache);
-    emit d->requestPhotos(accountId, userId, albumId);
+    d->read(qHash(accountId) ^ qHash(userId) ^ qHash(albumId), [accountId, userId, albumId](ImageCacheThreadWorker *reader) {
+        QMetaObject::invokeMethod(reader, "requestPhotos", Qt::QueuedConnection,
+                                  Q_ARG(int, accountId), Q_ARG(QString, userId), Q_ARG(QString, albumId));
+    });
 }
 
 void ImageCache::requestPhotoCount(int accountId, const QString &userId)
 {
     Q_D(ImageCache);
-    emit d->requestPhotoCount(accountId, userId);
+    d->read(qHash(accountId) ^ qHash(userId), [accountId, userId](ImageCacheThreadWorker *reader) {
+        QMetaObject::invokeMethod(reader, "requestPhotoCount", Qt::QueuedConnection,
+                                  Q_ARG(int, accountId), Q_ARG(QString, userId));
+    });
 }
 
 void ImageCache::populateUserThumbnail(int idempToken, int accountId, const QString &userId, const QNetworkRequest &requestTemplate)
@@ -538,10 +707,10 @@ void ImageCache::populateAlbumThumbnail(int idempToken, int accountId, const QSt
     emit d->populateAlbumThumbnail(idempToken, accountId, userId, albumId, requestTemplate);
 }
 
-void ImageCache::populatePhotoThumbnail(int idempToken, int accountId, const QString &userId, const QString &albumId, const QString &photoId, const QNetworkRequest &requestTemplate)
+void ImageCache::populatePhotoThumbnail(int idempToken, int accountId, const QString &userId, const QString &albumId, const QString &photoId, const QNetworkRequest &requestTemplate, int thumbnailSize)
 {
     Q_D(ImageCache);
-    emit d->populatePhotoThumbnail(idempToken, accountId, userId, albumId, photoId, requestTemplate);
+    emit d->populatePhotoThumbnail(idempToken, accountId, userId, albumId, photoId, requestTemplate, thumbnailSize);
 }
 
 void ImageCache::populatePhotoImage(int idempToken, int accountId, const QString &userId, const QString &albumId, const QString &photoId, const QNetworkRequest &requestTemplate)
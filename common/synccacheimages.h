@@ -106,12 +106,42 @@ struct PhotoCounter {
     int count = 0;
 };
 
+// The items stored or deleted after a change sequence number, in which only
+// the key members (accountId, userId, albumId and photoId) are set.
+struct ImageChanges {
+    qint64 sequence = 0;            // the latest change, to pass to the next changesSince()
+    bool reloadRequired = false;    // deletions since the given sequence were pruned from the journal
+    QVector<SyncCache::User> storedUsers;
+    QVector<SyncCache::User> deletedUsers;
+    QVector<SyncCache::Album> storedAlbums;
+    QVector<SyncCache::Album> deletedAlbums;
+    QVector<SyncCache::Photo> storedPhotos;
+    QVector<SyncCache::Photo> deletedPhotos;
+};
+
+// Counts of cross-process change notifications, where merged notifications were
+// folded into a later one by the coalescing interval.
+struct ChangeNotificationStatistics {
+    int sent = 0;
+    int sendsMerged = 0;
+    int delivered = 0;
+    int receiptsMerged = 0;
+};
+
 class ImageDatabase : public Database
 {
     Q_OBJECT
 
 public:
-    ImageDatabase(QObject *parent = nullptr, bool emitCrossProcessChangeNotifications = true);
+    // A read-only database serves queries alongside a read-write one in the same
+    // process: it neither receives nor sends change notifications, and leaves the
+    // files of deleted items to be removed by the writer.
+    enum Access {
+        ReadWrite,
+        ReadOnly
+    };
+
+    ImageDatabase(QObject *parent = nullptr, bool emitCrossProcessChangeNotifications = true, Access access = ReadWrite);
 
     QVector<SyncCache::User> users(SyncCache::DatabaseError *error) const;
     QVector<SyncCache::Album> albums(int accountId, const QString &userId, SyncCache::DatabaseError *error, const QString &parentAlbumId = QString()) const;
@@ -124,10 +154,24 @@ public:
     SyncCache::PhotoCounter photoCount(int accountId, const QString &userId, SyncCache::DatabaseError *error) const;
     QString findThumbnailForAlbum(int accountId, const QString &userId, const QString &albumId, SyncCache::DatabaseError *error) const;
 
+    // Every stored or deleted item is given a new change sequence number; pass 0 for all changes.
+    SyncCache::ImageChanges changesSince(qint64 sequence, SyncCache::DatabaseError *error) const;
+
+    // An opaque digest identifying the changes to a user's data, or to one of their albums.
+    static quint64 changeScope(int accountId, const QString &userId, const QString &albumId = QString());
+
+    // Change notifications sent or received within this interval of the previous one
+    // are merged into one sent or delivered when it has elapsed.  0 disables merging.
+    void setChangeNotificationInterval(int milliseconds);
+    SyncCache::ChangeNotificationStatistics changeNotificationStatistics() const;
+
     void storeUser(const SyncCache::User &user, SyncCache::DatabaseError *error);
     void storeAlbum(const SyncCache::Album &album, SyncCache::DatabaseError *error);
     void storePhoto(const SyncCache::Photo &photo, SyncCache::DatabaseError *error);
 
+    void storeAlbums(const QVector<SyncCache::Album> &albums, SyncCache::DatabaseError *error);
+    void storePhotos(const QVector<SyncCache::Photo> &photos, SyncCache::DatabaseError *error);
+
     void deleteUser(const SyncCache::User &user, SyncCache::DatabaseError *error);
     void deleteAlbum(const SyncCache::Album &album, SyncCache::DatabaseError *error);
     void deletePhoto(const SyncCache::Photo &photo, SyncCache::DatabaseError *error);
@@ -142,6 +186,10 @@ Q_SIGNALS:
     void photosDeleted(const QVector<SyncCache::Photo> &photos);
 
     void dataChanged();
+    // Emitted with dataChanged() for changes made by any process.  The scopes
+    // include the user scope of every change, and the album scope of changes
+    // to albums and photos.
+    void dataChangedInScopes(qint64 sequence, const QList<quint64> &scopes);
 };
 
 class ImageCachePrivate;
@@ -153,6 +201,14 @@ public:
     ImageCache(QObject *parent = nullptr);
     ~ImageCache();
 
+    // Photo thumbnails are fetched from the server in one of these sizes (in pixels),
+    // whichever is the smallest that covers the size passed to populatePhotoThumbnail().
+    enum ThumbnailSize {
+        SmallThumbnail = 256,
+        MediumThumbnail = 512,
+        LargeThumbnail = 1024
+    };
+
     static QString imageCacheDir(int accountId);
     static QString imageCacheRootDir();
 
@@ -167,7 +223,7 @@ public Q_SLOTS:
 
     virtual void populateUserThumbnail(int idempToken, int accountId, const QString &userId, const QNetworkRequest &requestTemplate);
     virtual void populateAlbumThumbnail(int idempToken, int accountId, const QString &userId, const QString &albumId, const QNetworkRequest &requestTemplate);
-    virtual void populatePhotoThumbnail(int idempToken, int accountId, const QString &userId, const QString &albumId, const QString &photoId, const QNetworkRequest &requestTemplate);
+    virtual void populatePhotoThumbnail(int idempToken, int accountId, const QString &userId, const QString &albumId, const QString &photoId, const QNetworkRequest &requestTemplate, int thumbnailSize);
     virtual void populatePhotoImage(int idempToken, int accountId, const QString &userId, const QString &albumId, const QString &photoId, const QNetworkRequest &requestTemplate);
 
 Q_SIGNALS:
@@ -210,6 +266,7 @@ Q_SIGNALS:
     void photosDeleted(const QVector<SyncCache::Photo> &photos);
 
     void dataChanged();
+    void dataChangedInScopes(qint64 sequence, const QList<quint64> &scopes);
 
 private:
     Q_DECLARE_PRIVATE(ImageCache)
@@ -46,6 +46,8 @@
 #include <QtCore/QThread>
 #include <QtSql/QSqlDatabase>
 
+#include <functional>
+
 namespace SyncCache {
 
 class ImageChangeNotifier;
@@ -56,7 +58,7 @@ class ImageCacheThreadWorker : public QObject
     Q_OBJECT
 
 public:
-    ImageCacheThreadWorker(QObject *parent = nullptr);
+    ImageCacheThreadWorker(ImageDatabase::Access access = ImageDatabase::ReadWrite, QObject *parent = nullptr);
     ~ImageCacheThreadWorker();
 
 public Q_SLOTS:
@@ -70,7 +72,7 @@ public Q_SLOTS:
 
     void populateUserThumbnail(int idempToken, int accountId, const QString &userId, const QNetworkRequest &requestTemplate);
     void populateAlbumThumbnail(int idempToken, int accountId, const QString &userId, const QString &albumId, const QNetworkRequest &requestTemplate);
-    void populatePhotoThumbnail(int idempToken, int accountId, const QString &userId, const QString &albumId, const QString &photoId, const QNetworkRequest &requestTemplate);
+    void populatePhotoThumbnail(int idempToken, int accountId, const QString &userId, const QString &albumId, const QString &photoId, const QNetworkRequest &requestTemplate, int thumbnailSize);
     void populatePhotoImage(int idempToken, int accountId, const QString &userId, const QString &albumId, const QString &photoId, const QNetworkRequest &requestTemplate);
 
 Q_SIGNALS:
@@ -113,6 +115,7 @@ Q_SIGNALS:
     void photosDeleted(const QVector<SyncCache::Photo> &photos);
 
     void dataChanged();
+    void dataChangedInScopes(qint64 sequence, const QList<quint64> &scopes);
 
 private:
     void photoThumbnailDownloadFinished(int idempToken, const SyncCache::Photo &photo, const QUrl &filePath);
@@ -129,44 +132,66 @@ public:
     ImageCachePrivate(ImageCache *parent);
     ~ImageCachePrivate();
 
+    // Queues the request on the reader which serves queries with the given key, or
+    // holds it until that reader has opened the database.  Requests for the same
+    // data always go to the same reader, so that their results arrive in order.
+    void read(uint key, const std::function<void(ImageCacheThreadWorker *)> &request);
+
 Q_SIGNALS:
     void openDatabase(const QString &accountType);
-
-    void requestUser(int accountId, const QString &userId);
-    void requestUsers();
-    void requestAlbums(int accountId, const QString &userId);
-    void requestPhotos(int accountId, const QString &userId, const QString &albumId);
-    void requestPhotoCount(int accountId, const QString &userId);
+    void openReaderDatabases(const QString &accountType);
 
     bool populateUserThumbnail(int idempToken, int accountId, const QString &userId, const QNetworkRequest &requestTemplate);
     bool populateAlbumThumbnail(int idempToken, int accountId, const QString &userId, const QString &albumId, const QNetworkRequest &requestTemplate);
-    bool populatePhotoThumbnail(int idempToken, int accountId, const QString &userId, const QString &albumId, const QString &photoId, const QNetworkRequest &requestTemplate);
+    bool populatePhotoThumbnail(int idempToken, int accountId, const QString &userId, const QString &albumId, const QString &photoId, const QNetworkRequest &requestTemplate, int thumbnailSize);
     bool populatePhotoImage(int idempToken, int accountId, const QString &userId, const QString &albumId, const QString &photoId, const QNetworkRequest &requestTemplate);
 
 private:
+    // The worker owns the only connection used for writes, and serves the
+    // populate requests which write to the database.  Reads are spread over
+    // a pool of readers with their own connections and threads, so that a
+    // large query does not hold up thumbnails.
     QThread m_dbThread;
     ImageCacheThreadWorker *m_worker;
+    QVector<QThread *> m_readerThreads;
+    QVector<ImageCacheThreadWorker *> m_readers;
+    QVector<bool> m_readerOpened;
+    QVector<QVector<std::function<void(ImageCacheThreadWorker *)> > > m_pendingReads;
+    QString m_accountType;
+
+    void readerOpened(int index);
 };
 
 class ImageDatabasePrivate : public DatabasePrivate
 {
 public:
-    ImageDatabasePrivate(ImageDatabase *parent, bool emitCrossProcessChangeNotifications);
+    ImageDatabasePrivate(ImageDatabase *parent, bool emitCrossProcessChangeNotifications, ImageDatabase::Access access);
 
     int currentSchemaVersion() const override;
     QVector<const char *> createStatements() const override;
     QVector<UpgradeOperation> upgradeVersions() const override;
+    DatabaseOptions defaultOptions() const override;
 
     bool preTransactionCommit() override;
     void transactionCommittedPreUnlock() override;
     void transactionCommittedPostUnlock() override;
     void transactionRolledBackPreUnlocked() override;
 
+    // The single row lookups of user(), album() and photo(), on the given connection.
+    // Lookups made to decide how to write must see the latest state, so use the writer.
+    User fetchUser(int accountId, DatabaseError *error, DatabaseImpl::ReadConnection connection) const;
+    Album fetchAlbum(int accountId, const QString &userId, const QString &albumId, DatabaseError *error, DatabaseImpl::ReadConnection connection) const;
+    Photo fetchPhoto(int accountId, const QString &userId, const QString &albumId, const QString &photoId, DatabaseError *error, DatabaseImpl::ReadConnection connection) const;
+
 private:
+    QVector<Album> fixupAlbumThumbnails(const QVector<Album> &albums, DatabaseError *error);
+
     friend class SyncCache::ImageDatabase;
     ImageDatabase *m_imageDbParent;
     QScopedPointer<ImageChangeNotifier> m_changeNotifier;
     bool m_emitCrossProcessChangeNotifications = true;
+    qint64 m_commitSequence = 0;
+    qint64 m_tempCommitSequence = 0;
 
     QVector<QString> m_filesToDelete;
     QVector<SyncCache::User> m_deletedUsers;
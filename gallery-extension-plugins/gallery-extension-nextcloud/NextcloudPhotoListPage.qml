@@ -118,6 +118,7 @@ Page {
 
                 imageCache: NextcloudImageCache
                 downloadThumbnail: true
+                thumbnailSize: Theme.itemSizeMedium
                 accountId: model.accountId
                 userId: model.userId
                 albumId: model.albumId
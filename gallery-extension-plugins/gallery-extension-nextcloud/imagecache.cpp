@@ -88,7 +88,7 @@ void NextcloudImageCache::populateAlbumThumbnail(int idempToken, int accountId,
     performRequest(req);
 }
 
-void NextcloudImageCache::populatePhotoThumbnail(int idempToken, int accountId, const QString &userId, const QString &albumId, const QString &photoId, const QNetworkRequest &)
+void NextcloudImageCache::populatePhotoThumbnail(int idempToken, int accountId, const QString &userId, const QString &albumId, const QString &photoId, const QNetworkRequest &, int thumbnailSize)
 {
     PendingRequest req;
     req.idempToken = idempToken;
@@ -96,6 +96,7 @@ void NextcloudImageCache::populatePhotoThumbnail(int idempToken, int accountId,
     req.userId = userId;
     req.albumId = albumId;
     req.photoId = photoId;
+    req.thumbnailSize = thumbnailSize;
     req.type = PopulatePhotoThumbnailType;
     performRequest(req);
 }
@@ -139,7 +140,7 @@ void NextcloudImageCache::performRequests()
                 case PopulatePhotoThumbnailType:
                         SyncCache::ImageCache::populatePhotoThumbnail(
                                 req.idempToken, req.accountId, req.userId, req.albumId, req.photoId,
-                                templateRequest(req.accountId, true));
+                                templateRequest(req.accountId, true), req.thumbnailSize);
                         break;
                 case PopulatePhotoImageType:
                         SyncCache::ImageCache::populatePhotoImage(
@@ -57,7 +57,7 @@ public:
     void openDatabase(const QString &) override;
     void populateUserThumbnail(int idempToken, int accountId, const QString &userId, const QNetworkRequest &) override;
     void populateAlbumThumbnail(int idempToken, int accountId, const QString &userId, const QString &albumId, const QNetworkRequest &) override;
-    void populatePhotoThumbnail(int idempToken, int accountId, const QString &userId, const QString &albumId, const QString &photoId, const QNetworkRequest &) override;
+    void populatePhotoThumbnail(int idempToken, int accountId, const QString &userId, const QString &albumId, const QString &photoId, const QNetworkRequest &, int thumbnailSize) override;
     void populatePhotoImage(int idempToken, int accountId, const QString &userId, const QString &albumId, const QString &photoId, const QNetworkRequest &) override;
 
     enum PendingRequestType {
@@ -74,6 +74,7 @@ public:
         QString userId;
         QString albumId;
         QString photoId;
+        int thumbnailSize = SmallThumbnail;
     };
 
     QNetworkRequest templateRequest(int accountId, bool requiresBasicAuth = false) const;
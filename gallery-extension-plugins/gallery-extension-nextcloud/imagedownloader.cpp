@@ -173,6 +173,22 @@ void NextcloudImageDownloader::setDownloadThumbnail(bool v)
     }
 }
 
+int NextcloudImageDownloader::thumbnailSize() const
+{
+    return m_thumbnailSize;
+}
+
+void NextcloudImageDownloader::setThumbnailSize(int size)
+{
+    if (m_thumbnailSize != size) {
+        m_thumbnailSize = size;
+        emit thumbnailSizeChanged();
+        if (!m_deferLoad && m_downloadThumbnail) {
+            loadImage();
+        }
+    }
+}
+
 bool NextcloudImageDownloader::downloadImage() const
 {
     return m_downloadImage;
@@ -257,7 +273,7 @@ void NextcloudImageDownloader::loadImage()
                 connect(m_imageCache, &SyncCache::ImageCache::populatePhotoThumbnailFailed,
                         this, &NextcloudImageDownloader::populateFailed,
                         Qt::UniqueConnection);
-                m_imageCache->populatePhotoThumbnail(m_idempToken, m_accountId, m_userId, m_albumId, m_photoId, networkRequest);
+                m_imageCache->populatePhotoThumbnail(m_idempToken, m_accountId, m_userId, m_albumId, m_photoId, networkRequest, m_thumbnailSize);
             }
         }
     } else {
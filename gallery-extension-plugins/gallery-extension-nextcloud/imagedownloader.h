@@ -53,6 +53,7 @@ class NextcloudImageDownloader : public QObject, public QQmlParserStatus
     Q_PROPERTY(QString albumId READ albumId WRITE setAlbumId NOTIFY albumIdChanged)
     Q_PROPERTY(QString photoId READ photoId WRITE setPhotoId NOTIFY photoIdChanged)
     Q_PROPERTY(bool downloadThumbnail READ downloadThumbnail WRITE setDownloadThumbnail NOTIFY downloadThumbnailChanged)
+    Q_PROPERTY(int thumbnailSize READ thumbnailSize WRITE setThumbnailSize NOTIFY thumbnailSizeChanged)
     Q_PROPERTY(bool downloadImage READ downloadImage WRITE setDownloadImage NOTIFY downloadImageChanged)
     Q_PROPERTY(QUrl imagePath READ imagePath NOTIFY imagePathChanged)
     Q_PROPERTY(Status status READ status NOTIFY statusChanged)
@@ -90,6 +91,9 @@ public:
     bool downloadThumbnail() const;
     void setDownloadThumbnail(bool v);
 
+    int thumbnailSize() const;
+    void setThumbnailSize(int size);
+
     bool downloadImage() const;
     void setDownloadImage(bool v);
 
@@ -103,6 +107,7 @@ Q_SIGNALS:
     void albumIdChanged();
     void photoIdChanged();
     void downloadThumbnailChanged();
+    void thumbnailSizeChanged();
     void downloadImageChanged();
     void imagePathChanged();
     void statusChanged();
@@ -121,6 +126,7 @@ private:
     QString m_albumId;
     QString m_photoId;
     bool m_downloadThumbnail = false;
+    int m_thumbnailSize = SyncCache::ImageCache::SmallThumbnail;
     bool m_downloadImage = false;
     QUrl m_imagePath;
     int m_idempToken = 0;
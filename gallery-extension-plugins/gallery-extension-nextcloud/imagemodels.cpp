@@ -528,8 +528,14 @@ void NextcloudAlbumModel::setImageCache(SyncCache::ImageCache *cache)
         }
     });
 
-    connect(m_imageCache, &SyncCache::ImageCache::dataChanged,
-            this, [this] { this->loadData(); });
+    connect(m_imageCache, &SyncCache::ImageCache::dataChangedInScopes,
+            this, [this] (qint64, const QList<quint64> &scopes) {
+        // Scopes are per user, so a model not limited to one user reloads on any change.
+        if (m_accountId <= 0 || m_userId.isEmpty()
+                || scopes.contains(SyncCache::ImageDatabase::changeScope(m_accountId, m_userId))) {
+            this->loadData();
+        }
+    });
 }
 
 int NextcloudAlbumModel::accountId() const
@@ -837,8 +843,15 @@ void NextcloudPhotoModel::setImageCache(SyncCache::ImageCache *cache)
         }
     });
 
-    connect(m_imageCache, &SyncCache::ImageCache::dataChanged,
-            this, [this] { this->loadData(); });
+    connect(m_imageCache, &SyncCache::ImageCache::dataChangedInScopes,
+            this, [this] (qint64, const QList<quint64> &scopes) {
+        // Scopes are per album, so a model not limited to one album, such as the
+        // photos of all accounts, reloads on any change.
+        if (m_accountId <= 0 || m_userId.isEmpty() || m_albumId.isEmpty()
+                || scopes.contains(SyncCache::ImageDatabase::changeScope(m_accountId, m_userId, m_albumId))) {
+            this->loadData();
+        }
+    });
 }
 
 int NextcloudPhotoModel::accountId() const